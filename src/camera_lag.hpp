@@ -0,0 +1,97 @@
+#ifndef CAMERA_LAG_H
+#define CAMERA_LAG_H
+
+/**********************************************************************************
+ *
+ *  Timestamped history of the angles of the car, which the chasing cameras
+ *  follow with a delay.
+ *
+ *  The angles are kept in a ring of CAMERA_LAG_CAPACITY entries, so nothing is
+ *  moved or allocated once the ring exists. The camera reads the angle the car
+ *  had some time ago, interpolated between the two entries around that time.
+ *  The times that are read only ever grow, so the entries older than the last
+ *  one read are dropped as soon as they are passed: a push and a read cost
+ *  O(1) (amortized), whatever the frame rate. If the ring fills up (at more
+ *  than CAMERA_LAG_CAPACITY frames in the delay) the oldest entry is dropped,
+ *  and the camera lags a little less.
+ *  The history is only touched by the render thread, so it needs no locks.
+ *
+ **********************************************************************************/
+
+
+const size_t CAMERA_LAG_CAPACITY = 1024;
+
+
+// Angles (in degrees) interpolated between older and newer, with the yaw along the shortest way around
+// the wrap at +-360 degrees
+glm::vec3 mixAngles(glm::vec3 older, const glm::vec3& newer, float alpha) {
+        if (newer.y - older.y > 180.0f) {
+                older.y += 360.0f;
+        } else if (newer.y - older.y < -180.0f) {
+                older.y -= 360.0f;
+        }
+        return glm::mix(older, newer, alpha);
+}
+
+
+class CameraLag {
+public:
+        // Forgets the history: until time, and until the next pushes, the angles are all equal to angle
+        void reset(double time, const glm::vec3& angle);
+        // Appends the angles of the car at time, which must not be older than the last ones pushed
+        void push(double time, const glm::vec3& angle);
+        // The angles of the car at time, interpolated, which must not be older than the last ones sampled
+        glm::vec3 sample(double time);
+        size_t size() const { return count; }
+
+private:
+        struct Entry {
+                double time;
+                glm::vec3 angle;
+        };
+
+        std::array<Entry, CAMERA_LAG_CAPACITY> entries;
+        size_t first = 0;
+        size_t count = 0;
+
+        Entry& entry(size_t i) { return entries[(first + i) % CAMERA_LAG_CAPACITY]; }
+};
+
+
+void CameraLag::reset(double time, const glm::vec3& angle) {
+        first = 0;
+        count = 1;
+        entries[0] = Entry{time, angle};
+}
+
+void CameraLag::push(double time, const glm::vec3& angle) {
+        if (count == CAMERA_LAG_CAPACITY) {
+                first = (first + 1) % CAMERA_LAG_CAPACITY;
+                count--;
+        }
+        entry(count) = Entry{time, angle};
+        count++;
+}
+
+glm::vec3 CameraLag::sample(double time) {
+        if (count == 0) {
+                return glm::vec3(0.0f);
+        }
+
+        // the entries before the one at (or right before) time will never be read again
+        while (count >= 2 && entry(1).time <= time) {
+                first = (first + 1) % CAMERA_LAG_CAPACITY;
+                count--;
+        }
+
+        const Entry& older = entry(0);
+        if (count == 1 || time <= older.time) {
+                return older.angle;
+        }
+        const Entry& newer = entry(1);
+        float alpha = static_cast<float>((time - older.time) / (newer.time - older.time));
+        return mixAngles(older.angle, newer.angle, alpha);
+}
+
+
+#endif          // CAMERA_LAG_H
@@ -2,14 +2,83 @@
 
 #define VERTICES_NUMBER 110
 
+// Cars that the traffic instance buffer can hold
+#define MAX_CAR_INSTANCES 10000
+
+// The terrain is split into TERRAIN_TILES_PER_SIDE x TERRAIN_TILES_PER_SIDE tiles, culled one by one
+#define TERRAIN_TILES_PER_SIDE 8
+
+// Patches of the CDLOD terrain that the instance buffer can hold
+#define MAX_TERRAIN_PATCHES 4096
+
+// Steps per second of the car simulation thread
+#define DEFAULT_PHYSICS_RATE 500.0f
+
 
 struct Terrain {
         float width;
         float height;
-        std::vector<std::vector<float>> altitudes{VERTICES_NUMBER, std::vector<float>(VERTICES_NUMBER, 0.0f)};
+        Heightfield heightfield;
+
+        void init(const std::vector<Vertex>& vertices);
 };
 
 
+// Build the heightfield from the vertices of the terrain model, snapping each vertex
+// directly into its (col, row) cell: col grows with x, row grows with z.
+void Terrain::init(const std::vector<Vertex>& vertices) {
+        auto start_time = std::chrono::high_resolution_clock::now();
+
+        float map_min_x = 0.0;
+        float map_max_x = 0.0;
+        float map_min_z = 0.0;
+        float map_max_z = 0.0;
+
+        for (const auto& vertex : vertices) {
+                map_min_x = std::min(map_min_x, vertex.pos.x);
+                map_max_x = std::max(map_max_x, vertex.pos.x);
+                map_min_z = std::min(map_min_z, vertex.pos.z);
+                map_max_z = std::max(map_max_z, vertex.pos.z);
+        }
+
+        height = map_max_x - map_min_x;
+        width = map_max_z - map_min_z;
+
+        float step_x = height / (VERTICES_NUMBER - 1);
+        float step_z = width / (VERTICES_NUMBER - 1);
+        heightfield.init(VERTICES_NUMBER, VERTICES_NUMBER, glm::vec2(map_min_x, map_min_z), glm::vec2(step_x, step_z));
+
+        std::vector<bool> is_cell_filled(VERTICES_NUMBER * VERTICES_NUMBER, false);
+        int filled_cells = 0;
+
+        for (const auto& vertex : vertices) {
+                int col = static_cast<int>(std::lround((vertex.pos.x - map_min_x) / step_x));
+                int row = static_cast<int>(std::lround((vertex.pos.z - map_min_z) / step_z));
+
+                // every vertex must lie (almost) exactly on a node of the regular grid
+                if (fabs(map_min_x + col * step_x - vertex.pos.x) > 0.01 * step_x
+                    || fabs(map_min_z + row * step_z - vertex.pos.z) > 0.01 * step_z) {
+                        throw std::runtime_error("terrain model is not a regular grid!");
+                }
+
+                if (!is_cell_filled[col * VERTICES_NUMBER + row]) {
+                        is_cell_filled[col * VERTICES_NUMBER + row] = true;
+                        filled_cells++;
+                }
+                heightfield.at(col, row) = vertex.pos.y;
+        }
+
+        if (filled_cells != VERTICES_NUMBER * VERTICES_NUMBER) {
+                throw std::runtime_error("terrain model does not cover the whole heightfield!");
+        }
+
+        auto end_time = std::chrono::high_resolution_clock::now();
+        std::cout << "Terrain heightfield " << VERTICES_NUMBER << "x" << VERTICES_NUMBER << " built in "
+                  << std::chrono::duration<float, std::chrono::milliseconds::period>(end_time - start_time).count()
+                  << " ms\n";
+}
+
+
 Terrain terrain = Terrain();
 
 
@@ -39,6 +108,13 @@ struct terrainUniformBufferObject {
 };
 
 
+struct cdlodUniformBufferObject {
+        alignas(16) glm::vec4 camera_pos;                       // in the space of the terrain model
+        alignas(16) glm::vec4 heightfield;                      // origin (x, z) and spacing (x, z) of the samples
+        alignas(16) glm::vec4 morph_ranges[CDLOD_MAX_LEVELS];   // start and end of the morph of each level
+};
+
+
 class CarSimulator : public BaseProject {
 protected:
 
@@ -48,9 +124,10 @@ protected:
         DescriptorSetLayout DSLSkyBox;
 
         // Pipelines (Shader couples)
-        Pipeline P_Car;
+        // (the car and the terrain have one variant per lighting mode, see initLightingPipelines)
+        PipelineVariants P_Car;
         Pipeline P_SkyBox;
-        Pipeline P_Terrain;
+        PipelineVariants P_Terrain;
 
         // Models, textures and Descriptors (values assigned to the uniforms)
         Model M_SlCar;
@@ -60,13 +137,168 @@ protected:
         Model M_SlTerrain;
         Texture T_SlTerrain;
         DescriptorSet DS_SlTerrain;
+        BoxCuller terrainTileBoxes;     // world-space bounding boxes of the tiles of M_SlTerrain
         
         Model M_SlSkyBox;
         SkyBoxTexture T_SlSkyBox;
         DescriptorSet DS_SlSkyBox;
+        const std::vector<std::string> skyBoxFaces = {"sky/SkyBox_top.png", "sky/SkyBox_left.png", "sky/SkyBox_up.png",
+                                                      "sky/SkyBox_down.png", "sky/SkyBox_front.png", "sky/SkyBox_back.png"};
 
         DescriptorSet DS_global;
 
+        // CDLOD terrain: one grid patch instanced over the nodes of a quadtree, lifted by the height map
+        DescriptorSetLayout DSLTerrainCdlod;
+        PipelineVariants P_TerrainCdlod;
+        Model M_TerrainPatch;
+        Texture T_TerrainHeights;
+        DescriptorSet DS_TerrainCdlod;
+        InstanceBuffer IB_TerrainPatches;
+        CdlodQuadtree terrainQuadtree;
+
+        // Traffic: the cars drawn by a single instanced draw, sharing the mesh and the texture of M_SlCar
+        PipelineVariants P_CarInstanced;
+        InstanceBuffer IB_Cars;
+
+        bool uniformLighting = false;
+        uint32_t trafficCars = 0;
+        bool isBenchmarkCars = false;
+        bool isCdlodTerrain = false;
+        float physicsRate = DEFAULT_PHYSICS_RATE;
+        std::string recordFile;
+        std::string replayFile;
+        float replayStep = 0.0f;
+        std::string frameTimesFile;
+
+public:
+        // Read the lights from the uniforms at every fragment (a single pipeline for the car and one for
+        // the terrain) instead of switching between the specialized pipeline variants
+        void setUniformLighting(bool uniform) {
+                uniformLighting = uniform;
+        }
+
+        // Draw the car of the user together with other cars parked around it, all with one instanced draw
+        void setTrafficCars(uint32_t cars) {
+                trafficCars = std::min<uint32_t>(cars, MAX_CAR_INSTANCES);
+        }
+
+        // Measure the frame times with 1 to MAX_CAR_INSTANCES instanced cars, then exit
+        void setBenchmarkCars(bool benchmark) {
+                isBenchmarkCars = benchmark;
+        }
+
+        // Draw the terrain with continuous level of detail from its heightfield instead of the full .obj mesh
+        void setCdlodTerrain(bool cdlod) {
+                isCdlodTerrain = cdlod;
+        }
+
+        // Steps per second of the simulation of the car, on its own thread (0: one step per frame on the render thread)
+        void setPhysicsRate(float rate) {
+                physicsRate = rate;
+        }
+
+        // Save the keys pressed during the session to file when the window is closed
+        void setRecordFile(const std::string& file) {
+                recordFile = file;
+        }
+
+        // Replay the keys recorded in file instead of reading the keyboard, then exit
+        void setReplayFile(const std::string& file) {
+                replayFile = file;
+        }
+
+        // Advance every frame of a replay by step seconds (and the simulation of the car with it), instead of the
+        // wall clock (0: real time)
+        void setReplayStep(float step) {
+                replayStep = step;
+        }
+
+        // Write the times of each frame of the replay to file, as CSV
+        void setFrameTimesFile(const std::string& file) {
+                frameTimesFile = file;
+        }
+
+        // Drive the car runs times through the commands of driveFile (- for the standard input, see headless_drive.hpp)
+        // with steps of dt seconds, without a window or a device; false if the runs took different trajectories, or
+        // a trajectory other than expectedHash (the hash printed by a reference run, to compare builds and machines)
+        bool runHeadlessDrive(const std::string& driveFile, float dt, int runs, const std::string& trajectoryFile,
+                              std::optional<uint64_t> expectedHash) {
+                std::vector<DriveCommand> commands;
+                if (driveFile == "-") {
+                        commands = parseDriveCommands(std::cin, dt);
+                } else {
+                        std::ifstream input(driveFile);
+                        if (!input) {
+                                throw std::runtime_error("failed to open drive " + driveFile + "!");
+                        }
+                        commands = parseDriveCommands(input, dt);
+                }
+
+                Model terrainModel;
+                terrainModel.load("models/Terrain.obj");
+                terrain.init(terrainModel.vertices);
+
+                float simulatedTime = commands.back().step * dt;
+                float bestTime = std::numeric_limits<float>::max();
+                uint64_t firstHash = 0;
+                bool isDeterministic = true;
+                Car drive_car;
+
+                for (int run = 0; run < runs; run++) {
+                        std::ofstream trajectory;
+                        if (run == 0 && !trajectoryFile.empty()) {
+                                trajectory.open(trajectoryFile);
+                                if (!trajectory) {
+                                        throw std::runtime_error("failed to open trajectory " + trajectoryFile + "!");
+                                }
+                        }
+
+                        drive_car = Car();
+                        auto start_time = std::chrono::high_resolution_clock::now();
+                        uint64_t hash = run_drive(drive_car, commands, dt, trajectory.is_open() ? &trajectory : nullptr);
+                        auto end_time = std::chrono::high_resolution_clock::now();
+
+                        // the run writing the trajectory is not timed
+                        if (!trajectory.is_open()) {
+                                bestTime = std::min(bestTime, std::chrono::duration<float>(end_time - start_time).count());
+                        }
+                        if (run == 0) {
+                                firstHash = hash;
+                        } else if (hash != firstHash) {
+                                isDeterministic = false;
+                        }
+                }
+
+                std::cout << std::fixed << std::setprecision(3)
+                          << "Drive of " << simulatedTime << " s in " << commands.back().step << " steps of " << dt * 1000.0f << " ms, "
+                          << runs << " runs\n"
+                          << "  final car:   x=" << drive_car.pos.x << "  y=" << drive_car.pos.y << "  z=" << drive_car.pos.z
+                          << "  yaw=" << drive_car.angle.y << "  speed=" << drive_car.lin_speed << "\n"
+                          << "  trajectory:  " << std::hex << std::setw(16) << std::setfill('0') << firstHash
+                          << std::dec << std::setfill(' ') << (isDeterministic ? " (identical in every run)" : " (DIFFERENT between runs)") << "\n";
+                if (bestTime < std::numeric_limits<float>::max()) {
+                        std::cout << "  speed:       " << std::setprecision(0) << simulatedTime / bestTime
+                                  << " simulated s per wall s (best run: " << std::setprecision(3) << bestTime * 1000.0f << " ms)\n";
+                }
+                std::cout << std::defaultfloat;
+
+                bool isExpected = !expectedHash || *expectedHash == firstHash;
+                if (!isExpected) {
+                        std::cout << "  expected:    " << std::hex << std::setw(16) << std::setfill('0') << *expectedHash
+                                  << std::dec << std::setfill(' ') << " (DIFFERENT trajectory)\n";
+                }
+                return isDeterministic && isExpected;
+        }
+
+protected:
+
+        bool isRecording() const {
+                return !recordFile.empty();
+        }
+
+        bool isReplay() const {
+                return !replayFile.empty();
+        }
 
         void setWindowParameters() {
                 windowWidth = 800;
@@ -75,19 +307,12 @@ protected:
                 initialBackgroundColor = {1.0f, 1.0f, 1.0f, 1.0f};
 
                 // Descriptor pool sizes
-                uniformBlocksInPool = 5; //con 8 compila senza errori, 3 è il valore prima dello skybox
+                uniformBlocksInPool = 6; //con 8 compila senza errori, 3 è il valore prima dello skybox
                 texturesInPool = 8; //con 8 compila senza errori, 2 è il valore prima dello skybox
                 setsInPool = 5; //con 8 compila senza errori, 3 è il valore prima dello skybox
         }
 
 
-        // Function used to compare two vec3.
-        static bool isP1beforeP2(glm::vec3 p1, glm::vec3 p2) {
-                return ((p1.x < p2.x)
-                        || ((fabs(p1.x - p2.x) < 0.0001) && (p1.z < p2.z)));
-        }
-
-
         void recreateSwapChainDSInit() {
 
                 DS_SlCar.init(this, &DSLobj, {
@@ -105,16 +330,88 @@ protected:
                 DS_global.init(this, &DSLglobal, {
                                         {0, UNIFORM, sizeof(globalUniformBufferObject), nullptr}});
 
+                if (isInstanced()) {
+                        IB_Cars.init(this, MAX_CAR_INSTANCES);
+                }
+                if (isCdlodTerrain) {
+                        initTerrainCdlodDS();
+                }
+        }
+
+
+        void initTerrainCdlodDS() {
+                DS_TerrainCdlod.init(this, &DSLTerrainCdlod, {
+                                        {0, UNIFORM, sizeof(terrainUniformBufferObject), nullptr},
+                                        {1, TEXTURE, 0, &T_SlTerrain},
+                                        {2, TEXTURE, 0, &T_TerrainHeights},
+                                        {3, UNIFORM, sizeof(cdlodUniformBufferObject), nullptr}});
+                IB_TerrainPatches.init(this, MAX_TERRAIN_PATCHES);
         }
 
 
         void recreateSwapChainPipelinesInit() {
-                P_Car.init(this, "shaders/carVert.spv", "shaders/carFrag.spv", {&DSLglobal, &DSLobj}, VK_COMPARE_OP_LESS);
-                P_Terrain.init(this, "shaders/terrainVert.spv", "shaders/terrainFrag.spv", {&DSLglobal, &DSLobj}, VK_COMPARE_OP_LESS);
+                initLightingPipelines();
                 P_SkyBox.init(this, "shaders/skyBoxVert.spv", "shaders/skyBoxFrag.spv", {&DSLglobal, &DSLSkyBox}, VK_COMPARE_OP_LESS_OR_EQUAL);
         }
 
 
+        // The lights are fixed in each variant by the specialization constants of the fragment shaders
+        // {lighting from uniforms, spotlight on, headlights on}: the terrain has a variant for each lighting
+        // mode (bit 0 spotlight, bit 1 headlights) and the car, which the headlights do not light, one for
+        // each state of the spotlight. With uniform lighting there is a single variant reading the uniforms.
+        void initLightingPipelines() {
+                std::vector<std::vector<int32_t>> carConstants;
+                std::vector<std::vector<int32_t>> terrainConstants;
+                if (uniformLighting) {
+                        carConstants = {{1}};
+                        terrainConstants = {{1}};
+                } else {
+                        carConstants = {{0, 0}, {0, 1}};
+                        for (int32_t mode = 0; mode < 4; mode++) {
+                                terrainConstants.push_back({0, mode & 1, mode >> 1});
+                        }
+                }
+
+                P_Car.init(this, "shaders/carVert.spv", "shaders/carFrag.spv", {&DSLglobal, &DSLobj},
+                           VK_COMPARE_OP_LESS, carConstants);
+                P_Terrain.init(this, "shaders/terrainVert.spv", "shaders/terrainFrag.spv", {&DSLglobal, &DSLobj},
+                               VK_COMPARE_OP_LESS, terrainConstants);
+                if (isInstanced()) {
+                        P_CarInstanced.init(this, "shaders/carInstancedVert.spv", "shaders/carFrag.spv", {&DSLglobal, &DSLobj},
+                                            VK_COMPARE_OP_LESS, carConstants, true);
+                }
+                if (isCdlodTerrain) {
+                        P_TerrainCdlod.init(this, "shaders/terrainCdlodVert.spv", "shaders/terrainFrag.spv",
+                                            {&DSLglobal, &DSLTerrainCdlod}, VK_COMPARE_OP_LESS, terrainConstants, true);
+                }
+        }
+
+
+        bool isInstanced() {
+                return trafficCars > 0 || isBenchmarkCars;
+        }
+
+
+        // Index of the terrain variant for the current lighting mode (0 with uniform lighting)
+        uint32_t lightingMode() {
+                return uniformLighting ? 0 : (spotlight_on | (headlights_on << 1));
+        }
+
+
+        // Models and textures are decoded on worker threads while the Vulkan objects are being created
+        void localRequestAssets() {
+                assetLoader.requestModel("models/Hummer.obj");
+                assetLoader.requestModel("models/SkyBox.obj");
+                assetLoader.requestModel("models/Terrain.obj");
+
+                assetLoader.requestTexture("textures/Hummer.png");
+                assetLoader.requestTexture("textures/Terrain.png");
+                for (const auto& face : skyBoxFaces) {
+                        assetLoader.requestTexture(TEXTURE_PATH + face);
+                }
+        }
+
+
         void localInit() {
                 // Descriptor Layouts (what will be passed to the shaders)
                 DSLobj.init(this, {
@@ -122,23 +419,30 @@ protected:
                                 // first  element : the binding number
                                 // second element : the time of element (buffer or texture)
                                 // third  element : the pipeline stage where it will be used
-                                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS},
+                                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS},
                                 {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}
                 });
 
                 DSLglobal.init(this, {
-                                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_ALL_GRAPHICS}
+                                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS}
                 });
                 
                 DSLSkyBox.init(this, {
-                                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT},
+                                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT},
                                 {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT}
                 });
 
+                // the terrain bindings, plus the height map and the CDLOD parameters read by the vertex shader
+                DSLTerrainCdlod.init(this, {
+                                {0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_ALL_GRAPHICS},
+                                {1, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT},
+                                {2, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_VERTEX_BIT},
+                                {3, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, VK_SHADER_STAGE_VERTEX_BIT}
+                });
+
                 // Pipelines (Shader couples)
                 // The last array is a vector of pointer to the layouts of the sets that will be used in the pipeline
-                P_Car.init(this, "shaders/carVert.spv", "shaders/carFrag.spv", {&DSLglobal, &DSLobj}, VK_COMPARE_OP_LESS);
-                P_Terrain.init(this, "shaders/terrainVert.spv", "shaders/terrainFrag.spv", {&DSLglobal, &DSLobj}, VK_COMPARE_OP_LESS);
+                initLightingPipelines();
                 P_SkyBox.init(this, "shaders/skyBoxVert.spv", "shaders/skyBoxFrag.spv", {&DSLglobal, &DSLSkyBox}, VK_COMPARE_OP_LESS_OR_EQUAL);
 
                 // Models, textures and Descriptors (values assigned to the uniforms)
@@ -154,86 +458,74 @@ protected:
                 });
 
                 M_SlSkyBox.init(this, "models/SkyBox.obj");
-                T_SlSkyBox.init(this, {"sky/SkyBox_top.png", "sky/SkyBox_left.png", "sky/SkyBox_up.png", "sky/SkyBox_down.png", "sky/SkyBox_front.png", "sky/SkyBox_back.png"});
+                T_SlSkyBox.init(this, skyBoxFaces);
                 DS_SlSkyBox.initDSSkyBox(this, &DSLSkyBox, {
                                 {0, UNIFORM, sizeof(skyboxUniformBufferObject), nullptr},
                                 {1, TEXTURE, 0, &T_SlSkyBox}});
 
-                M_SlTerrain.init(this, "models/Terrain.obj");
+                M_SlTerrain.init(this, "models/Terrain.obj", TERRAIN_TILES_PER_SIDE);
+                for (const auto& tile : M_SlTerrain.tiles) {
+                        terrainTileBoxes.add(tile.boundingBoxMin, tile.boundingBoxMax, compute_terrain_model());
+                }
                 T_SlTerrain.init(this, "textures/Terrain.png");
                 DS_SlTerrain.init(this, &DSLobj, {
                                 {0, UNIFORM, sizeof(terrainUniformBufferObject), nullptr},
                                 {1, TEXTURE, 0, &T_SlTerrain}});
 
 
-                float map_min_x = 0.0;
-                float map_max_x = 0.0;
-                float map_min_z = 0.0;
-                float map_max_z = 0.0;
-
-                std::vector<glm::vec3> terrain_points;
-
-                for (int i = 0; i < std::size(M_SlTerrain.vertices); i++) {
-
-                        if (M_SlTerrain.vertices[i].pos.x < map_min_x) {
-                                map_min_x = M_SlTerrain.vertices[i].pos.x;
-                        } else if (M_SlTerrain.vertices[i].pos.x > map_max_x) {
-                                map_max_x = M_SlTerrain.vertices[i].pos.x;
-                        }
-
-                        if (M_SlTerrain.vertices[i].pos.z < map_min_z) {
-                                map_min_z = M_SlTerrain.vertices[i].pos.z;
-                        } else if (M_SlTerrain.vertices[i].pos.z > map_max_z) {
-                                map_max_z = M_SlTerrain.vertices[i].pos.z;
-                        }
+                terrain.init(M_SlTerrain.vertices);
+                if (isCdlodTerrain) {
+                        initTerrainCdlod();
+                }
+                if (isReplay()) {
+                        input_recording.load(replayFile);
+                }
+                start_simulation();
 
-                        // Store the unique values of all the vertices, discarding the repeated ones.
-                        bool is_point_present = false;
-                        for (int j = 0; j < terrain_points.size(); j++) {
-                                if (terrain_points[j].x == M_SlTerrain.vertices[i].pos.x && terrain_points[j].z == M_SlTerrain.vertices[i].pos.z) {
-                                        is_point_present = true;
-                                }
-                        }
-                        
-                        if (!is_point_present){
-                        	glm::vec3 point = {M_SlTerrain.vertices[i].pos.x, M_SlTerrain.vertices[i].pos.y, M_SlTerrain.vertices[i].pos.z};
-                                terrain_points.push_back(point);
-                        }
+                DS_global.init(this, &DSLglobal, {
+                                                {0, UNIFORM, sizeof(globalUniformBufferObject), nullptr}});
 
+                if (isInstanced()) {
+                        IB_Cars.init(this, MAX_CAR_INSTANCES);
                 }
-
-                // Reorder Points vector using comparePoints (declared above) static function.
-                sort(terrain_points.begin(), terrain_points.end(), isP1beforeP2);
-
-                int col = 0;
-                int row = 0;
-
-                // Fill terrain.altitudes vector.
-                for (int i = 0; i < terrain_points.size(); i++) {
-            		terrain.altitudes[col][row] = terrain_points[i].y;
-            		if (row < VERTICES_NUMBER - 1) {
-            			row++;
-            		} else {
-            			col++;
-            			row = 0;
-            		}
+                if (isCdlodTerrain) {
+                        initTerrainCdlodDS();
                 }
-				
-                terrain.height = map_max_x - map_min_x;
-                terrain.width = map_max_z - map_min_z;
+        }
 
 
-                DS_global.init(this, &DSLglobal, {
-                                                {0, UNIFORM, sizeof(globalUniformBufferObject), nullptr}});
+        // The height map holds Terrain::heightfield, one sample per texel (sample (col, row) at texel (col, row))
+        void initTerrainCdlod() {
+                const Heightfield& heightfield = terrain.heightfield;
+                const std::vector<float>& heights = heightfield.getSamples();
+
+                terrainQuadtree.init(heights, heightfield.getSamplesX(), heightfield.getSamplesZ(),
+                                     heightfield.getOrigin(), heightfield.getSpacing());
+                T_TerrainHeights.initHeightMap(this, heights, heightfield.getSamplesX(), heightfield.getSamplesZ());
+
+                std::vector<Vertex> patchVertices;
+                std::vector<uint32_t> patchIndices;
+                buildCdlodPatch(patchVertices, patchIndices);
+                M_TerrainPatch.initMesh(this, patchVertices, patchIndices);
         }
 
 
         void localCleanup() {
+                simulation.stop();
+                if (isRecording()) {
+                        input_recording.save(recordFile, input_time);
+                }
+
                 T_SlCar.cleanup();
                 M_SlCar.cleanup();
 
                 T_SlTerrain.cleanup();
                 M_SlTerrain.cleanup();    
+
+                if (isCdlodTerrain) {
+                        T_TerrainHeights.cleanup();
+                        M_TerrainPatch.cleanup();
+                }
                 
                 T_SlSkyBox.cleanup();
                 M_SlSkyBox.cleanup();
@@ -241,6 +533,7 @@ protected:
                 DSLglobal.cleanup();
                 DSLobj.cleanup();
                 DSLSkyBox.cleanup();
+                DSLTerrainCdlod.cleanup();
         }
 
 
@@ -249,6 +542,9 @@ protected:
         		DS_SlTerrain.cleanup();
         		DS_SlSkyBox.cleanup();
         		DS_global.cleanup();      		
+        		IB_Cars.cleanup();
+        		DS_TerrainCdlod.cleanup();
+        		IB_TerrainPatches.cleanup();
         }
         
 
@@ -256,67 +552,62 @@ protected:
                 P_SkyBox.cleanup();
                 P_Car.cleanup();
                 P_Terrain.cleanup();
+                P_CarInstanced.cleanup();
+                P_TerrainCdlod.cleanup();
         }
 
 
-        // Here it is the creation of the command buffer:
+        // Here it is the list of the draw calls:
         // you send to the GPU all the objects you want to draw, with their buffers and textures.
-        void populateCommandBuffer(VkCommandBuffer commandBuffer, int currentImage) {
-
-                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, P_Car.graphicsPipeline);
-                vkCmdBindDescriptorSets(commandBuffer,
-                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                        P_Car.pipelineLayout, 0, 1, &DS_global.descriptorSets[currentImage],
-                                        0, nullptr);
-
-                VkBuffer vertexBuffers[] = {M_SlCar.vertexBuffer};
-                // property .vertexBuffer of models, contains the VkBuffer handle to its vertex buffer
-                VkDeviceSize offsets[] = {0};
-                vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-                // property .indexBuffer of models, contains the VkBuffer handle to its index buffer
-                vkCmdBindIndexBuffer(commandBuffer, M_SlCar.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-
-                // property .pipelineLayout of a pipeline contains its layout.
-                // property .descriptorSets of a descriptor set contains its elements.
-                vkCmdBindDescriptorSets(commandBuffer,
-                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                        P_Car.pipelineLayout, 1, 1, &DS_SlCar.descriptorSets[currentImage],
-                                        0, nullptr);
-
-                // property .indices.size() of models, contains the number of triangles * 3 of the mesh.
-                vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(M_SlCar.indices.size()), 1, 0, 0, 0);
-
-				vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, P_Terrain.graphicsPipeline);
-                VkBuffer vertexBuffers2[] = {M_SlTerrain.vertexBuffer};
-                VkDeviceSize offsets2[] = {0};
-                vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers2, offsets2);
-                vkCmdBindIndexBuffer(commandBuffer, M_SlTerrain.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-                vkCmdBindDescriptorSets(commandBuffer,
-                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                        P_Terrain.pipelineLayout, 0, 1, &DS_global.descriptorSets[currentImage],
-                                        0, nullptr);
-                vkCmdBindDescriptorSets(commandBuffer,
-                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                        P_Terrain.pipelineLayout, 1, 1, &DS_SlTerrain.descriptorSets[currentImage],
-                                        0, nullptr);
-                vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(M_SlTerrain.indices.size()), 1, 0, 0, 0);
-                                 
-                                 
-                                 
-                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, P_SkyBox.graphicsPipeline);
-                VkBuffer vertexBuffers3[] = {M_SlSkyBox.vertexBuffer};
-                VkDeviceSize offsets3[] = {0};
-                vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers3, offsets3);
-                vkCmdBindIndexBuffer(commandBuffer, M_SlSkyBox.indexBuffer, 0, VK_INDEX_TYPE_UINT32);
-                vkCmdBindDescriptorSets(commandBuffer,
-                                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                        P_SkyBox.pipelineLayout, 0, 1, &DS_global.descriptorSets[currentImage],
-                                        0, nullptr);
-                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
-                                        P_SkyBox.pipelineLayout, 1, 1, &DS_SlSkyBox.descriptorSets[currentImage],
-                                        0, nullptr);
-                vkCmdDrawIndexed(commandBuffer, static_cast<uint32_t>(M_SlSkyBox.indices.size()), 1, 0, 0, 0);
+        void populateRenderQueue(RenderQueue& renderQueue) {
+                // recorded every frame, so the variants always match the lights
+                uint32_t mode = lightingMode();
+
+                // - first  element : the pipeline
+                // - second element : the descriptor sets, bound from set 0
+                // - third  element : the model, whose vertex and index buffers are drawn
+                // - fourth element : the number of instances
+                // - fifth  element : the buffer with the per-instance data, for the instanced draws
+                // - then, optionally, the range of the index buffer to draw (by default the whole model)
+                //   and the first instance read from the instance buffer
+                // then the layer and the distance from the camera, which decide the order of the draws
+                if (isInstanced()) {
+                        renderQueue.submit({&P_CarInstanced[mode & 1], {&DS_global, &DS_SlCar}, &M_SlCar, car_count, &IB_Cars},
+                                           LAYER_OPAQUE, glm::distance(camera_pos, car.pos));
+                } else {
+                        renderQueue.submit({&P_Car[mode & 1], {&DS_global, &DS_SlCar}, &M_SlCar, 1},
+                                           LAYER_OPAQUE, glm::distance(camera_pos, car.pos));
+                }
 
+                if (isCdlodTerrain) {
+                        // one instanced draw for the whole patches and one for each quarter
+                        for (uint32_t part = 0; part < CDLOD_PATCH_PARTS; part++) {
+                                if (terrain_patch_counts[part] == 0) {
+                                        continue;
+                                }
+                                uint32_t firstIndex, indexCount;
+                                cdlodPatchPart(part, firstIndex, indexCount);
+                                renderQueue.submit({&P_TerrainCdlod[mode], {&DS_global, &DS_TerrainCdlod}, &M_TerrainPatch,
+                                                    terrain_patch_counts[part], &IB_TerrainPatches,
+                                                    firstIndex, indexCount, terrain_patch_offsets[part]},
+                                                   LAYER_OPAQUE, 0.0f);
+                        }
+                } else {
+                        // only the tiles of the terrain that can be in the view are drawn, nearest first
+                        terrainTileBoxes.cull(Frustum::fromMatrix(camera_view_proj), visible_terrain_tiles);
+                        glm::mat4 terrainModel = compute_terrain_model();
+                        for (uint32_t tile : visible_terrain_tiles) {
+                                const ModelTile& modelTile = M_SlTerrain.tiles[tile];
+                                glm::vec3 centre = glm::vec3(terrainModel * glm::vec4((modelTile.boundingBoxMin
+                                                                                        + modelTile.boundingBoxMax) / 2.0f, 1.0f));
+                                renderQueue.submit({&P_Terrain[mode], {&DS_global, &DS_SlTerrain}, &M_SlTerrain, 1, nullptr,
+                                                    modelTile.firstIndex, modelTile.indexCount},
+                                                   LAYER_OPAQUE, glm::distance(camera_pos, centre));
+                        }
+                }
+
+                renderQueue.submit({&P_SkyBox, {&DS_global, &DS_SlSkyBox}, &M_SlSkyBox, 1},
+                                   LAYER_BACKGROUND, 0.0f);
         }
 
 
@@ -333,11 +624,134 @@ protected:
 };
 
 
-int main() {
+#include "self_checks.hpp"
+
+
+int main(int argc, char* argv[]) {
         CarSimulator car_simulator;
 
         try {
+                // ./car_simulator --benchmark-obj [runs]: compare the .obj parsers, without opening a window
+                if (argc > 1 && std::string(argv[1]) == "--benchmark-obj") {
+                        int runs = (argc > 2) ? std::max(1, atoi(argv[2])) : 5;
+                        benchmarkObjLoading({"models/Hummer.obj", "models/Terrain.obj"}, runs);
+                        return EXIT_SUCCESS;
+                }
+
+                // ./car_simulator --check-model-dedup: check that the deduplicated models draw the same triangles as the .obj files
+                if (argc > 1 && std::string(argv[1]) == "--check-model-dedup") {
+                        return checkModelDedup({"models/Hummer.obj", "models/Terrain.obj", "models/SkyBox.obj"})
+                               ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+
+                // ./car_simulator --check-cdlod [samples]: check and time the CDLOD quadtree of a synthetic heightfield, without opening a window
+                if (argc > 1 && std::string(argv[1]) == "--check-cdlod") {
+                        uint32_t samples = (argc > 2) ? std::max(2, atoi(argv[2])) : 4097;
+                        return checkCdlodQuadtree(samples) ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+
+                // ./car_simulator --benchmark-heightfield [queries]: check and time the terrain height queries, without opening a window
+                if (argc > 1 && std::string(argv[1]) == "--benchmark-heightfield") {
+                        size_t queries = (argc > 2) ? std::max(1, atoi(argv[2])) : 1000000;
+                        Model terrainModel;
+                        terrainModel.load("models/Terrain.obj");
+                        terrain.init(terrainModel.vertices);
+                        return benchmarkHeightfield(terrain.heightfield, queries, 5) ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+
+                // ./car_simulator --benchmark-camera-lag: check and time the delay of the chasing cameras, without opening a window
+                if (argc > 1 && std::string(argv[1]) == "--benchmark-camera-lag") {
+                        return benchmarkCameraLag(CAMERA_LAG, 60.0f) ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+
+                // ./car_simulator --headless DRIVE [--dt S] [--runs N] [--trajectory FILE] [--expect-hash HEX]:
+                // simulate a scripted drive (- for the standard input) without a window or a GPU, see headless_drive.hpp
+                if (argc > 1 && std::string(argv[1]) == "--headless") {
+                        if (argc < 3) {
+                                throw std::runtime_error("--headless needs a drive!");
+                        }
+                        float dt = 1.0f / DEFAULT_PHYSICS_RATE;
+                        int runs = 3;
+                        std::string trajectoryFile;
+                        std::optional<uint64_t> expectedHash;
+                        for (int i = 3; i < argc; i += 2) {
+                                std::string option = argv[i];
+                                if (i + 1 >= argc) {
+                                        throw std::runtime_error("missing value of " + option + "!");
+                                }
+                                std::string value = argv[i + 1];
+                                size_t parsed = 0;
+                                try {
+                                        if (option == "--dt") {
+                                                dt = std::stof(value, &parsed);
+                                        } else if (option == "--runs") {
+                                                runs = std::stoi(value, &parsed);
+                                        } else if (option == "--trajectory") {
+                                                trajectoryFile = value;
+                                                parsed = value.size();
+                                        } else if (option == "--expect-hash") {
+                                                expectedHash = std::stoull(value, &parsed, 16);
+                                        } else {
+                                                throw std::runtime_error("unknown option " + option + " of --headless!");
+                                        }
+                                } catch (const std::logic_error&) {
+                                        parsed = 0;
+                                }
+                                if (parsed != value.size() || value.empty() || !(dt > 0.0f) || !std::isfinite(dt) || runs < 1) {
+                                        throw std::runtime_error("invalid value " + value + " of " + option + "!");
+                                }
+                        }
+                        return car_simulator.runHeadlessDrive(argv[2], dt, runs, trajectoryFile, expectedHash)
+                               ? EXIT_SUCCESS : EXIT_FAILURE;
+                }
+
+                // ./car_simulator --host-visible-geometry: keep the models in host-visible memory
+                // ./car_simulator --uniform-lighting: branch on the light uniforms instead of using pipeline variants
+                // ./car_simulator --recording-threads N: record the draw list on N threads at most
+                // ./car_simulator --benchmark-recording: time the recording of 1k...50k draws, then exit
+                // ./car_simulator --check-geometry-upload: read back the vertex and index buffers uploaded to the GPU, then exit
+                // ./car_simulator --cars N: draw N cars (the user's one and N-1 parked) with one instanced draw
+                // ./car_simulator --benchmark-cars: frame times with 1...10000 instanced cars, then exit
+                // ./car_simulator --cdlod-terrain: draw the terrain with continuous level of detail from its heightfield
+                // ./car_simulator --physics-rate HZ: steps per second of the car simulation (0: one step per frame)
+                // ./car_simulator --record FILE: save the keys pressed to FILE when the window is closed
+                // ./car_simulator --replay FILE: replay the keys of FILE in real time, then exit
+                // ./car_simulator --replay-step S: advance every frame of the replay by S seconds instead of the wall clock
+                // ./car_simulator --frame-times FILE: write the times of each frame of the replay to FILE
+                for (int i = 1; i < argc; i++) {
+                        if (std::string(argv[i]) == "--host-visible-geometry") {
+                                car_simulator.setHostVisibleGeometry(true);
+                        } else if (std::string(argv[i]) == "--uniform-lighting") {
+                                car_simulator.setUniformLighting(true);
+                        } else if (std::string(argv[i]) == "--recording-threads" && i + 1 < argc) {
+                                car_simulator.setRecordingThreads(std::max(1, atoi(argv[++i])));
+                        } else if (std::string(argv[i]) == "--benchmark-recording") {
+                                car_simulator.setBenchmarkRecording(true);
+                        } else if (std::string(argv[i]) == "--check-geometry-upload") {
+                                car_simulator.setCheckGeometryUpload(true);
+                        } else if (std::string(argv[i]) == "--cars" && i + 1 < argc) {
+                                car_simulator.setTrafficCars(std::max(1, atoi(argv[++i])));
+                        } else if (std::string(argv[i]) == "--benchmark-cars") {
+                                car_simulator.setBenchmarkCars(true);
+                        } else if (std::string(argv[i]) == "--cdlod-terrain") {
+                                car_simulator.setCdlodTerrain(true);
+                        } else if (std::string(argv[i]) == "--physics-rate" && i + 1 < argc) {
+                                car_simulator.setPhysicsRate(std::max(0.0f, static_cast<float>(atof(argv[++i]))));
+                        } else if (std::string(argv[i]) == "--record" && i + 1 < argc) {
+                                car_simulator.setRecordFile(argv[++i]);
+                        } else if (std::string(argv[i]) == "--replay" && i + 1 < argc) {
+                                car_simulator.setReplayFile(argv[++i]);
+                        } else if (std::string(argv[i]) == "--replay-step" && i + 1 < argc) {
+                                car_simulator.setReplayStep(std::max(0.0f, static_cast<float>(atof(argv[++i]))));
+                        } else if (std::string(argv[i]) == "--frame-times" && i + 1 < argc) {
+                                car_simulator.setFrameTimesFile(argv[++i]);
+                        }
+                }
+
                 car_simulator.run();
+                if (!car_simulator.isCheckPassed()) {
+                        return EXIT_FAILURE;
+                }
         } catch (const std::exception& e) {
                 std::cerr << e.what() << std::endl;
                 return EXIT_FAILURE;
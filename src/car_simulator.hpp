@@ -16,6 +16,18 @@
 #include <fstream>
 #include <array>
 #include <iomanip>
+#include <unordered_map>
+#include <map>
+#include <memory>
+#include <future>
+#include <deque>
+#include <functional>
+#include <atomic>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define GLM_FORCE_RADIANS
 #define GLM_FORCE_DEFAULT_ALIGNED_GENTYPES
@@ -28,15 +40,37 @@
 #define TINYOBJLOADER_IMPLEMENTATION
 #include <tiny_obj_loader.h>
 
+#include "obj_loader.hpp"
+
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
 
 const std::string TEXTURE_PATH = "textures/";
 
+// Bump whenever Vertex or the .meshbin layout changes, so that old caches are rebuilt
+const uint32_t MESH_CACHE_VERSION = 1;
+
+// Pipeline cache kept between runs, discarded whenever the GPU or its driver change
+const std::string PIPELINE_CACHE_FILE = "pipeline_cache.bin";
+const uint32_t PIPELINE_CACHE_VERSION = 1;
+
 
 const int MAX_FRAMES_IN_FLIGHT = 2;
 
+// Number of frame times logged before and after each swapchain recreation
+const int RESIZE_TRACE_FRAMES = 5;
+
+// Seconds between two reports of the command buffer recording times
+const float RECORDING_REPORT_PERIOD = 5.0f;
+
+// Draw list sizes of --benchmark-recording, and runs of each measure (the best one is kept)
+const std::vector<size_t> RECORDING_BENCHMARK_DRAWS = {1000, 5000, 10000, 50000};
+const int RECORDING_BENCHMARK_RUNS = 5;
+
+// Vertices of the buffers uploaded and read back by --check-geometry-upload (the indices are 3 per vertex)
+const size_t GEOMETRY_CHECK_VERTICES = 100000;
+
 const std::vector<const char*> validationLayers = {
                 "VK_LAYER_KHRONOS_validation"
 };
@@ -81,8 +115,73 @@ struct Vertex {
 
                 return attributeDescriptions;
         }
+
+        bool operator==(const Vertex& other) const {
+                return pos == other.pos && norm == other.norm && texCoord == other.texCoord;
+        }
+};
+
+// Per-instance attributes of the instanced pipelines, read from vertex binding 1
+// (the model matrix at locations 3 to 6, the flags at location 7)
+struct InstanceData {
+        glm::mat4 model;
+        uint32_t flags;
+
+        static VkVertexInputBindingDescription getBindingDescription() {
+                VkVertexInputBindingDescription bindingDescription{};
+                bindingDescription.binding = 1;
+                bindingDescription.stride = sizeof(InstanceData);
+                bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+                return bindingDescription;
+        }
+
+        static std::array<VkVertexInputAttributeDescription, 5>
+        getAttributeDescriptions() {
+                std::array<VkVertexInputAttributeDescription, 5>
+                                attributeDescriptions{};
+
+                // a mat4 takes one location per column
+                for (uint32_t column = 0; column < 4; column++) {
+                        attributeDescriptions[column].binding = 1;
+                        attributeDescriptions[column].location = 3 + column;
+                        attributeDescriptions[column].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+                        attributeDescriptions[column].offset = offsetof(InstanceData, model) + column * sizeof(glm::vec4);
+                }
+
+                attributeDescriptions[4].binding = 1;
+                attributeDescriptions[4].location = 7;
+                attributeDescriptions[4].format = VK_FORMAT_R32_UINT;
+                attributeDescriptions[4].offset = offsetof(InstanceData, flags);
+
+                return attributeDescriptions;
+        }
 };
 
+// Hash of a Vertex, used to merge the repeated (pos, norm, texCoord) tuples of an .obj file
+namespace std {
+        template<> struct hash<Vertex> {
+                size_t operator()(const Vertex& vertex) const {
+                        const float components[8] = {
+                                        vertex.pos.x, vertex.pos.y, vertex.pos.z,
+                                        vertex.norm.x, vertex.norm.y, vertex.norm.z,
+                                        vertex.texCoord.x, vertex.texCoord.y
+                        };
+
+                        size_t seed = 0;
+                        for (float component : components) {
+                                // +0.0f and -0.0f compare equal, so they must also hash equal
+                                uint32_t bits = 0;
+                                if (component != 0.0f) {
+                                        memcpy(&bits, &component, sizeof(bits));
+                                }
+                                seed ^= bits + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+                        }
+                        return seed;
+                }
+        };
+}
+
 
 // Lesson 13
 struct QueueFamilyIndices {
@@ -175,38 +274,114 @@ void PrintVkError( VkResult result ) {
         std::cout << "Error: " << result << ", " << meaning << "\n";
 }
 
+#include "gpu_allocator.hpp"
+#include "draw_recorder.hpp"
+#include "frustum.hpp"
+#include "heightfield.hpp"
+#include "cdlod_terrain.hpp"
+#include "fixed_step_simulation.hpp"
+#include "camera_lag.hpp"
+#include "headless_drive.hpp"
+#include "input_recording.hpp"
+
 class BaseProject;
 
+// FNV-1a hash of the payload of the cache files, used to detect truncated or corrupted caches
+static uint64_t cacheChecksum(const unsigned char* data, size_t size) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (size_t i = 0; i < size; i++) {
+                hash = (hash ^ data[i]) * 0x100000001b3ULL;
+        }
+        return hash;
+}
+
+// Header of the binary .meshbin cache written next to each .obj model,
+// followed by the vertex array and then by the index array
+struct MeshCacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t vertexSize;
+        uint64_t sourceSize;
+        int64_t sourceModificationTime;
+        uint64_t vertexCount;
+        uint64_t indexCount;
+        glm::vec3 boundingBoxMin;
+        glm::vec3 boundingBoxMax;
+        uint64_t checksum;
+};
+
+// Header of the pipeline cache file, followed by the data of vkGetPipelineCacheData
+struct PipelineCacheHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t vendorID;
+        uint32_t deviceID;
+        uint32_t driverVersion;
+        uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+        uint64_t dataSize;
+        uint64_t checksum;
+};
+
+// Range of the index buffer with the triangles of one tile of a model, and their bounding box
+struct ModelTile {
+        uint32_t firstIndex;
+        uint32_t indexCount;
+        glm::vec3 boundingBoxMin;
+        glm::vec3 boundingBoxMax;
+};
+
 struct Model {
         BaseProject *BP;
         std::vector<Vertex> vertices;
         std::vector<uint32_t> indices;
+        glm::vec3 boundingBoxMin;
+        glm::vec3 boundingBoxMax;
         VkBuffer vertexBuffer;
-        VkDeviceMemory vertexBufferMemory;
+        GpuAllocation vertexBufferMemory;
         VkBuffer indexBuffer;
-        VkDeviceMemory indexBufferMemory;
+        GpuAllocation indexBufferMemory;
+        std::vector<ModelTile> tiles;   // empty unless the model was split into tiles
 
         void loadModel(std::string file);
+        bool loadModelCache(std::string file, std::string cacheFile);
+        void saveModelCache(std::string file, std::string cacheFile);
         void createIndexBuffer();
         void createVertexBuffer();
+        void splitIntoTiles(int tilesPerSide);
 
-        void init(BaseProject *bp, std::string file);
+        void load(std::string file);
+        void init(BaseProject *bp, std::string file, int tilesPerSide = 0);
+        void initMesh(BaseProject *bp, const std::vector<Vertex>& meshVertices, const std::vector<uint32_t>& meshIndices);
         void cleanup();
 };
 
+// RGBA pixels of a texture image decoded by stb_image, still to be uploaded to the GPU
+struct TextureData {
+        int width;
+        int height;
+        int channels;
+        std::shared_ptr<stbi_uc> pixels;
+
+        static TextureData load(std::string file);
+};
+
 struct Texture {
         BaseProject *BP;
         uint32_t mipLevels;
         VkImage textureImage;
-        VkDeviceMemory textureImageMemory;
+        GpuAllocation textureImageMemory;
         VkImageView textureImageView;
         VkSampler textureSampler;
 
         void createTextureImage(std::string file);
         void createTextureImageView();
         void createTextureSampler();
+        void createHeightMapImage(const std::vector<float>& heights, uint32_t width, uint32_t height);
+        void createHeightMapSampler();
 
         void init(BaseProject *bp, std::string file);
+        // One float per texel (heights[row * width + col]), read with texelFetch in the vertex shaders
+        void initHeightMap(BaseProject *bp, const std::vector<float>& heights, uint32_t width, uint32_t height);
         void cleanup();
 };
 
@@ -214,7 +389,7 @@ struct SkyBoxTexture {
 		Texture TD;
 		
 		void createCubicTextureImage(std::vector<std::string> textures);
-		void createSkyBoxImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkImage& image, VkDeviceMemory& imageMemory);
+		void createSkyBoxImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkImage& image, GpuAllocation& imageMemory);
 		void createSkyBoxImageView();
 		void createSkyBoxTextureSampler();
 		
@@ -241,14 +416,33 @@ struct Pipeline {
         BaseProject *BP;
         VkPipeline graphicsPipeline;
         VkPipelineLayout pipelineLayout;
+        std::vector<VkDescriptorSetLayout> setLayouts;
 
+        // fragConstants[i] is the value of the specialization constant with constant_id i of the
+        // fragment shader; constants that are not given keep the default written in the shader.
+        // Instanced pipelines also read an InstanceData per instance from vertex binding 1.
         void init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
-                  std::vector<DescriptorSetLayout *> D, VkCompareOp compareOp);
+                  std::vector<DescriptorSetLayout *> D, VkCompareOp compareOp,
+                  const std::vector<int32_t>& fragConstants = {}, bool instanced = false);
         VkShaderModule createShaderModule(const std::vector<char>& code);
         static std::vector<char> readFile(const std::string& filename);
         void cleanup();
 };
 
+// Permutations of the same pipeline that differ only in the specialization constants of the fragment
+// shader, so that the driver compiles each one without the branches that the constants turn off.
+// All the variants are built up front (through the pipeline cache) and the caller picks one by index
+// when it records the draw calls.
+struct PipelineVariants {
+        std::vector<Pipeline> variants;
+
+        void init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
+                  std::vector<DescriptorSetLayout *> D, VkCompareOp compareOp,
+                  const std::vector<std::vector<int32_t>>& fragConstants, bool instanced = false);
+        Pipeline& operator[](size_t variant) { return variants[variant]; }
+        void cleanup();
+};
+
 enum DescriptorSetElementType {UNIFORM, TEXTURE};
 
 struct DescriptorSetElement {
@@ -265,20 +459,285 @@ struct SkyBoxDescriptorSetElement {
         SkyBoxTexture *tex;
 };
 
+// Uniform data of all the objects, packed into one persistently mapped buffer per swapchain image
+// (the unit the command buffers are recorded and the uniforms are updated for). Each uniform element
+// of a DescriptorSet reserves a slot aligned to minUniformBufferOffsetAlignment, and is bound as a
+// VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC with the offset of its slot; all the slots are released
+// together with the swapchain.
+struct UniformRing {
+        BaseProject *BP;
+        std::vector<VkBuffer> buffers;
+        std::vector<GpuAllocation> buffersMemory;
+        std::vector<char*> mapped;
+        VkDeviceSize size;
+        VkDeviceSize alignment;
+        VkDeviceSize head;
+
+        void init(BaseProject *bp, VkDeviceSize size);
+        uint32_t allocate(VkDeviceSize size);
+        void cleanup();
+};
+
+// Per-instance data of an instanced draw, in a persistently mapped vertex buffer per swapchain image
+// that the CPU rewrites every frame
+struct InstanceBuffer {
+        BaseProject *BP;
+        std::vector<VkBuffer> buffers;
+        std::vector<GpuAllocation> buffersMemory;
+        std::vector<InstanceData*> mapped;
+        uint32_t capacity;
+
+        void init(BaseProject *bp, uint32_t capacity);
+        void cleanup();
+};
+
 struct DescriptorSet {
         BaseProject *BP;
 
-        std::vector<std::vector<VkBuffer>> uniformBuffers;
-        std::vector<std::vector<VkDeviceMemory>> uniformBuffersMemory;
+        std::vector<std::vector<void*>> uniformBuffersMapped;
         std::vector<VkDescriptorSet> descriptorSets;
 
-        std::vector<bool> toFree;
+        // offsets of the uniform slots in the UniformRing, ordered by binding as vkCmdBindDescriptorSets wants
+        std::vector<uint32_t> dynamicOffsets;
 
         void init(BaseProject *bp, DescriptorSetLayout *L,
                   std::vector<DescriptorSetElement> E);
         void initDSSkyBox(BaseProject *bp, DescriptorSetLayout *L,
                   std::vector<SkyBoxDescriptorSetElement> E);
         void cleanup();
+
+        // Uniform buffers stay mapped for their whole lifetime: updating one is a plain store
+        template<typename T>
+        T* uniform(uint32_t currentImage, int element = 0) {
+                return static_cast<T*>(uniformBuffersMapped[element][currentImage]);
+        }
+};
+
+// Number of descriptor sets a draw call can bind, starting from set 0
+const int DRAW_CALL_DESCRIPTOR_SETS = 2;
+
+// One draw call of the scene, with the objects it needs bound
+struct DrawCall {
+        Pipeline *pipeline;
+        std::array<DescriptorSet *, DRAW_CALL_DESCRIPTOR_SETS> descriptorSets;   // nullptr for unused sets
+        Model *model;
+        uint32_t instanceCount;
+        InstanceBuffer *instances;      // bound to vertex binding 1, nullptr if not instanced
+        uint32_t firstIndex = 0;
+        uint32_t indexCount = 0;        // 0 to draw all the indices of the model
+        uint32_t firstInstance = 0;     // index of the first InstanceData read from instances
+};
+
+// Layers of the sort key, drawn in this order: opaque objects front to back (so that the depth test rejects
+// the hidden fragments early), then the background on the pixels left, then transparent objects back to front
+enum RenderLayer {LAYER_OPAQUE, LAYER_BACKGROUND, LAYER_TRANSPARENT};
+
+// Draw calls of a frame, radix-sorted by a 64-bit key so that the draws sharing a pipeline and a material
+// are recorded one after the other, and only the state that changes between them has to be bound:
+//   opaque and background:  layer (4 bits) | pipeline (12) | material (16) | depth (32)
+//   transparent:            layer (4 bits) | inverted depth (32) | pipeline (12) | material (16)
+// pipeline and material are small ids given to the Pipeline and to the last DescriptorSet of the draw
+// the first time they are submitted.
+class RenderQueue {
+public:
+        void clear() {
+                draws.clear();
+                keys.clear();
+        }
+
+        void submit(const DrawCall& draw, RenderLayer layer, float depth) {
+                uint64_t pipelineId = idOf(pipelineIds, draw.pipeline) & 0xFFF;
+                const void *material = nullptr;
+                for (DescriptorSet *DS : draw.descriptorSets) {
+                        material = (DS != nullptr) ? DS : material;
+                }
+                uint64_t materialId = idOf(materialIds, material) & 0xFFFF;
+
+                // the bits of non-negative floats are ordered as the floats are
+                float clampedDepth = std::max(depth, 0.0f);
+                uint32_t depthBits;
+                memcpy(&depthBits, &clampedDepth, sizeof(depthBits));
+
+                uint64_t key = static_cast<uint64_t>(layer) << 60;
+                if (layer == LAYER_TRANSPARENT) {
+                        key |= static_cast<uint64_t>(~depthBits) << 28 | pipelineId << 16 | materialId;
+                } else {
+                        key |= pipelineId << 48 | materialId << 32 | depthBits;
+                }
+
+                draws.push_back(draw);
+                keys.push_back(key);
+        }
+
+        // Least significant digit radix sort, one byte at a time, stable
+        void sort() {
+                size_t count = draws.size();
+                if (count < 2) {
+                        return;
+                }
+
+                entries.resize(count);
+                scratch.resize(count);
+                for (size_t i = 0; i < count; i++) {
+                        entries[i] = {keys[i], static_cast<uint32_t>(i)};
+                }
+
+                for (int shift = 0; shift < 64; shift += 8) {
+                        std::array<size_t, 256> offsets{};
+                        for (const auto& entry : entries) {
+                                offsets[(entry.first >> shift) & 0xFF]++;
+                        }
+                        // a byte that all the keys share does not change the order
+                        if (offsets[(entries[0].first >> shift) & 0xFF] == count) {
+                                continue;
+                        }
+
+                        size_t offset = 0;
+                        for (auto& bucket : offsets) {
+                                size_t bucketSize = bucket;
+                                bucket = offset;
+                                offset += bucketSize;
+                        }
+                        for (const auto& entry : entries) {
+                                scratch[offsets[(entry.first >> shift) & 0xFF]++] = entry;
+                        }
+                        entries.swap(scratch);
+                }
+
+                sortedDraws.resize(count);
+                for (size_t i = 0; i < count; i++) {
+                        sortedDraws[i] = draws[entries[i].second];
+                        keys[i] = entries[i].first;
+                }
+                draws.swap(sortedDraws);
+        }
+
+        // Keeps only the first count draws
+        void truncate(size_t count) {
+                draws.resize(std::min(count, draws.size()));
+                keys.resize(draws.size());
+        }
+
+        size_t size() const {
+                return draws.size();
+        }
+
+        const DrawCall& operator[](size_t i) const {
+                return draws[i];
+        }
+
+private:
+        std::vector<DrawCall> draws;
+        std::vector<uint64_t> keys;
+
+        // (key, index of the draw) pairs and the buffers of the sort, kept to avoid allocations every frame
+        std::vector<std::pair<uint64_t, uint32_t>> entries;
+        std::vector<std::pair<uint64_t, uint32_t>> scratch;
+        std::vector<DrawCall> sortedDraws;
+
+        std::unordered_map<const void *, uint32_t> pipelineIds;
+        std::unordered_map<const void *, uint32_t> materialIds;
+
+        static uint32_t idOf(std::unordered_map<const void *, uint32_t>& ids, const void *object) {
+                auto it = ids.find(object);
+                if (it == ids.end()) {
+                        it = ids.emplace(object, static_cast<uint32_t>(ids.size())).first;
+                }
+                return it->second;
+        }
+};
+
+// Decodes the .obj models and the .png textures on worker threads, so that the disk and decoding work
+// overlaps with the creation of the Vulkan objects; Model, Texture and SkyBoxTexture then collect the
+// CPU-side data once the device is ready (or decode it on the spot if it was never requested)
+class AssetLoader {
+public:
+        void requestModel(const std::string& file) {
+                if (modelJobs.count(file) == 0) {
+                        modelJobs[file] = std::async(std::launch::async, [file]() {
+                                return runJob<Model>([&file](Model& model) { model.load(file); });
+                        });
+                }
+        }
+
+        void requestTexture(const std::string& file) {
+                if (textureJobs.count(file) == 0) {
+                        textureJobs[file] = std::async(std::launch::async, [file]() {
+                                return runJob<TextureData>([&file](TextureData& data) {
+                                        data = TextureData::load(file);
+                                });
+                        });
+                }
+        }
+
+        // Moves the vertices, the indices and the bounding box of the model into the given one
+        void takeModel(const std::string& file, Model& model) {
+                Model loaded = take<Model>(modelJobs, file, [&file](Model& m) { m.load(file); });
+                model.vertices = std::move(loaded.vertices);
+                model.indices = std::move(loaded.indices);
+                model.boundingBoxMin = loaded.boundingBoxMin;
+                model.boundingBoxMax = loaded.boundingBoxMax;
+        }
+
+        TextureData takeTexture(const std::string& file) {
+                return take<TextureData>(textureJobs, file, [&file](TextureData& data) {
+                        data = TextureData::load(file);
+                });
+        }
+
+private:
+        template<typename T>
+        struct Job {
+                T data{};
+                float loadTime;         // ms spent on the worker thread
+        };
+
+        std::map<std::string, std::future<Job<Model>>> modelJobs;
+        std::map<std::string, std::future<Job<TextureData>>> textureJobs;
+
+        template<typename T, typename F>
+        static Job<T> runJob(F load) {
+                auto start_time = std::chrono::high_resolution_clock::now();
+                Job<T> job;
+                load(job.data);
+                job.loadTime = std::chrono::duration<float, std::milli>(
+                                std::chrono::high_resolution_clock::now() - start_time).count();
+                return job;
+        }
+
+        // Waits for the job of the given file (rethrowing its errors), or loads the file right now if no
+        // job was started for it, and logs how long the loading took and how long the main thread waited
+        template<typename T, typename F>
+        static T take(std::map<std::string, std::future<Job<T>>>& jobs, const std::string& file, F load) {
+                auto start_time = std::chrono::high_resolution_clock::now();
+                auto it = jobs.find(file);
+                if (it == jobs.end()) {
+                        Job<T> job = runJob<T>(load);
+                        std::cout << file << " -> loaded in " << job.loadTime << " ms on the main thread\n";
+                        return std::move(job.data);
+                }
+
+                Job<T> job = it->second.get();
+                jobs.erase(it);
+                float waitTime = std::chrono::duration<float, std::milli>(
+                                std::chrono::high_resolution_clock::now() - start_time).count();
+                std::cout << file << " -> loaded in " << job.loadTime << " ms on a worker thread, main thread waited "
+                          << waitTime << " ms\n";
+                return std::move(job.data);
+        }
+};
+
+
+// All the staging copies, layout transitions and mipmap blits of a loading phase, recorded into a
+// single command buffer and submitted once; the staging buffers are freed when its fence signals
+struct UploadBatch {
+        VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+        VkFence fence = VK_NULL_HANDLE;
+        std::vector<VkBuffer> stagingBuffers;
+        std::vector<GpuAllocation> stagingBuffersMemory;
+        VkDeviceSize stagedBytes = 0;
+        int operations = 0;
+        std::chrono::high_resolution_clock::time_point submitTime;
 };
 
 
@@ -290,13 +749,49 @@ class BaseProject {
         friend class Pipeline;
         friend class DescriptorSetLayout;
         friend class DescriptorSet;
+        friend class UniformRing;
+        friend class InstanceBuffer;
 public:
         virtual void setWindowParameters() = 0;
+
+        // Keep vertex and index buffers in HOST_VISIBLE memory instead of uploading them to DEVICE_LOCAL
+        // memory: useful for integrated GPUs, and to inspect the geometry while debugging
+        void setHostVisibleGeometry(bool hostVisible) {
+                hostVisibleGeometry = hostVisible;
+        }
+
+        // Threads recording the draw list (0: one per core)
+        void setRecordingThreads(uint32_t threads) {
+                recordingThreads = threads;
+        }
+
+        // Run benchmarkRecording instead of the main loop
+        void setBenchmarkRecording(bool benchmark) {
+                isBenchmarkRecording = benchmark;
+        }
+
+        // Run checkGeometryUpload instead of the main loop
+        void setCheckGeometryUpload(bool check) {
+                isCheckGeometryUpload = check;
+        }
+
+        // False if the check run instead of the main loop failed
+        bool isCheckPassed() const {
+                return checkPassed;
+        }
+
         void run() {
                 setWindowParameters();
+                localRequestAssets();
                 initWindow();
                 initVulkan();
-                mainLoop();
+                if (isBenchmarkRecording) {
+                        benchmarkRecording();
+                } else if (isCheckGeometryUpload) {
+                        checkPassed = checkGeometryUpload();
+                } else {
+                        mainLoop();
+                }
                 cleanup();
         }
 
@@ -308,6 +803,17 @@ protected:
         int uniformBlocksInPool;
         int texturesInPool;
         int setsInPool;
+        VkDeviceSize uniformRingSize = 64 * 1024;
+        bool hostVisibleGeometry = false;
+        uint32_t recordingThreads = 0;
+        bool isBenchmarkRecording = false;
+        bool isCheckGeometryUpload = false;
+        bool checkPassed = true;
+
+        AssetLoader assetLoader;
+        GpuAllocator allocator;
+        UploadBatch uploadBatch;
+        UniformRing uniformRing;
 
         // Lesson 12
         GLFWwindow* window;
@@ -320,10 +826,15 @@ protected:
         VkQueue graphicsQueue;
         VkQueue presentQueue;
         VkCommandPool commandPool;
-        std::vector<VkCommandBuffer> commandBuffers;
+        // each frame in flight records its command buffer, every frame, from its own pool
+        std::array<VkCommandPool, MAX_FRAMES_IN_FLIGHT> frameCommandPools;
+        std::array<VkCommandBuffer, MAX_FRAMES_IN_FLIGHT> commandBuffers;
+        // draws of the frame being recorded, split among the threads of drawRecorder when they are many
+        RenderQueue renderQueue;
+        DrawRecorder drawRecorder;
 
         // Lesson 14
-        VkSwapchainKHR swapChain;
+        VkSwapchainKHR swapChain = VK_NULL_HANDLE;
         std::vector<VkImage> swapChainImages;
         VkFormat swapChainImageFormat;
         VkExtent2D swapChainExtent;
@@ -331,6 +842,7 @@ protected:
 
         // Lesson 19
         VkRenderPass renderPass;
+        VkPipelineCache pipelineCache;
 
         VkDescriptorPool descriptorPool;
 
@@ -340,7 +852,7 @@ protected:
 
         // L22.1 --- depth buffer allocation (Z-buffer)
         VkImage depthImage;
-        VkDeviceMemory depthImageMemory;
+        GpuAllocation depthImageMemory;
         VkImageView depthImageView;
 
         // L22.2 --- Frame buffers
@@ -353,6 +865,53 @@ protected:
         std::vector<VkFence> inFlightFences;
         std::vector<VkFence> imagesInFlight;
 
+        // Objects that may still be used by the frames in flight are destroyed once the fences of
+        // those frames have signaled: each entry remembers the serial of the last frame submitted
+        // on every frame slot when it was queued
+        struct DeferredDestruction {
+                std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> frameSerials;
+                std::function<void()> destroy;
+        };
+        std::deque<DeferredDestruction> deferredDestructions;
+        std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> frameSerials{};
+        uint64_t submittedFrames = 0;
+
+        // Frame times around the swapchain recreations
+        std::chrono::high_resolution_clock::time_point lastFrameTime;
+        std::deque<float> recentFrameTimes;
+        std::vector<float> resizeTraceBefore;
+        std::vector<float> resizeTraceAfter;
+        float resizeTraceRecreationTime = 0.0f;
+        bool isResizeTraceOpen = false;
+
+        // CPU time spent resetting and recording the command buffers since the last report
+        std::chrono::high_resolution_clock::time_point lastRecordingReport;
+        uint32_t recordedFrames = 0;
+        float recordingTimeSum = 0.0f;
+        float recordingTimeMax = 0.0f;
+
+        // Binds emitted and skipped (because the object was already bound) by recordDraws since the
+        // last report; recordDraws may run on several threads
+        struct BindCounters {
+                std::atomic<uint64_t> draws{0};
+                std::atomic<uint64_t> pipelines{0};
+                std::atomic<uint64_t> pipelinesAvoided{0};
+                std::atomic<uint64_t> descriptorSets{0};
+                std::atomic<uint64_t> descriptorSetsAvoided{0};
+                std::atomic<uint64_t> models{0};
+                std::atomic<uint64_t> modelsAvoided{0};
+        };
+        BindCounters bindCounters;
+
+        // GPU time of the frames, from two timestamps written by the command buffer of each frame in flight
+        VkQueryPool timestampQueryPool = VK_NULL_HANDLE;
+        float timestampPeriod = 0.0f;           // ns per timestamp tick
+        std::array<bool, MAX_FRAMES_IN_FLIGHT> hasTimestamps{};
+        // CPU time spent on the last frame (uniforms, render queue, recording and submission), and GPU time
+        // of the last frame whose timestamps were read back (-1 if the queue does not support timestamps)
+        float lastCpuFrameTime = 0.0f;
+        float lastGpuFrameTime = -1.0f;
+
         // Lesson 12
         void initWindow() {
                 glfwInit();
@@ -362,6 +921,9 @@ protected:
                 window = glfwCreateWindow(windowWidth, windowHeight, windowTitle.c_str(), nullptr, nullptr);
         }
 
+        // Starts loading the models and textures that localInit will use
+        virtual void localRequestAssets() {}
+
         virtual void localInit() = 0;
         
         virtual void recreateSwapChainDSInit() = 0;
@@ -375,6 +937,8 @@ protected:
                 createSurface();				// L13
                 pickPhysicalDevice();			// L14
                 createLogicalDevice();			// L14
+                allocator.init(physicalDevice, device);
+                createPipelineCache();
                 createSwapChain();				// L15
                 createImageViews();				// L15
                 createRenderPass();				// L19
@@ -382,11 +946,101 @@ protected:
                 createDepthResources();			// L22.1
                 createFramebuffers();			// L22.2
                 createDescriptorPool();			// L21
+                uniformRing.init(this, uniformRingSize);
 
+                beginUploadBatch();
                 localInit();
+                submitUploadBatch();
 
                 createCommandBuffers();			// L22.5 (13)
+                createTimestampQueries();
                 createSyncObjects();			// L22.3
+
+                allocator.printStats("after loading");
+        }
+
+        // Seeds the pipeline cache with the file saved by the previous run, if it was written
+        // by the same GPU and driver; otherwise the pipelines are compiled from scratch (cold)
+        void createPipelineCache() {
+                VkPhysicalDeviceProperties properties;
+                vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+                std::vector<char> data;
+                std::ifstream in(PIPELINE_CACHE_FILE, std::ios::binary | std::ios::ate);
+                if (in.is_open()) {
+                        size_t fileSize = static_cast<size_t>(in.tellg());
+                        PipelineCacheHeader header{};
+                        in.seekg(0);
+                        if (fileSize >= sizeof(header) && in.read(reinterpret_cast<char*>(&header), sizeof(header))
+                            && memcmp(header.magic, "PIPECACH", 8) == 0
+                            && header.version == PIPELINE_CACHE_VERSION
+                            && header.vendorID == properties.vendorID
+                            && header.deviceID == properties.deviceID
+                            && header.driverVersion == properties.driverVersion
+                            && memcmp(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) == 0
+                            && header.dataSize == fileSize - sizeof(header)) {
+                                data.resize(header.dataSize);
+                                if (!in.read(data.data(), data.size())
+                                    || header.checksum != cacheChecksum(
+                                                reinterpret_cast<const unsigned char*>(data.data()), data.size())) {
+                                        data.clear();
+                                }
+                        }
+                }
+
+                VkPipelineCacheCreateInfo cacheInfo{};
+                cacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+                cacheInfo.initialDataSize = data.size();
+                cacheInfo.pInitialData = data.empty() ? nullptr : data.data();
+
+                VkResult result = vkCreatePipelineCache(device, &cacheInfo, nullptr, &pipelineCache);
+                if (result != VK_SUCCESS) {
+                        PrintVkError(result);
+                        throw std::runtime_error("failed to create pipeline cache!");
+                }
+
+                if (data.empty()) {
+                        std::cout << "Pipeline cache: cold, no valid " << PIPELINE_CACHE_FILE << " for this device\n";
+                } else {
+                        std::cout << "Pipeline cache: warm, loaded " << data.size() / 1024 << " KiB from "
+                                  << PIPELINE_CACHE_FILE << "\n";
+                }
+        }
+
+        void savePipelineCache() {
+                VkPhysicalDeviceProperties properties;
+                vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+
+                size_t dataSize = 0;
+                if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, nullptr) != VK_SUCCESS) {
+                        return;
+                }
+                std::vector<char> data(dataSize);
+                if (vkGetPipelineCacheData(device, pipelineCache, &dataSize, data.data()) != VK_SUCCESS) {
+                        return;
+                }
+                data.resize(dataSize);
+
+                PipelineCacheHeader header{};
+                memcpy(header.magic, "PIPECACH", 8);
+                header.version = PIPELINE_CACHE_VERSION;
+                header.vendorID = properties.vendorID;
+                header.deviceID = properties.deviceID;
+                header.driverVersion = properties.driverVersion;
+                memcpy(header.pipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+                header.dataSize = data.size();
+                header.checksum = cacheChecksum(reinterpret_cast<const unsigned char*>(data.data()), data.size());
+
+                std::string tmpFile = PIPELINE_CACHE_FILE + ".tmp";
+                std::ofstream out(tmpFile, std::ios::binary | std::ios::trunc);
+                out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                out.write(data.data(), data.size());
+                out.close();
+
+                if (!out || std::rename(tmpFile.c_str(), PIPELINE_CACHE_FILE.c_str()) != 0) {
+                        std::cout << "Unable to write pipeline cache " << PIPELINE_CACHE_FILE << "\n";
+                        std::remove(tmpFile.c_str());
+                }
         }
 
         // Lesson 12 and 22.0
@@ -754,7 +1408,8 @@ protected:
                 createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
                 createInfo.presentMode = presentMode;
                 createInfo.clipped = VK_TRUE;
-                createInfo.oldSwapchain = VK_NULL_HANDLE;
+                // the previous swapchain (if any) keeps presenting the frames in flight
+                createInfo.oldSwapchain = swapChain;
 
                 VkResult result = vkCreateSwapchainKHR(device, &createInfo, nullptr, &swapChain);
                 if (result != VK_SUCCESS) {
@@ -771,36 +1426,59 @@ protected:
                 swapChainExtent = extent;
         }
         
+        // Only the objects that depend on the swapchain images and on their size
         void cleanupSwapChain() {
         
             vkDestroyImageView(device, depthImageView, nullptr);
             vkDestroyImage(device, depthImage, nullptr);
-            vkFreeMemory(device, depthImageMemory, nullptr);
+            allocator.free(depthImageMemory);
         
             for (size_t i = 0; i < swapChainFramebuffers.size(); i++) {
         			vkDestroyFramebuffer(device, swapChainFramebuffers[i], nullptr);
     		}
     		
-    		vkFreeCommandBuffers(device, commandPool,
-                                     static_cast<uint32_t>(commandBuffers.size()), commandBuffers.data());
-            
-            recreateSwapChainLocalCleanupPipelines();
-            
-            
-            vkDestroyRenderPass(device, renderPass, nullptr);
-
 			for (size_t i = 0; i < swapChainImageViews.size(); i++) {
 					vkDestroyImageView(device, swapChainImageViews[i], nullptr);
 			}
 
     		vkDestroySwapchainKHR(device, swapChain, nullptr);
+		}
+
+        void cleanupPipelines() {
+            recreateSwapChainLocalCleanupPipelines();
+            vkDestroyRenderPass(device, renderPass, nullptr);
+        }
 
+        void cleanupDescriptorSets() {
 			recreateSwapChainLocalCleanupDS();
-			
+			uniformRing.cleanup();
     		vkDestroyDescriptorPool(device, descriptorPool, nullptr);
-
-		}
+        }
         
+        // Moves the swapchain dependent objects into a deferred destruction, so that the frames in flight
+        // can finish with them while the new ones are created
+        void retireSwapChain() {
+                VkSwapchainKHR oldSwapChain = swapChain;
+                std::vector<VkImageView> oldImageViews = swapChainImageViews;
+                std::vector<VkFramebuffer> oldFramebuffers = swapChainFramebuffers;
+                VkImageView oldDepthImageView = depthImageView;
+                VkImage oldDepthImage = depthImage;
+                GpuAllocation oldDepthImageMemory = depthImageMemory;
+
+                deferDestruction([=]() mutable {
+                        vkDestroyImageView(device, oldDepthImageView, nullptr);
+                        vkDestroyImage(device, oldDepthImage, nullptr);
+                        allocator.free(oldDepthImageMemory);
+                        for (auto framebuffer : oldFramebuffers) {
+                                vkDestroyFramebuffer(device, framebuffer, nullptr);
+                        }
+                        for (auto imageView : oldImageViews) {
+                                vkDestroyImageView(device, imageView, nullptr);
+                        }
+                        vkDestroySwapchainKHR(device, oldSwapChain, nullptr);
+                });
+        }
+
         void recreateSwapChain() {
         
 		        int width = 0, height = 0;
@@ -809,22 +1487,164 @@ protected:
 						glfwGetFramebufferSize(window, &width, &height);
 						glfwWaitEvents();
 				}
-        		
-				vkDeviceWaitIdle(device);
-				
-				cleanupSwapChain();
-				
+
+				auto start_time = std::chrono::high_resolution_clock::now();
+
+				VkFormat oldImageFormat = swapChainImageFormat;
+				size_t oldImageCount = swapChainImages.size();
+
+				retireSwapChain();
+
 				createSwapChain();
 				createImageViews();
-				createRenderPass();
-				recreateSwapChainPipelinesInit();
+
+				// Pipelines and descriptor sets are still used by the frames in flight: in the rare cases
+				// in which they have to be rebuilt, wait for the GPU to be idle
+				bool isFormatChanged = swapChainImageFormat != oldImageFormat;
+				bool isImageCountChanged = swapChainImages.size() != oldImageCount;
+				if (isFormatChanged || isImageCountChanged) {
+						vkDeviceWaitIdle(device);
+				}
+
+				// pipelines use dynamic viewport and scissor: they only depend on the format of
+				// the images (through the render pass), which a resize normally does not change
+				if (isFormatChanged) {
+						cleanupPipelines();
+						createRenderPass();
+						recreateSwapChainPipelinesInit();
+				}
+
+				// descriptor sets and uniform buffers are per image
+				if (isImageCountChanged) {
+						cleanupDescriptorSets();
+						createDescriptorPool();
+						uniformRing.init(this, uniformRingSize);
+						recreateSwapChainDSInit();
+				}
+
+				// the uniforms of any new image may still be read by the last frame submitted
+				VkFence lastFrameFence = VK_NULL_HANDLE;
+				uint64_t lastSerial = 0;
+				for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+						if (frameSerials[i] > lastSerial) {
+								lastSerial = frameSerials[i];
+								lastFrameFence = inFlightFences[i];
+						}
+				}
+				imagesInFlight.assign(swapChainImages.size(), lastFrameFence);
+
 				createDepthResources();		
 				createFramebuffers();	
-				createDescriptorPool();
-				recreateSwapChainDSInit();			
-				createCommandBuffers();
+
+				float recreationTime = std::chrono::duration<float, std::milli>(
+								std::chrono::high_resolution_clock::now() - start_time).count();
+				openResizeTrace(recreationTime);
+
+				allocator.printStats("after swapchain recreation");
 		}
 
+        void deferDestruction(std::function<void()> destroy) {
+                deferredDestructions.push_back({frameSerials, std::move(destroy)});
+        }
+
+        // Runs the deferred destructions whose frames have completed (or waits for them)
+        void flushDeferredDestructions(bool wait) {
+                while (!deferredDestructions.empty()) {
+                        DeferredDestruction& destruction = deferredDestructions.front();
+
+                        for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+                                // a newer frame on the same slot means that the fence was already waited for
+                                if (destruction.frameSerials[i] == 0 || frameSerials[i] != destruction.frameSerials[i]) {
+                                        continue;
+                                }
+                                if (wait) {
+                                        vkWaitForFences(device, 1, &inFlightFences[i], VK_TRUE, UINT64_MAX);
+                                } else if (vkGetFenceStatus(device, inFlightFences[i]) != VK_SUCCESS) {
+                                        return;
+                                }
+                        }
+
+                        destruction.destroy();
+                        deferredDestructions.pop_front();
+                }
+        }
+
+        void openResizeTrace(float recreationTime) {
+                if (isResizeTraceOpen) {
+                        closeResizeTrace();
+                }
+                resizeTraceBefore.assign(recentFrameTimes.begin(), recentFrameTimes.end());
+                resizeTraceAfter.clear();
+                resizeTraceRecreationTime = recreationTime;
+                isResizeTraceOpen = true;
+        }
+
+        void closeResizeTrace() {
+                std::cout << "Resize trace: frame times before";
+                for (float frameTime : resizeTraceBefore) {
+                        std::cout << " " << frameTime;
+                }
+                std::cout << " ms | swapchain recreated in " << resizeTraceRecreationTime << " ms | after";
+                for (float frameTime : resizeTraceAfter) {
+                        std::cout << " " << frameTime;
+                }
+                std::cout << " ms\n";
+                isResizeTraceOpen = false;
+        }
+
+        void traceFrameTime() {
+                auto now = std::chrono::high_resolution_clock::now();
+                if (submittedFrames > 0) {
+                        float frameTime = std::chrono::duration<float, std::milli>(now - lastFrameTime).count();
+
+                        recentFrameTimes.push_back(frameTime);
+                        if (recentFrameTimes.size() > RESIZE_TRACE_FRAMES) {
+                                recentFrameTimes.pop_front();
+                        }
+
+                        if (isResizeTraceOpen) {
+                                resizeTraceAfter.push_back(frameTime);
+                                if (resizeTraceAfter.size() == RESIZE_TRACE_FRAMES) {
+                                        closeResizeTrace();
+                                }
+                        }
+                }
+                lastFrameTime = now;
+        }
+
+        // Prints the average and the worst recording time every RECORDING_REPORT_PERIOD seconds
+        void traceRecordingTime(float recordingTime) {
+                auto now = std::chrono::high_resolution_clock::now();
+
+                recordedFrames++;
+                recordingTimeSum += recordingTime;
+                recordingTimeMax = std::max(recordingTimeMax, recordingTime);
+
+                if (std::chrono::duration<float>(now - lastRecordingReport).count() >= RECORDING_REPORT_PERIOD) {
+                        std::cout << "Command buffer recording: " << std::fixed << std::setprecision(3)
+                                  << recordingTimeSum / recordedFrames << " ms average, " << recordingTimeMax
+                                  << " ms worst over " << recordedFrames << " frames\n" << std::defaultfloat;
+                        std::cout << "  per frame: " << bindCounters.draws / recordedFrames << " draws, "
+                                  << bindCounters.pipelines / recordedFrames << " pipeline binds ("
+                                  << bindCounters.pipelinesAvoided / recordedFrames << " avoided), "
+                                  << bindCounters.descriptorSets / recordedFrames << " descriptor set binds ("
+                                  << bindCounters.descriptorSetsAvoided / recordedFrames << " avoided), "
+                                  << bindCounters.models / recordedFrames << " vertex/index buffer binds ("
+                                  << bindCounters.modelsAvoided / recordedFrames << " avoided)\n";
+                        bindCounters.draws = 0;
+                        bindCounters.pipelines = 0;
+                        bindCounters.pipelinesAvoided = 0;
+                        bindCounters.descriptorSets = 0;
+                        bindCounters.descriptorSetsAvoided = 0;
+                        bindCounters.models = 0;
+                        bindCounters.modelsAvoided = 0;
+                        lastRecordingReport = now;
+                        recordedFrames = 0;
+                        recordingTimeSum = 0.0f;
+                        recordingTimeMax = 0.0f;
+                }
+        }
+
         // Lesson 14
         VkSurfaceFormatKHR chooseSwapSurfaceFormat(
                         const std::vector<VkSurfaceFormatKHR>& availableFormats)
@@ -1041,7 +1861,7 @@ protected:
                          VkFormat format,
                          VkImageTiling tiling, VkImageUsageFlags usage,
                          VkMemoryPropertyFlags properties, VkImage& image,
-                         VkDeviceMemory& imageMemory) {
+                         GpuAllocation& imageMemory) {
                 VkImageCreateInfo imageInfo{};
                 imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
                 imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1067,17 +1887,11 @@ protected:
                 VkMemoryRequirements memRequirements;
                 vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-                VkMemoryAllocateInfo allocInfo{};
-                allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-                allocInfo.allocationSize = memRequirements.size;
-                allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits,
-                                                           properties);
-                if (vkAllocateMemory(device, &allocInfo, nullptr, &imageMemory) !=
-                    VK_SUCCESS) {
-                        throw std::runtime_error("failed to allocate image memory!");
-                }
+                imageMemory = allocator.allocate(memRequirements,
+                                                 findMemoryType(memRequirements.memoryTypeBits, properties),
+                                                 tiling == VK_IMAGE_TILING_LINEAR);
 
-                vkBindImageMemory(device, image, imageMemory, 0);
+                vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
         }
 
         // New - Lesson 23
@@ -1223,7 +2037,13 @@ protected:
         }
 
         // New - Lesson 23
+        // While an upload batch is open, the commands are recorded into its command buffer instead
         VkCommandBuffer beginSingleTimeCommands() {
+                if (uploadBatch.commandBuffer != VK_NULL_HANDLE && uploadBatch.fence == VK_NULL_HANDLE) {
+                        uploadBatch.operations++;
+                        return uploadBatch.commandBuffer;
+                }
+
                 VkCommandBufferAllocateInfo allocInfo{};
                 allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
                 allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
@@ -1244,6 +2064,10 @@ protected:
 
         // New - Lesson 23
         void endSingleTimeCommands(VkCommandBuffer commandBuffer) {
+                if (commandBuffer == uploadBatch.commandBuffer) {
+                        return;
+                }
+
                 vkEndCommandBuffer(commandBuffer);
 
                 VkSubmitInfo submitInfo{};
@@ -1256,6 +2080,95 @@ protected:
                 vkFreeCommandBuffers(device, commandPool, 1, &commandBuffer);
         }
 
+        void beginUploadBatch() {
+                uploadBatch = UploadBatch{};
+
+                VkCommandBufferAllocateInfo allocInfo{};
+                allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+                allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+                allocInfo.commandPool = commandPool;
+                allocInfo.commandBufferCount = 1;
+
+                VkResult result = vkAllocateCommandBuffers(device, &allocInfo, &uploadBatch.commandBuffer);
+                if (result != VK_SUCCESS) {
+                        PrintVkError(result);
+                        throw std::runtime_error("failed to allocate upload command buffer!");
+                }
+
+                VkCommandBufferBeginInfo beginInfo{};
+                beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+                vkBeginCommandBuffer(uploadBatch.commandBuffer, &beginInfo);
+        }
+
+        // Submits the whole batch without waiting: commands submitted later to the same queue
+        // (i.e. the frames) are ordered after it by the barriers that close each upload
+        void submitUploadBatch() {
+                vkEndCommandBuffer(uploadBatch.commandBuffer);
+
+                VkFenceCreateInfo fenceInfo{};
+                fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+
+                VkResult result = vkCreateFence(device, &fenceInfo, nullptr, &uploadBatch.fence);
+                if (result != VK_SUCCESS) {
+                        PrintVkError(result);
+                        throw std::runtime_error("failed to create upload fence!");
+                }
+
+                VkSubmitInfo submitInfo{};
+                submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+                submitInfo.commandBufferCount = 1;
+                submitInfo.pCommandBuffers = &uploadBatch.commandBuffer;
+
+                uploadBatch.submitTime = std::chrono::high_resolution_clock::now();
+                result = vkQueueSubmit(graphicsQueue, 1, &submitInfo, uploadBatch.fence);
+                if (result != VK_SUCCESS) {
+                        PrintVkError(result);
+                        throw std::runtime_error("failed to submit upload command buffer!");
+                }
+        }
+
+        // Frees the staging buffers and the command buffer of the submitted batch once its fence has
+        // signaled (or after waiting for it); returns whether the batch has been released
+        bool releaseUploadBatch(bool wait) {
+                if (uploadBatch.fence == VK_NULL_HANDLE) {
+                        return true;
+                }
+
+                if (wait) {
+                        vkWaitForFences(device, 1, &uploadBatch.fence, VK_TRUE, UINT64_MAX);
+                } else if (vkGetFenceStatus(device, uploadBatch.fence) != VK_SUCCESS) {
+                        return false;
+                }
+
+                float uploadTime = std::chrono::duration<float, std::milli>(
+                                std::chrono::high_resolution_clock::now() - uploadBatch.submitTime).count();
+                std::cout << "Upload batch: " << uploadBatch.operations << " operations, "
+                          << uploadBatch.stagingBuffers.size() << " staging buffers ("
+                          << uploadBatch.stagedBytes / 1024 << " KiB), completed within " << uploadTime << " ms\n";
+
+                for (size_t i = 0; i < uploadBatch.stagingBuffers.size(); i++) {
+                        destroyBuffer(uploadBatch.stagingBuffers[i], uploadBatch.stagingBuffersMemory[i]);
+                }
+                vkDestroyFence(device, uploadBatch.fence, nullptr);
+                vkFreeCommandBuffers(device, commandPool, 1, &uploadBatch.commandBuffer);
+
+                uploadBatch = UploadBatch{};
+                return true;
+        }
+
+        // Staging buffers still referenced by an open upload batch are kept until the batch completes
+        void destroyStagingBuffer(VkBuffer buffer, GpuAllocation& bufferMemory, VkDeviceSize size) {
+                if (uploadBatch.commandBuffer != VK_NULL_HANDLE && uploadBatch.fence == VK_NULL_HANDLE) {
+                        uploadBatch.stagingBuffers.push_back(buffer);
+                        uploadBatch.stagingBuffersMemory.push_back(bufferMemory);
+                        uploadBatch.stagedBytes += size;
+                } else {
+                        destroyBuffer(buffer, bufferMemory);
+                }
+        }
+
 
 
         // Lesson 22.4
@@ -1263,7 +2176,7 @@ protected:
         // Lesson 21
         void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage,
                           VkMemoryPropertyFlags properties,
-                          VkBuffer& buffer, VkDeviceMemory& bufferMemory) {
+                          VkBuffer& buffer, GpuAllocation& bufferMemory) {
                 VkBufferCreateInfo bufferInfo{};
                 bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
                 bufferInfo.size = size;
@@ -1281,20 +2194,70 @@ protected:
                 VkMemoryRequirements memRequirements;
                 vkGetBufferMemoryRequirements(device, buffer, &memRequirements);
 
-                VkMemoryAllocateInfo allocInfo{};
-                allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-                allocInfo.allocationSize = memRequirements.size;
-                allocInfo.memoryTypeIndex =
-                                findMemoryType(memRequirements.memoryTypeBits, properties);
+                bufferMemory = allocator.allocate(memRequirements,
+                                                  findMemoryType(memRequirements.memoryTypeBits, properties),
+                                                  true);
 
-                result = vkAllocateMemory(device, &allocInfo, nullptr,
-                                          &bufferMemory);
-                if (result != VK_SUCCESS) {
-                        PrintVkError(result);
-                        throw std::runtime_error("failed to allocate vertex buffer memory!");
+                vkBindBufferMemory(device, buffer, bufferMemory.memory, bufferMemory.offset);
+        }
+
+        void destroyBuffer(VkBuffer buffer, GpuAllocation& bufferMemory) {
+                vkDestroyBuffer(device, buffer, nullptr);
+                allocator.free(bufferMemory);
+        }
+
+        void copyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size) {
+                VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+
+                VkBufferCopy copyRegion{};
+                copyRegion.size = size;
+                vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion);
+
+                // make the copy visible to the vertex input of the frames submitted afterwards
+                VkMemoryBarrier barrier{};
+                barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+                vkCmdPipelineBarrier(commandBuffer,
+                                     VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                     VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0,
+                                     1, &barrier, 0, nullptr, 0, nullptr);
+
+                endSingleTimeCommands(commandBuffer);
+        }
+
+        // Creates a vertex or index buffer filled with the given contents: in DEVICE_LOCAL memory through
+        // a staging buffer, or directly in HOST_VISIBLE memory if hostVisibleGeometry is set
+        void createGeometryBuffer(const void* contents, VkDeviceSize size, VkBufferUsageFlags usage,
+                                  VkBuffer& buffer, GpuAllocation& bufferMemory) {
+
+                if (hostVisibleGeometry) {
+                        createBuffer(size, usage,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                     VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                     buffer, bufferMemory);
+
+                        memcpy(allocator.map(bufferMemory), contents, (size_t) size);
+                        return;
                 }
 
-                vkBindBufferMemory(device, buffer, bufferMemory, 0);
+                VkBuffer stagingBuffer;
+                GpuAllocation stagingBufferMemory;
+
+                createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                             VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                             stagingBuffer, stagingBufferMemory);
+
+                memcpy(allocator.map(stagingBufferMemory), contents, (size_t) size);
+
+                createBuffer(size, usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                             buffer, bufferMemory);
+
+                copyBuffer(stagingBuffer, buffer, size);
+
+                destroyStagingBuffer(stagingBuffer, stagingBufferMemory, size);
         }
 
         // Lesson 21
@@ -1317,7 +2280,7 @@ protected:
         // Lesson 21
         void createDescriptorPool() {
                 std::array<VkDescriptorPoolSize, 2> poolSizes{};
-                poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+                poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
                 poolSizes[0].descriptorCount = static_cast<uint32_t>(uniformBlocksInPool *
                                                                      swapChainImages.size());
                 // New - Lesson 23
@@ -1340,67 +2303,383 @@ protected:
                 }
         }
 
-        virtual void populateCommandBuffer(VkCommandBuffer commandBuffer, int i) = 0;
+        // Submits the draw calls of the frame, which are then sorted by their keys before being recorded
+        virtual void populateRenderQueue(RenderQueue& renderQueue) = 0;
 
         // Lesson 22.5 (and 13)
+        // The command buffers are recorded every frame (see drawFrame), so they do not depend on the
+        // swapchain: one transient pool per frame in flight, reset as a whole once the frame has completed
         void createCommandBuffers() {
-                // Lesson 13
-                commandBuffers.resize(swapChainFramebuffers.size());
+                QueueFamilyIndices queueFamilyIndices =
+                                findQueueFamilies(physicalDevice);
 
-                VkCommandBufferAllocateInfo allocInfo{};
-                allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-                allocInfo.commandPool = commandPool;
-                allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-                allocInfo.commandBufferCount = (uint32_t) commandBuffers.size();
+                for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+                        VkCommandPoolCreateInfo poolInfo{};
+                        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+                        poolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+                        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+                        VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &frameCommandPools[i]);
+                        if (result != VK_SUCCESS) {
+                                PrintVkError(result);
+                                throw std::runtime_error("failed to create command pool!");
+                        }
+
+                        // Lesson 13
+                        VkCommandBufferAllocateInfo allocInfo{};
+                        allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+                        allocInfo.commandPool = frameCommandPools[i];
+                        allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+                        allocInfo.commandBufferCount = 1;
+
+                        result = vkAllocateCommandBuffers(device, &allocInfo, &commandBuffers[i]);
+                        if (result != VK_SUCCESS) {
+                                PrintVkError(result);
+                                throw std::runtime_error("failed to allocate command buffers!");
+                        }
+                }
+                uint32_t threads = (recordingThreads > 0) ? recordingThreads : std::thread::hardware_concurrency();
+                drawRecorder.init(device, queueFamilyIndices.graphicsFamily.value(), MAX_FRAMES_IN_FLIGHT, threads);
+
+                lastRecordingReport = std::chrono::high_resolution_clock::now();
+        }
+
+        // The GPU time of the frames is measured only if the graphics queue supports timestamps
+        void createTimestampQueries() {
+                uint32_t queueFamilyCount = 0;
+                vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, nullptr);
+                std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+                vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+                QueueFamilyIndices queueFamilyIndices = findQueueFamilies(physicalDevice);
+                if (queueFamilies[queueFamilyIndices.graphicsFamily.value()].timestampValidBits == 0) {
+                        std::cout << "The graphics queue does not support timestamps, GPU frame times are not available\n";
+                        return;
+                }
+
+                VkPhysicalDeviceProperties properties;
+                vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+                timestampPeriod = properties.limits.timestampPeriod;
 
-                VkResult result = vkAllocateCommandBuffers(device, &allocInfo,
-                                                           commandBuffers.data());
+                VkQueryPoolCreateInfo queryPoolInfo{};
+                queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+                queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+                queryPoolInfo.queryCount = 2 * MAX_FRAMES_IN_FLIGHT;
+
+                VkResult result = vkCreateQueryPool(device, &queryPoolInfo, nullptr, &timestampQueryPool);
                 if (result != VK_SUCCESS) {
                         PrintVkError(result);
-                        throw std::runtime_error("failed to allocate command buffers!");
+                        throw std::runtime_error("failed to create timestamp query pool!");
                 }
+        }
 
-                // Lesson 22.5 --- Draw calls
-                // This is where the commands that actually draw something on screen are!
-                for (size_t i = 0; i < commandBuffers.size(); i++) {
-                        VkCommandBufferBeginInfo beginInfo{};
-                        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-                        beginInfo.flags = 0; // Optional
-                        beginInfo.pInheritanceInfo = nullptr; // Optional
+        // Reads the timestamps of the current frame slot, whose fence has just signaled
+        void readFrameTimestamps() {
+                if (timestampQueryPool == VK_NULL_HANDLE || !hasTimestamps[currentFrame]) {
+                        return;
+                }
 
-                        if (vkBeginCommandBuffer(commandBuffers[i], &beginInfo) !=
-                            VK_SUCCESS) {
-                                throw std::runtime_error("failed to begin recording command buffer!");
-                        }
+                uint64_t timestamps[2];
+                VkResult result = vkGetQueryPoolResults(device, timestampQueryPool, static_cast<uint32_t>(2 * currentFrame), 2,
+                                                        sizeof(timestamps), timestamps, sizeof(uint64_t),
+                                                        VK_QUERY_RESULT_64_BIT);
+                if (result == VK_SUCCESS) {
+                        lastGpuFrameTime = (timestamps[1] - timestamps[0]) * timestampPeriod / 1000000.0f;
+                }
+        }
 
-                        VkRenderPassBeginInfo renderPassInfo{};
-                        renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-                        renderPassInfo.renderPass = renderPass;
-                        renderPassInfo.framebuffer = swapChainFramebuffers[i];
-                        renderPassInfo.renderArea.offset = {0, 0};
-                        renderPassInfo.renderArea.extent = swapChainExtent;
+        // Lesson 22.5 --- Draw calls
+        // This is where the commands that actually draw something on screen are!
+        // The draws of renderQueue are recorded inline if chunks is 1, otherwise into that many secondary
+        // command buffers on the threads of drawRecorder
+        void recordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t imageIndex, uint32_t chunks) {
+                VkCommandBufferBeginInfo beginInfo{};
+                beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+                beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+                beginInfo.pInheritanceInfo = nullptr; // Optional
+
+                if (vkBeginCommandBuffer(commandBuffer, &beginInfo) !=
+                    VK_SUCCESS) {
+                        throw std::runtime_error("failed to begin recording command buffer!");
+                }
+
+                uint32_t firstQuery = static_cast<uint32_t>(2 * currentFrame);
+                if (timestampQueryPool != VK_NULL_HANDLE) {
+                        vkCmdResetQueryPool(commandBuffer, timestampQueryPool, firstQuery, 2);
+                        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, timestampQueryPool, firstQuery);
+                }
 
-                        std::array<VkClearValue, 2> clearValues{};
-                        clearValues[0].color = initialBackgroundColor;
-                        clearValues[1].depthStencil = {1.0f, 0};
+                VkRenderPassBeginInfo renderPassInfo{};
+                renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+                renderPassInfo.renderPass = renderPass;
+                renderPassInfo.framebuffer = swapChainFramebuffers[imageIndex];
+                renderPassInfo.renderArea.offset = {0, 0};
+                renderPassInfo.renderArea.extent = swapChainExtent;
 
-                        renderPassInfo.clearValueCount =
-                                        static_cast<uint32_t>(clearValues.size());
-                        renderPassInfo.pClearValues = clearValues.data();
+                std::array<VkClearValue, 2> clearValues{};
+                clearValues[0].color = initialBackgroundColor;
+                clearValues[1].depthStencil = {1.0f, 0};
 
-                        vkCmdBeginRenderPass(commandBuffers[i], &renderPassInfo,
+                renderPassInfo.clearValueCount =
+                                static_cast<uint32_t>(clearValues.size());
+                renderPassInfo.pClearValues = clearValues.data();
+
+                if (chunks <= 1) {
+                        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
                                              VK_SUBPASS_CONTENTS_INLINE);
+                        recordDraws(commandBuffer, imageIndex, 0, renderQueue.size());
+                } else {
+                        vkCmdBeginRenderPass(commandBuffer, &renderPassInfo,
+                                             VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+
+                        VkCommandBufferInheritanceInfo inheritanceInfo{};
+                        inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+                        inheritanceInfo.renderPass = renderPass;
+                        inheritanceInfo.subpass = 0;
+                        inheritanceInfo.framebuffer = swapChainFramebuffers[imageIndex];
+
+                        drawRecorder.record(static_cast<uint32_t>(currentFrame), commandBuffer, inheritanceInfo,
+                                            renderQueue.size(), chunks,
+                                            [this, imageIndex](VkCommandBuffer secondary, size_t begin, size_t end) {
+                                                    recordDraws(secondary, imageIndex, begin, end);
+                                            });
+                }
+
+                vkCmdEndRenderPass(commandBuffer);
 
+                if (timestampQueryPool != VK_NULL_HANDLE) {
+                        vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, timestampQueryPool,
+                                            firstQuery + 1);
+                }
 
-                        populateCommandBuffer(commandBuffers[i], i);
+                if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+                        throw std::runtime_error("failed to record command buffer!");
+                }
+        }
 
+        // Records the draws [begin, end) of renderQueue, binding only the objects that change from one draw
+        // to the next. It may run on several threads at once, each one with its own command buffer.
+        void recordDraws(VkCommandBuffer commandBuffer, uint32_t imageIndex, size_t begin, size_t end) {
+                // viewport and scissor are dynamic states of all the pipelines (and are not inherited
+                // by secondary command buffers)
+                VkViewport viewport{};
+                viewport.x = 0.0f;
+                viewport.y = 0.0f;
+                viewport.width = (float) swapChainExtent.width;
+                viewport.height = (float) swapChainExtent.height;
+                viewport.minDepth = 0.0f;
+                viewport.maxDepth = 1.0f;
+                vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+
+                VkRect2D scissor{};
+                scissor.offset = {0, 0};
+                scissor.extent = swapChainExtent;
+                vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+
+                Pipeline *boundPipeline = nullptr;
+                std::array<DescriptorSet *, DRAW_CALL_DESCRIPTOR_SETS> boundSets{};
+                Model *boundModel = nullptr;
+                InstanceBuffer *boundInstances = nullptr;
+                uint64_t pipelines = 0, pipelinesAvoided = 0;
+                uint64_t descriptorSets = 0, descriptorSetsAvoided = 0;
+                uint64_t models = 0, modelsAvoided = 0;
+
+                for (size_t i = begin; i < end; i++) {
+                        const DrawCall& draw = renderQueue[i];
+
+                        if (draw.pipeline != boundPipeline) {
+                                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                                  draw.pipeline->graphicsPipeline);
+                                pipelines++;
+
+                                // the sets stay bound across pipelines whose layouts have the same set
+                                // layouts up to them (e.g. DS_global at set 0), the following ones do not
+                                size_t compatibleSets = 0;
+                                while (boundPipeline != nullptr
+                                       && compatibleSets < boundPipeline->setLayouts.size()
+                                       && compatibleSets < draw.pipeline->setLayouts.size()
+                                       && boundPipeline->setLayouts[compatibleSets] == draw.pipeline->setLayouts[compatibleSets]) {
+                                        compatibleSets++;
+                                }
+                                for (size_t set = compatibleSets; set < DRAW_CALL_DESCRIPTOR_SETS; set++) {
+                                        boundSets[set] = nullptr;
+                                }
+                                boundPipeline = draw.pipeline;
+                        } else {
+                                pipelinesAvoided++;
+                        }
 
-                        vkCmdEndRenderPass(commandBuffers[i]);
+                        for (uint32_t set = 0; set < DRAW_CALL_DESCRIPTOR_SETS; set++) {
+                                DescriptorSet *DS = draw.descriptorSets[set];
+                                if (DS == nullptr) {
+                                        continue;
+                                }
+                                if (DS == boundSets[set]) {
+                                        descriptorSetsAvoided++;
+                                        continue;
+                                }
+                                vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS,
+                                                        draw.pipeline->pipelineLayout, set, 1,
+                                                        &DS->descriptorSets[imageIndex],
+                                                        static_cast<uint32_t>(DS->dynamicOffsets.size()),
+                                                        DS->dynamicOffsets.data());
+                                descriptorSets++;
+                                boundSets[set] = DS;
+                        }
 
-                        if (vkEndCommandBuffer(commandBuffers[i]) != VK_SUCCESS) {
-                                throw std::runtime_error("failed to record command buffer!");
+                        if (draw.model != boundModel || draw.instances != boundInstances) {
+                                VkBuffer vertexBuffers[] = {draw.model->vertexBuffer,
+                                                            (draw.instances != nullptr) ? draw.instances->buffers[imageIndex]
+                                                                                        : VK_NULL_HANDLE};
+                                VkDeviceSize offsets[] = {0, 0};
+                                vkCmdBindVertexBuffers(commandBuffer, 0, (draw.instances != nullptr) ? 2 : 1,
+                                                       vertexBuffers, offsets);
+                                vkCmdBindIndexBuffer(commandBuffer, draw.model->indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+                                models++;
+                                boundModel = draw.model;
+                                boundInstances = draw.instances;
+                        } else {
+                                modelsAvoided++;
                         }
+
+                        uint32_t indexCount = (draw.indexCount > 0) ? draw.indexCount
+                                                                    : static_cast<uint32_t>(draw.model->indices.size());
+                        vkCmdDrawIndexed(commandBuffer, indexCount, draw.instanceCount, draw.firstIndex, 0, draw.firstInstance);
+                }
+
+                bindCounters.draws += end - begin;
+                bindCounters.pipelines += pipelines;
+                bindCounters.pipelinesAvoided += pipelinesAvoided;
+                bindCounters.descriptorSets += descriptorSets;
+                bindCounters.descriptorSetsAvoided += descriptorSetsAvoided;
+                bindCounters.models += models;
+                bindCounters.modelsAvoided += modelsAvoided;
+        }
+
+        // Records the render queue of the scene repeated up to each of RECORDING_BENCHMARK_DRAWS draws (and
+        // sorted), on 1, 2, 4... threads, without submitting it, and prints the best recording times
+        void benchmarkRecording() {
+                renderQueue.clear();
+                populateRenderQueue(renderQueue);
+                if (renderQueue.size() == 0) {
+                        return;
                 }
+
+                std::vector<uint32_t> threadCounts;
+                for (uint32_t threads = 1; threads < drawRecorder.getThreadCount(); threads *= 2) {
+                        threadCounts.push_back(threads);
+                }
+                threadCounts.push_back(drawRecorder.getThreadCount());
+
+                std::cout << "Command buffer recording (ms, best of " << RECORDING_BENCHMARK_RUNS << " runs)\n"
+                          << std::setw(8) << "draws";
+                for (uint32_t threads : threadCounts) {
+                        std::cout << std::setw(10) << threads << " thr";
+                }
+                std::cout << "\n" << std::fixed << std::setprecision(3);
+
+                for (size_t drawCount : RECORDING_BENCHMARK_DRAWS) {
+                        renderQueue.clear();
+                        while (renderQueue.size() < drawCount) {
+                                populateRenderQueue(renderQueue);
+                        }
+                        renderQueue.truncate(drawCount);
+                        renderQueue.sort();
+
+                        std::cout << std::setw(8) << drawCount;
+                        for (uint32_t threads : threadCounts) {
+                                float bestTime = std::numeric_limits<float>::max();
+                                for (int run = 0; run < RECORDING_BENCHMARK_RUNS; run++) {
+                                        auto start_time = std::chrono::high_resolution_clock::now();
+                                        vkResetCommandPool(device, frameCommandPools[currentFrame], 0);
+                                        drawRecorder.resetFrame(static_cast<uint32_t>(currentFrame));
+                                        recordCommandBuffer(commandBuffers[currentFrame], 0, threads);
+                                        bestTime = std::min(bestTime, std::chrono::duration<float, std::milli>(
+                                                        std::chrono::high_resolution_clock::now() - start_time).count());
+                                }
+                                std::cout << std::setw(14) << bestTime;
+                        }
+                        std::cout << "\n";
+                }
+                std::cout << std::defaultfloat;
+        }
+
+        // Uploads a known vertex and index buffer with createGeometryBuffer, through the staging buffer into
+        // DEVICE_LOCAL memory and then directly into HOST_VISIBLE memory, copies each of them back into a
+        // host-visible buffer, and compares the bytes with the ones uploaded; false if any of them differs
+        bool checkGeometryUpload() {
+                releaseUploadBatch(true);
+
+                std::vector<Vertex> checkVertices(GEOMETRY_CHECK_VERTICES);
+                std::vector<uint32_t> checkIndices(3 * GEOMETRY_CHECK_VERTICES);
+                for (size_t i = 0; i < checkVertices.size(); i++) {
+                        float value = static_cast<float>(i);
+                        checkVertices[i].pos = glm::vec3(value, -value, value * 0.5f);
+                        checkVertices[i].norm = glm::vec3(0.0f, 1.0f, value * 0.25f);
+                        checkVertices[i].texCoord = glm::vec2(value / checkVertices.size(), 1.0f - value / checkVertices.size());
+                }
+                for (size_t i = 0; i < checkIndices.size(); i++) {
+                        checkIndices[i] = static_cast<uint32_t>((i * 7919) % checkVertices.size());
+                }
+
+                struct GeometryContents {
+                        const char* name;
+                        const void* data;
+                        VkDeviceSize size;
+                        VkBufferUsageFlags usage;
+                };
+                const std::array<GeometryContents, 2> contents = {{
+                        {"vertex buffer", checkVertices.data(), checkVertices.size() * sizeof(Vertex), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT},
+                        {"index buffer", checkIndices.data(), checkIndices.size() * sizeof(uint32_t), VK_BUFFER_USAGE_INDEX_BUFFER_BIT},
+                }};
+
+                bool wasHostVisibleGeometry = hostVisibleGeometry;
+                bool isCorrect = true;
+                for (bool hostVisible : {false, true}) {
+                        hostVisibleGeometry = hostVisible;
+                        for (const auto& content : contents) {
+                                VkBuffer buffer;
+                                GpuAllocation bufferMemory;
+                                createGeometryBuffer(content.data, content.size, content.usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                                     buffer, bufferMemory);
+
+                                VkBuffer readbackBuffer;
+                                GpuAllocation readbackBufferMemory;
+                                createBuffer(content.size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                             VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                             VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                             readbackBuffer, readbackBufferMemory);
+
+                                VkCommandBuffer commandBuffer = beginSingleTimeCommands();
+                                VkBufferCopy copyRegion{};
+                                copyRegion.size = content.size;
+                                vkCmdCopyBuffer(commandBuffer, buffer, readbackBuffer, 1, &copyRegion);
+
+                                // make the copy visible to the reads of the host once the queue is idle
+                                VkMemoryBarrier barrier{};
+                                barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                                barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                                barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+                                vkCmdPipelineBarrier(commandBuffer,
+                                                     VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                                     VK_PIPELINE_STAGE_HOST_BIT, 0,
+                                                     1, &barrier, 0, nullptr, 0, nullptr);
+                                endSingleTimeCommands(commandBuffer);
+
+                                bool isMatching = memcmp(allocator.map(readbackBufferMemory), content.data, (size_t) content.size) == 0;
+                                isCorrect = isCorrect && isMatching;
+                                std::cout << "  " << content.name << " (" << content.size / 1024 << " KiB) in "
+                                          << (hostVisible ? "HOST_VISIBLE" : "DEVICE_LOCAL") << " memory: "
+                                          << (isMatching ? "ok" : "MISMATCH") << "\n";
+
+                                destroyBuffer(readbackBuffer, readbackBufferMemory);
+                                destroyBuffer(buffer, bufferMemory);
+                        }
+                }
+                hostVisibleGeometry = wasHostVisibleGeometry;
+
+                std::cout << (isCorrect ? "  all checks passed\n" : "  CHECKS FAILED\n");
+                return isCorrect;
         }
 
         // Lesson 22.5
@@ -1447,9 +2726,15 @@ protected:
 
         // Lesson 22.6
         void drawFrame() {
+                traceFrameTime();
+
                 vkWaitForFences(device, 1, &inFlightFences[currentFrame],
                                 VK_TRUE, UINT64_MAX);
 
+                readFrameTimestamps();
+                releaseUploadBatch(false);
+                flushDeferredDestructions(false);
+
                 uint32_t imageIndex;
 
                 VkResult result = vkAcquireNextImageKHR(device, swapChain, UINT64_MAX,
@@ -1468,8 +2753,21 @@ protected:
                 }
                 imagesInFlight[imageIndex] = inFlightFences[currentFrame];
 
+                auto cpu_start_time = std::chrono::high_resolution_clock::now();
+
                 updateUniformBuffer(imageIndex);
 
+                // the fence of this frame has signaled, so its command buffer can be recorded again
+                auto recording_start_time = std::chrono::high_resolution_clock::now();
+                vkResetCommandPool(device, frameCommandPools[currentFrame], 0);
+                drawRecorder.resetFrame(static_cast<uint32_t>(currentFrame));
+                renderQueue.clear();
+                populateRenderQueue(renderQueue);
+                renderQueue.sort();
+                recordCommandBuffer(commandBuffers[currentFrame], imageIndex, drawRecorder.chunkCount(renderQueue.size()));
+                traceRecordingTime(std::chrono::duration<float, std::milli>(
+                                std::chrono::high_resolution_clock::now() - recording_start_time).count());
+
                 VkSubmitInfo submitInfo{};
                 submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
                 VkSemaphore waitSemaphores[] = {imageAvailableSemaphores[currentFrame]};
@@ -1479,7 +2777,7 @@ protected:
                 submitInfo.pWaitSemaphores = waitSemaphores;
                 submitInfo.pWaitDstStageMask = waitStages;
                 submitInfo.commandBufferCount = 1;
-                submitInfo.pCommandBuffers = &commandBuffers[imageIndex];
+                submitInfo.pCommandBuffers = &commandBuffers[currentFrame];
                 VkSemaphore signalSemaphores[] = {renderFinishedSemaphores[currentFrame]};
                 submitInfo.signalSemaphoreCount = 1;
                 submitInfo.pSignalSemaphores = signalSemaphores;
@@ -1490,6 +2788,10 @@ protected:
                                   inFlightFences[currentFrame]) != VK_SUCCESS) {
                         throw std::runtime_error("Failed to submit draw command buffer!");
                 }
+                frameSerials[currentFrame] = ++submittedFrames;
+                hasTimestamps[currentFrame] = true;
+                lastCpuFrameTime = std::chrono::duration<float, std::milli>(
+                                std::chrono::high_resolution_clock::now() - cpu_start_time).count();
                 
                 VkPresentInfoKHR presentInfo{};
                 presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
@@ -1525,8 +2827,12 @@ protected:
         // All lessons
 
         void cleanup() {
-        		
+        		releaseUploadBatch(true);
+        		flushDeferredDestructions(true);
+
         		cleanupSwapChain();
+        		cleanupPipelines();
+        		cleanupDescriptorSets();
 
                 localCleanup();
 
@@ -1536,8 +2842,19 @@ protected:
                         vkDestroyFence(device, inFlightFences[i], nullptr);
                 }
 
+                drawRecorder.cleanup();
+                if (timestampQueryPool != VK_NULL_HANDLE) {
+                        vkDestroyQueryPool(device, timestampQueryPool, nullptr);
+                }
+                for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+                        vkDestroyCommandPool(device, frameCommandPools[i], nullptr);
+                }
                 vkDestroyCommandPool(device, commandPool, nullptr);
 
+                savePipelineCache();
+                vkDestroyPipelineCache(device, pipelineCache, nullptr);
+
+                allocator.cleanup();
                 vkDestroyDevice(device, nullptr);
 
                 DestroyDebugUtilsMessengerEXT(instance, debugMessenger, nullptr);
@@ -1556,85 +2873,274 @@ protected:
 
 void Model::loadModel(std::string file) {
         tinyobj::attrib_t attrib;
-        std::vector<tinyobj::shape_t> shapes;
-        std::vector<tinyobj::material_t> materials;
-        std::string warn, err;
+        std::vector<tinyobj::index_t> objIndices;
 
-        if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
-                              file.c_str())) {
-                throw std::runtime_error(warn + err);
+        // Big models are parsed on all the cores, the others (or the unsupported ones) by tinyobj
+        if (!loadObjParallel(file, attrib, objIndices)) {
+                std::vector<tinyobj::shape_t> shapes;
+                std::vector<tinyobj::material_t> materials;
+                std::string warn, err;
+
+                if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err,
+                                      file.c_str())) {
+                        throw std::runtime_error(warn + err);
+                }
+
+                for (const auto& shape : shapes) {
+                        objIndices.insert(objIndices.end(), shape.mesh.indices.begin(), shape.mesh.indices.end());
+                }
         }
 
-        for (const auto& shape : shapes) {
-                for (const auto& index : shape.mesh.indices) {
-                        Vertex vertex{};
+        size_t expandedCount = objIndices.size();
 
-                        vertex.pos = {
-                                        attrib.vertices[3 * index.vertex_index + 0],
-                                        attrib.vertices[3 * index.vertex_index + 1],
-                                        attrib.vertices[3 * index.vertex_index + 2]
-                        };
+        // Identical (pos, norm, texCoord) tuples are stored only once,
+        // so that the index buffer references shared vertices
+        std::unordered_map<Vertex, uint32_t> uniqueVertices;
+        uniqueVertices.reserve(expandedCount);
+        indices.reserve(expandedCount);
 
-                        vertex.texCoord = {
-                                        attrib.texcoords[2 * index.texcoord_index + 0],
-                                        1 - attrib.texcoords[2 * index.texcoord_index + 1]
-                        };
+        for (const auto& index : objIndices) {
+                Vertex vertex{};
 
-                        vertex.norm = {
-                                        attrib.normals[3 * index.normal_index + 0],
-                                        attrib.normals[3 * index.normal_index + 1],
-                                        attrib.normals[3 * index.normal_index + 2]
-                        };
+                vertex.pos = {
+                                attrib.vertices[3 * index.vertex_index + 0],
+                                attrib.vertices[3 * index.vertex_index + 1],
+                                attrib.vertices[3 * index.vertex_index + 2]
+                };
+
+                vertex.texCoord = {
+                                attrib.texcoords[2 * index.texcoord_index + 0],
+                                1 - attrib.texcoords[2 * index.texcoord_index + 1]
+                };
 
+                vertex.norm = {
+                                attrib.normals[3 * index.normal_index + 0],
+                                attrib.normals[3 * index.normal_index + 1],
+                                attrib.normals[3 * index.normal_index + 2]
+                };
+
+                auto inserted = uniqueVertices.emplace(vertex, static_cast<uint32_t>(vertices.size()));
+                if (inserted.second) {
                         vertices.push_back(vertex);
-                        indices.push_back(vertices.size()-1);
                 }
+                indices.push_back(inserted.first->second);
+        }
+
+        boundingBoxMin = boundingBoxMax = vertices.empty() ? glm::vec3(0.0f) : vertices[0].pos;
+        for (const auto& vertex : vertices) {
+                boundingBoxMin = glm::min(boundingBoxMin, vertex.pos);
+                boundingBoxMax = glm::max(boundingBoxMax, vertex.pos);
+        }
+
+        std::cout << file << " -> vertices: " << vertices.size() << " unique / "
+                  << expandedCount << " expanded, saved "
+                  << (expandedCount - vertices.size()) * sizeof(Vertex) / 1024 << " KiB\n";
+}
+
+
+// Load vertices and indices from the .meshbin cache, mapped in memory.
+// Returns false (and leaves the model empty) if the cache is missing or stale.
+bool Model::loadModelCache(std::string file, std::string cacheFile) {
+        struct stat sourceStat;
+        if (stat(file.c_str(), &sourceStat) != 0) {
+                return false;
+        }
+
+        int fd = open(cacheFile.c_str(), O_RDONLY);
+        if (fd < 0) {
+                return false;
+        }
+
+        struct stat cacheStat;
+        if (fstat(fd, &cacheStat) != 0 || cacheStat.st_size < (off_t) sizeof(MeshCacheHeader)) {
+                close(fd);
+                return false;
+        }
+
+        size_t cacheSize = static_cast<size_t>(cacheStat.st_size);
+        void* mapped = mmap(nullptr, cacheSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapped == MAP_FAILED) {
+                return false;
+        }
+
+        const unsigned char* bytes = static_cast<const unsigned char*>(mapped);
+        MeshCacheHeader header;
+        memcpy(&header, bytes, sizeof(header));
+
+        size_t vertexBytes = header.vertexCount * sizeof(Vertex);
+        size_t indexBytes = header.indexCount * sizeof(uint32_t);
+
+        bool isValid = memcmp(header.magic, "MESHBIN", 8) == 0
+                       && header.version == MESH_CACHE_VERSION
+                       && header.vertexSize == sizeof(Vertex)
+                       && header.sourceSize == static_cast<uint64_t>(sourceStat.st_size)
+                       && header.sourceModificationTime == static_cast<int64_t>(sourceStat.st_mtime)
+                       && cacheSize == sizeof(MeshCacheHeader) + vertexBytes + indexBytes
+                       && header.checksum == cacheChecksum(bytes + sizeof(MeshCacheHeader),
+                                                               vertexBytes + indexBytes);
+
+        if (isValid) {
+                const Vertex* cachedVertices = reinterpret_cast<const Vertex*>(bytes + sizeof(MeshCacheHeader));
+                const uint32_t* cachedIndices = reinterpret_cast<const uint32_t*>(bytes + sizeof(MeshCacheHeader) + vertexBytes);
+                vertices.assign(cachedVertices, cachedVertices + header.vertexCount);
+                indices.assign(cachedIndices, cachedIndices + header.indexCount);
+                boundingBoxMin = header.boundingBoxMin;
+                boundingBoxMax = header.boundingBoxMax;
+
+                std::cout << cacheFile << " -> vertices: " << vertices.size()
+                          << ", indices: " << indices.size() << " (cached)\n";
+        } else {
+                std::cout << cacheFile << " -> stale or missing, parsing " << file << "\n";
         }
 
+        munmap(mapped, cacheSize);
+        return isValid;
+}
 
+// Write the .meshbin cache of a model just parsed from its .obj file.
+// The cache is written to a temporary file and then renamed, so that readers never see it partially written.
+void Model::saveModelCache(std::string file, std::string cacheFile) {
+        struct stat sourceStat;
+        if (stat(file.c_str(), &sourceStat) != 0) {
+                return;
+        }
+
+        size_t vertexBytes = vertices.size() * sizeof(Vertex);
+        size_t indexBytes = indices.size() * sizeof(uint32_t);
+
+        std::vector<unsigned char> payload(vertexBytes + indexBytes);
+        memcpy(payload.data(), vertices.data(), vertexBytes);
+        memcpy(payload.data() + vertexBytes, indices.data(), indexBytes);
+
+        MeshCacheHeader header{};
+        memcpy(header.magic, "MESHBIN", 8);
+        header.version = MESH_CACHE_VERSION;
+        header.vertexSize = sizeof(Vertex);
+        header.sourceSize = static_cast<uint64_t>(sourceStat.st_size);
+        header.sourceModificationTime = static_cast<int64_t>(sourceStat.st_mtime);
+        header.vertexCount = vertices.size();
+        header.indexCount = indices.size();
+        header.boundingBoxMin = boundingBoxMin;
+        header.boundingBoxMax = boundingBoxMax;
+        header.checksum = cacheChecksum(payload.data(), payload.size());
+
+        std::string tmpFile = cacheFile + ".tmp";
+        std::ofstream out(tmpFile, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(payload.data()), payload.size());
+        out.close();
+
+        if (!out || std::rename(tmpFile.c_str(), cacheFile.c_str()) != 0) {
+                std::cout << "Unable to write mesh cache " << cacheFile << "\n";
+                std::remove(tmpFile.c_str());
+        }
 }
 
 // Lesson 21
 void Model::createVertexBuffer() {
         VkDeviceSize bufferSize = sizeof(vertices[0]) * vertices.size();
 
-        BP->createBuffer(bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
-                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                         vertexBuffer, vertexBufferMemory);
-
-        void* data;
-        vkMapMemory(BP->device, vertexBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, vertices.data(), (size_t) bufferSize);
-        vkUnmapMemory(BP->device, vertexBufferMemory);
+        BP->createGeometryBuffer(vertices.data(), bufferSize, VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                                 vertexBuffer, vertexBufferMemory);
 }
 
 void Model::createIndexBuffer() {
         VkDeviceSize bufferSize = sizeof(indices[0]) * indices.size();
 
-        BP->createBuffer(bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
-                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                         indexBuffer, indexBufferMemory);
+        BP->createGeometryBuffer(indices.data(), bufferSize, VK_BUFFER_USAGE_INDEX_BUFFER_BIT,
+                                 indexBuffer, indexBufferMemory);
+}
+
+// CPU-side loading only, so that it can run on the worker threads of the AssetLoader
+void Model::load(std::string file) {
+        std::string cacheFile = file.substr(0, file.find_last_of('.')) + ".meshbin";
+        if (!loadModelCache(file, cacheFile)) {
+                loadModel(file);
+                saveModelCache(file, cacheFile);
+        }
+}
+
+// Reorders the triangles so that the ones whose centre falls in the same cell of a tilesPerSide x tilesPerSide
+// grid on the xz plane are contiguous in the index buffer, so that each tile can be culled and drawn on its own
+void Model::splitIntoTiles(int tilesPerSide) {
+        glm::vec2 gridMin(boundingBoxMin.x, boundingBoxMin.z);
+        glm::vec2 cellSize = glm::max(glm::vec2(boundingBoxMax.x, boundingBoxMax.z) - gridMin, glm::vec2(1e-6f))
+                             / static_cast<float>(tilesPerSide);
+        size_t triangleCount = indices.size() / 3;
+
+        std::vector<uint32_t> triangleTiles(triangleCount);
+        std::vector<uint32_t> tileStarts(tilesPerSide * tilesPerSide + 1, 0);
+        for (size_t t = 0; t < triangleCount; t++) {
+                glm::vec3 centre = (vertices[indices[3 * t]].pos + vertices[indices[3 * t + 1]].pos
+                                    + vertices[indices[3 * t + 2]].pos) / 3.0f;
+                glm::ivec2 cell = glm::clamp(glm::ivec2((glm::vec2(centre.x, centre.z) - gridMin) / cellSize),
+                                             0, tilesPerSide - 1);
+                triangleTiles[t] = cell.y * tilesPerSide + cell.x;
+                tileStarts[triangleTiles[t] + 1] += 3;
+        }
+        for (size_t tile = 1; tile < tileStarts.size(); tile++) {
+                tileStarts[tile] += tileStarts[tile - 1];
+        }
+
+        // counting sort of the triangles by tile, keeping their order inside each tile
+        std::vector<uint32_t> sortedIndices(indices.size());
+        std::vector<uint32_t> next(tileStarts.begin(), tileStarts.end() - 1);
+        for (size_t t = 0; t < triangleCount; t++) {
+                uint32_t& position = next[triangleTiles[t]];
+                for (int corner = 0; corner < 3; corner++) {
+                        sortedIndices[position++] = indices[3 * t + corner];
+                }
+        }
+        indices = std::move(sortedIndices);
+
+        tiles.clear();
+        for (size_t tile = 0; tile + 1 < tileStarts.size(); tile++) {
+                if (tileStarts[tile] == tileStarts[tile + 1]) {
+                        continue;
+                }
+                ModelTile modelTile{tileStarts[tile], tileStarts[tile + 1] - tileStarts[tile],
+                                    glm::vec3(std::numeric_limits<float>::max()),
+                                    glm::vec3(std::numeric_limits<float>::lowest())};
+                for (uint32_t i = modelTile.firstIndex; i < modelTile.firstIndex + modelTile.indexCount; i++) {
+                        modelTile.boundingBoxMin = glm::min(modelTile.boundingBoxMin, vertices[indices[i]].pos);
+                        modelTile.boundingBoxMax = glm::max(modelTile.boundingBoxMax, vertices[indices[i]].pos);
+                }
+                tiles.push_back(modelTile);
+        }
+}
+
+void Model::init(BaseProject *bp, std::string file, int tilesPerSide) {
+        BP = bp;
+        BP->assetLoader.takeModel(file, *this);
+        if (tilesPerSide > 0) {
+                splitIntoTiles(tilesPerSide);
+        }
 
-        void* data;
-        vkMapMemory(BP->device, indexBufferMemory, 0, bufferSize, 0, &data);
-        memcpy(data, indices.data(), (size_t) bufferSize);
-        vkUnmapMemory(BP->device, indexBufferMemory);
+        createVertexBuffer();
+        createIndexBuffer();
 }
 
-void Model::init(BaseProject *bp, std::string file) {
+// Model generated by the application instead of being loaded from an .obj file
+void Model::initMesh(BaseProject *bp, const std::vector<Vertex>& meshVertices, const std::vector<uint32_t>& meshIndices) {
         BP = bp;
-        loadModel(file);
+        vertices = meshVertices;
+        indices = meshIndices;
+
+        boundingBoxMin = glm::vec3(std::numeric_limits<float>::max());
+        boundingBoxMax = glm::vec3(std::numeric_limits<float>::lowest());
+        for (const auto& vertex : vertices) {
+                boundingBoxMin = glm::min(boundingBoxMin, vertex.pos);
+                boundingBoxMax = glm::max(boundingBoxMax, vertex.pos);
+        }
+
         createVertexBuffer();
         createIndexBuffer();
 }
 
 void Model::cleanup() {
-        vkDestroyBuffer(BP->device, indexBuffer, nullptr);
-        vkFreeMemory(BP->device, indexBufferMemory, nullptr);
-        vkDestroyBuffer(BP->device, vertexBuffer, nullptr);
-        vkFreeMemory(BP->device, vertexBufferMemory, nullptr);
+        BP->destroyBuffer(indexBuffer, indexBufferMemory);
+        BP->destroyBuffer(vertexBuffer, vertexBufferMemory);
 }
 
 
@@ -1643,31 +3149,37 @@ void Model::cleanup() {
 
 
 
-void Texture::createTextureImage(std::string file) {
-        int texWidth, texHeight, texChannels;
-        stbi_uc* pixels = stbi_load(file.c_str(), &texWidth, &texHeight,
-                                    &texChannels, STBI_rgb_alpha);
+TextureData TextureData::load(std::string file) {
+        TextureData data;
+        stbi_uc* pixels = stbi_load(file.c_str(), &data.width, &data.height,
+                                    &data.channels, STBI_rgb_alpha);
         if (!pixels) {
+                std::cout << file << "\n";
                 throw std::runtime_error("failed to load texture image!");
         }
+        data.pixels = std::shared_ptr<stbi_uc>(pixels, stbi_image_free);
+        return data;
+}
+
+void Texture::createTextureImage(std::string file) {
+        TextureData image = BP->assetLoader.takeTexture(file);
+        int texWidth = image.width;
+        int texHeight = image.height;
 
         VkDeviceSize imageSize = texWidth * texHeight * 4;
         mipLevels = static_cast<uint32_t>(std::floor(
                         std::log2(std::max(texWidth, texHeight)))) + 1;
 
         VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
+        GpuAllocation stagingBufferMemory;
 
         BP->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                          VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
                          VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                          stagingBuffer, stagingBufferMemory);
-        void* data;
-        vkMapMemory(BP->device, stagingBufferMemory, 0, imageSize, 0, &data);
-        memcpy(data, pixels, static_cast<size_t>(imageSize));
-        vkUnmapMemory(BP->device, stagingBufferMemory);
+        memcpy(BP->allocator.map(stagingBufferMemory), image.pixels.get(), static_cast<size_t>(imageSize));
 
-        stbi_image_free(pixels);
+        image.pixels.reset();
 
         BP->createImage(texWidth, texHeight, mipLevels, VK_FORMAT_R8G8B8A8_SRGB,
                         VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_SRC_BIT |
@@ -1683,8 +3195,7 @@ void Texture::createTextureImage(std::string file) {
         BP->generateMipmaps(textureImage, VK_FORMAT_R8G8B8A8_SRGB,
                             texWidth, texHeight, mipLevels, 1);
 
-        vkDestroyBuffer(BP->device, stagingBuffer, nullptr);
-        vkFreeMemory(BP->device, stagingBufferMemory, nullptr);
+        BP->destroyStagingBuffer(stagingBuffer, stagingBufferMemory, imageSize);
 }
 
 void Texture::createTextureImageView() {
@@ -1730,11 +3241,96 @@ void Texture::init(BaseProject *bp, std::string file) {
         createTextureSampler();
 }
 
+// R32_SFLOAT cannot be filtered linearly on every device, so the shaders interpolate the texels themselves
+void Texture::createHeightMapImage(const std::vector<float>& heights, uint32_t width, uint32_t height) {
+        VkDeviceSize imageSize = static_cast<VkDeviceSize>(width) * height * sizeof(float);
+        mipLevels = 1;
+
+        VkBuffer stagingBuffer;
+        GpuAllocation stagingBufferMemory;
+
+        BP->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                         VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                         stagingBuffer, stagingBufferMemory);
+        memcpy(BP->allocator.map(stagingBufferMemory), heights.data(), static_cast<size_t>(imageSize));
+
+        BP->createImage(width, height, mipLevels, VK_FORMAT_R32_SFLOAT,
+                        VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, textureImage,
+                        textureImageMemory);
+
+        BP->transitionImageLayout(textureImage, VK_FORMAT_R32_SFLOAT,
+                                  VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, mipLevels, 1);
+        BP->copyBufferToImage(stagingBuffer, textureImage, width, height, 1);
+
+        // read by the vertex shader, not by the fragment shader like the other textures
+        VkCommandBuffer commandBuffer = BP->beginSingleTimeCommands();
+
+        VkImageMemoryBarrier barrier{};
+        barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        barrier.image = textureImage;
+        barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        barrier.subresourceRange.baseMipLevel = 0;
+        barrier.subresourceRange.levelCount = mipLevels;
+        barrier.subresourceRange.baseArrayLayer = 0;
+        barrier.subresourceRange.layerCount = 1;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+
+        vkCmdPipelineBarrier(commandBuffer,
+                             VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0,
+                             0, nullptr, 0, nullptr, 1, &barrier);
+
+        BP->endSingleTimeCommands(commandBuffer);
+
+        BP->destroyStagingBuffer(stagingBuffer, stagingBufferMemory, imageSize);
+}
+
+void Texture::createHeightMapSampler() {
+        VkSamplerCreateInfo samplerInfo{};
+        samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+        samplerInfo.magFilter = VK_FILTER_NEAREST;
+        samplerInfo.minFilter = VK_FILTER_NEAREST;
+        samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        samplerInfo.anisotropyEnable = VK_FALSE;
+        samplerInfo.maxAnisotropy = 1.0f;
+        samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+        samplerInfo.unnormalizedCoordinates = VK_FALSE;
+        samplerInfo.compareEnable = VK_FALSE;
+        samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+        samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+        samplerInfo.mipLodBias = 0.0f;
+        samplerInfo.minLod = 0.0f;
+        samplerInfo.maxLod = 0.0f;
+
+        VkResult result = vkCreateSampler(BP->device, &samplerInfo, nullptr,
+                                          &textureSampler);
+        if (result != VK_SUCCESS) {
+                PrintVkError(result);
+                throw std::runtime_error("failed to create texture sampler!");
+        }
+}
+
+void Texture::initHeightMap(BaseProject *bp, const std::vector<float>& heights, uint32_t width, uint32_t height) {
+        BP = bp;
+        createHeightMapImage(heights, width, height);
+        textureImageView = BP->createImageView(textureImage, VK_FORMAT_R32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT,
+                                               mipLevels, VK_IMAGE_VIEW_TYPE_2D, 1);
+        createHeightMapSampler();
+}
+
 void Texture::cleanup() {
         vkDestroySampler(BP->device, textureSampler, nullptr);
         vkDestroyImageView(BP->device, textureImageView, nullptr);
         vkDestroyImage(BP->device, textureImage, nullptr);
-        vkFreeMemory(BP->device, textureImageMemory, nullptr);
+        BP->allocator.free(textureImageMemory);
 }
 
 void SkyBoxTexture::init(BaseProject *bp, std::vector<std::string> textures) {
@@ -1745,18 +3341,18 @@ void SkyBoxTexture::init(BaseProject *bp, std::vector<std::string> textures) {
 }
 
 void SkyBoxTexture::createCubicTextureImage(std::vector<std::string> textures) {
-		int texWidth, texHeight, texChannels;
-		stbi_uc* pixels[6];
+		int texWidth, texHeight;
+		TextureData faces[6];
 
 		for(int i = 0; i < 6; i++) {
-			pixels[i] = stbi_load((TEXTURE_PATH + textures[i]).c_str(), &texWidth, &texHeight,
-								&texChannels, STBI_rgb_alpha);
-			if (!pixels[i]) {
-				std::cout << (TEXTURE_PATH + textures[i]).c_str() << "\n";
-				throw std::runtime_error("failed to load texture image!");
+			faces[i] = TD.BP->assetLoader.takeTexture(TEXTURE_PATH + textures[i]);
+			if (i > 0 && (faces[i].width != texWidth || faces[i].height != texHeight)) {
+				throw std::runtime_error("sky box faces have different sizes!");
 			}
+			texWidth = faces[i].width;
+			texHeight = faces[i].height;
 			std::cout << TEXTURE_PATH + textures[i] << " -> size: " << texWidth
-					  << "x" << texHeight << ", ch: " << texChannels <<"\n";
+					  << "x" << texHeight << ", ch: " << faces[i].channels <<"\n";
 		}
 
 		VkDeviceSize imageSize = texWidth * texHeight * 4;
@@ -1765,7 +3361,7 @@ void SkyBoxTexture::createCubicTextureImage(std::vector<std::string> textures) {
 						std::log2(std::max(texWidth, texHeight)))) + 1;
 		
 		VkBuffer stagingBuffer;
-		VkDeviceMemory stagingBufferMemory;
+		GpuAllocation stagingBufferMemory;
 		
 		TD.BP->createBuffer(totalImageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
 		  						VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
@@ -1773,17 +3369,15 @@ void SkyBoxTexture::createCubicTextureImage(std::vector<std::string> textures) {
 		  						stagingBuffer, stagingBufferMemory);
 		  						
 		
-		void* data;
-		vkMapMemory(TD.BP->device, stagingBufferMemory, 0, totalImageSize, 0, &data);
+		void* data = TD.BP->allocator.map(stagingBufferMemory);
 		
 		for(int i = 0; i < 6; i++) {
-			memcpy(static_cast<char *>(data) + imageSize * i, pixels[i], static_cast<size_t>(imageSize));
+			memcpy(static_cast<char *>(data) + imageSize * i, faces[i].pixels.get(), static_cast<size_t>(imageSize));
 		}
-		vkUnmapMemory(TD.BP->device, stagingBufferMemory);
 		
 			
 		for(int i = 0; i < 6; i++) {
-			stbi_image_free(pixels[i]);
+			faces[i].pixels.reset();
 		}			
 		createSkyBoxImage(texWidth, texHeight, TD.mipLevels, TD.textureImage,
 					TD.textureImageMemory);
@@ -1797,11 +3391,10 @@ void SkyBoxTexture::createCubicTextureImage(std::vector<std::string> textures) {
 		TD.BP->generateMipmaps(TD.textureImage, VK_FORMAT_R8G8B8A8_SRGB,
 						texWidth, texHeight, TD.mipLevels, 6);
 
-		vkDestroyBuffer(TD.BP->device, stagingBuffer, nullptr);
-		vkFreeMemory(TD.BP->device, stagingBufferMemory, nullptr);
+		TD.BP->destroyStagingBuffer(stagingBuffer, stagingBufferMemory, totalImageSize);
 }
 
-void SkyBoxTexture::createSkyBoxImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkImage& image, VkDeviceMemory& imageMemory) {
+void SkyBoxTexture::createSkyBoxImage(uint32_t width, uint32_t height, uint32_t mipLevels, VkImage& image, GpuAllocation& imageMemory) {
 		VkImageCreateInfo imageInfo{};
 		imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
 		imageInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -1827,17 +3420,12 @@ void SkyBoxTexture::createSkyBoxImage(uint32_t width, uint32_t height, uint32_t
 		VkMemoryRequirements memRequirements;
 		vkGetImageMemoryRequirements(TD.BP->device, image, &memRequirements);
 
-		VkMemoryAllocateInfo allocInfo{};
-		allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-		allocInfo.allocationSize = memRequirements.size;
-		allocInfo.memoryTypeIndex = TD.BP->findMemoryType(memRequirements.memoryTypeBits,
-											VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-		if (vkAllocateMemory(TD.BP->device, &allocInfo, nullptr, &imageMemory) !=
-								VK_SUCCESS) {
-			throw std::runtime_error("failed to allocate image memory!");
-		}
+		imageMemory = TD.BP->allocator.allocate(memRequirements,
+							TD.BP->findMemoryType(memRequirements.memoryTypeBits,
+											VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT),
+							false);
 
-		vkBindImageMemory(TD.BP->device, image, imageMemory, 0);
+		vkBindImageMemory(TD.BP->device, image, imageMemory.memory, imageMemory.offset);
 }
 
 void SkyBoxTexture::createSkyBoxImageView() {
@@ -1879,7 +3467,7 @@ void SkyBoxTexture::cleanup() {
         vkDestroySampler(TD.BP->device, TD.textureSampler, nullptr);
         vkDestroyImageView(TD.BP->device, TD.textureImageView, nullptr);
         vkDestroyImage(TD.BP->device, TD.textureImage, nullptr);
-        vkFreeMemory(TD.BP->device, TD.textureImageMemory, nullptr);
+        TD.BP->allocator.free(TD.textureImageMemory);
 }
 
 
@@ -1887,7 +3475,8 @@ void SkyBoxTexture::cleanup() {
 
 
 void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
-                    std::vector<DescriptorSetLayout *> D, VkCompareOp compareOp) {
+                    std::vector<DescriptorSetLayout *> D, VkCompareOp compareOp,
+                    const std::vector<int32_t>& fragConstants, bool instanced) {
         BP = bp;
 
         auto vertShaderCode = readFile(VertShader);
@@ -1917,6 +3506,21 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
         fragShaderStageInfo.module = fragShaderModule;
         fragShaderStageInfo.pName = "main";
 
+        std::vector<VkSpecializationMapEntry> specializationEntries(fragConstants.size());
+        for (uint32_t i = 0; i < fragConstants.size(); i++) {
+                specializationEntries[i].constantID = i;
+                specializationEntries[i].offset = i * sizeof(int32_t);
+                specializationEntries[i].size = sizeof(int32_t);
+        }
+        VkSpecializationInfo specializationInfo{};
+        specializationInfo.mapEntryCount = static_cast<uint32_t>(specializationEntries.size());
+        specializationInfo.pMapEntries = specializationEntries.data();
+        specializationInfo.dataSize = fragConstants.size() * sizeof(int32_t);
+        specializationInfo.pData = fragConstants.data();
+        if (!fragConstants.empty()) {
+                fragShaderStageInfo.pSpecializationInfo = &specializationInfo;
+        }
+
         VkPipelineShaderStageCreateInfo shaderStages[] =
                         {vertShaderStageInfo, fragShaderStageInfo};
 
@@ -1924,13 +3528,22 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
         VkPipelineVertexInputStateCreateInfo vertexInputInfo{};
         vertexInputInfo.sType =
                         VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-        auto bindingDescription = Vertex::getBindingDescription();
-        auto attributeDescriptions = Vertex::getAttributeDescriptions();
-
-        vertexInputInfo.vertexBindingDescriptionCount = 1;
+        std::vector<VkVertexInputBindingDescription> bindingDescriptions = {Vertex::getBindingDescription()};
+        auto vertexAttributes = Vertex::getAttributeDescriptions();
+        std::vector<VkVertexInputAttributeDescription> attributeDescriptions(vertexAttributes.begin(),
+                                                                             vertexAttributes.end());
+        if (instanced) {
+                bindingDescriptions.push_back(InstanceData::getBindingDescription());
+                auto instanceAttributes = InstanceData::getAttributeDescriptions();
+                attributeDescriptions.insert(attributeDescriptions.end(), instanceAttributes.begin(),
+                                             instanceAttributes.end());
+        }
+
+        vertexInputInfo.vertexBindingDescriptionCount =
+                        static_cast<uint32_t>(bindingDescriptions.size());
         vertexInputInfo.vertexAttributeDescriptionCount =
                         static_cast<uint32_t>(attributeDescriptions.size());
-        vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
+        vertexInputInfo.pVertexBindingDescriptions = bindingDescriptions.data();
         vertexInputInfo.pVertexAttributeDescriptions =
                         attributeDescriptions.data();
 
@@ -1941,25 +3554,25 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
         inputAssembly.primitiveRestartEnable = VK_FALSE;
 
         // Lesson 19
-        VkViewport viewport{};
-        viewport.x = 0.0f;
-        viewport.y = 0.0f;
-        viewport.width = (float) BP->swapChainExtent.width;
-        viewport.height = (float) BP->swapChainExtent.height;
-        viewport.minDepth = 0.0f;
-        viewport.maxDepth = 1.0f;
-
-        VkRect2D scissor{};
-        scissor.offset = {0, 0};
-        scissor.extent = BP->swapChainExtent;
-
+        // Viewport and scissor are set when recording the command buffers, so that the
+        // pipelines do not depend on the size of the swapchain
         VkPipelineViewportStateCreateInfo viewportState{};
         viewportState.sType =
                         VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
         viewportState.viewportCount = 1;
-        viewportState.pViewports = &viewport;
+        viewportState.pViewports = nullptr;
         viewportState.scissorCount = 1;
-        viewportState.pScissors = &scissor;
+        viewportState.pScissors = nullptr;
+
+        std::array<VkDynamicState, 2> dynamicStates = {
+                        VK_DYNAMIC_STATE_VIEWPORT,
+                        VK_DYNAMIC_STATE_SCISSOR
+        };
+        VkPipelineDynamicStateCreateInfo dynamicState{};
+        dynamicState.sType =
+                        VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+        dynamicState.dynamicStateCount = static_cast<uint32_t>(dynamicStates.size());
+        dynamicState.pDynamicStates = dynamicStates.data();
 
         VkPipelineRasterizationStateCreateInfo rasterizer{};
         rasterizer.sType =
@@ -2023,6 +3636,8 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
                 DSL[i] = D[i]->descriptorSetLayout;
         }
 
+        setLayouts = DSL;
+
         VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
         pipelineLayoutInfo.sType =
                         VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -2064,19 +3679,27 @@ void Pipeline::init(BaseProject *bp, const std::string& VertShader, const std::s
         pipelineInfo.pMultisampleState = &multisampling;
         pipelineInfo.pDepthStencilState = &depthStencil;
         pipelineInfo.pColorBlendState = &colorBlending;
-        pipelineInfo.pDynamicState = nullptr; // Optional
+        pipelineInfo.pDynamicState = &dynamicState;
         pipelineInfo.layout = pipelineLayout;
         pipelineInfo.renderPass = BP->renderPass;
         pipelineInfo.subpass = 0;
         pipelineInfo.basePipelineHandle = VK_NULL_HANDLE; // Optional
         pipelineInfo.basePipelineIndex = -1; // Optional
 
-        result = vkCreateGraphicsPipelines(BP->device, VK_NULL_HANDLE, 1,
+        auto start_time = std::chrono::high_resolution_clock::now();
+        result = vkCreateGraphicsPipelines(BP->device, BP->pipelineCache, 1,
                                            &pipelineInfo, nullptr, &graphicsPipeline);
         if (result != VK_SUCCESS) {
                 PrintVkError(result);
                 throw std::runtime_error("failed to create graphics pipeline!");
         }
+        std::cout << VertShader << " + " << FragShader;
+        for (size_t i = 0; i < fragConstants.size(); i++) {
+                std::cout << ((i == 0) ? " [" : ", ") << fragConstants[i] << ((i + 1 == fragConstants.size()) ? "]" : "");
+        }
+        std::cout << " -> pipeline created in "
+                  << std::chrono::duration<float, std::milli>(
+                                  std::chrono::high_resolution_clock::now() - start_time).count() << " ms\n";
 
         vkDestroyShaderModule(BP->device, fragShaderModule, nullptr);
         vkDestroyShaderModule(BP->device, vertShaderModule, nullptr);
@@ -2124,6 +3747,22 @@ void Pipeline::cleanup() {
         vkDestroyPipelineLayout(BP->device, pipelineLayout, nullptr);
 }
 
+void PipelineVariants::init(BaseProject *bp, const std::string& VertShader, const std::string& FragShader,
+                            std::vector<DescriptorSetLayout *> D, VkCompareOp compareOp,
+                            const std::vector<std::vector<int32_t>>& fragConstants, bool instanced) {
+        variants.resize(fragConstants.size());
+        for (size_t i = 0; i < fragConstants.size(); i++) {
+                variants[i].init(bp, VertShader, FragShader, D, compareOp, fragConstants[i], instanced);
+        }
+}
+
+void PipelineVariants::cleanup() {
+        for (auto& variant : variants) {
+                variant.cleanup();
+        }
+        variants.clear();
+}
+
 void DescriptorSetLayout::init(BaseProject *bp, std::vector<DescriptorSetLayoutBinding> B) {
         BP = bp;
 
@@ -2157,28 +3796,28 @@ void DescriptorSetLayout::cleanup() {
 void DescriptorSet::initDSSkyBox(BaseProject *bp, DescriptorSetLayout *DSL, std::vector<SkyBoxDescriptorSetElement> E) {
 		BP = bp;
 
-        // Create uniform buffer
-        uniformBuffers.resize(E.size());
-        uniformBuffersMemory.resize(E.size());
-        toFree.resize(E.size());
+        // Reserve the uniform slots in the ring buffer
+        std::vector<uint32_t> uniformOffsets(E.size(), 0);
+        std::vector<std::pair<int, uint32_t>> bindingOffsets;
+        uniformBuffersMapped.resize(E.size());
 
         for (int j = 0; j < E.size(); j++) {
-                uniformBuffers[j].resize(BP->swapChainImages.size());
-                uniformBuffersMemory[j].resize(BP->swapChainImages.size());
+                uniformBuffersMapped[j].assign(BP->swapChainImages.size(), nullptr);
                 if(E[j].type == UNIFORM) {
+                        uniformOffsets[j] = BP->uniformRing.allocate(E[j].size);
+                        bindingOffsets.push_back({E[j].binding, uniformOffsets[j]});
                         for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-                                VkDeviceSize bufferSize = E[j].size;
-                                BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                                                 uniformBuffers[j][i], uniformBuffersMemory[j][i]);
+                                uniformBuffersMapped[j][i] = BP->uniformRing.mapped[i] + uniformOffsets[j];
                         }
-                        toFree[j] = true;
-                } else {
-                        toFree[j] = false;
                 }
         }
 
+        std::sort(bindingOffsets.begin(), bindingOffsets.end());
+        dynamicOffsets.clear();
+        for (const auto& bindingOffset : bindingOffsets) {
+                dynamicOffsets.push_back(bindingOffset.second);
+        }
+
         // Create Descriptor set
         std::vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
                                                    DSL->descriptorSetLayout);
@@ -2203,11 +3842,14 @@ void DescriptorSet::initDSSkyBox(BaseProject *bp, DescriptorSetLayout *DSL, std:
                 std::vector<VkWriteDescriptorSet> descriptorWrites(E.size());
                 std::vector<VkDescriptorBufferInfo> bufferInfoVector;
                 std::vector<VkDescriptorImageInfo> imageInfoVector;
+                bufferInfoVector.reserve(E.size());
+                imageInfoVector.reserve(E.size());
 
                 for (int j = 0; j < E.size(); j++) {
                         if(E[j].type == UNIFORM) {
+                                // the offset of the slot is given as dynamic offset when binding the set
                                 VkDescriptorBufferInfo bufferInfo{};
-                                bufferInfo.buffer = uniformBuffers[j][i];
+                                bufferInfo.buffer = BP->uniformRing.buffers[i];
                                 bufferInfo.offset = 0;
                                 bufferInfo.range = E[j].size;
                                 bufferInfoVector.push_back(bufferInfo);
@@ -2216,7 +3858,7 @@ void DescriptorSet::initDSSkyBox(BaseProject *bp, DescriptorSetLayout *DSL, std:
                                 descriptorWrites[j].dstSet = descriptorSets[i];
                                 descriptorWrites[j].dstBinding = E[j].binding;
                                 descriptorWrites[j].dstArrayElement = 0;
-                                descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+                                descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
                                 descriptorWrites[j].descriptorCount = 1;
                                 descriptorWrites[j].pBufferInfo = &(bufferInfoVector.back());
                         } else if(E[j].type == TEXTURE) {
@@ -2246,28 +3888,28 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
                          std::vector<DescriptorSetElement> E) {
         BP = bp;
 
-        // Create uniform buffer
-        uniformBuffers.resize(E.size());
-        uniformBuffersMemory.resize(E.size());
-        toFree.resize(E.size());
+        // Reserve the uniform slots in the ring buffer
+        std::vector<uint32_t> uniformOffsets(E.size(), 0);
+        std::vector<std::pair<int, uint32_t>> bindingOffsets;
+        uniformBuffersMapped.resize(E.size());
 
         for (int j = 0; j < E.size(); j++) {
-                uniformBuffers[j].resize(BP->swapChainImages.size());
-                uniformBuffersMemory[j].resize(BP->swapChainImages.size());
+                uniformBuffersMapped[j].assign(BP->swapChainImages.size(), nullptr);
                 if(E[j].type == UNIFORM) {
+                        uniformOffsets[j] = BP->uniformRing.allocate(E[j].size);
+                        bindingOffsets.push_back({E[j].binding, uniformOffsets[j]});
                         for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-                                VkDeviceSize bufferSize = E[j].size;
-                                BP->createBuffer(bufferSize, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
-                                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                                                 uniformBuffers[j][i], uniformBuffersMemory[j][i]);
+                                uniformBuffersMapped[j][i] = BP->uniformRing.mapped[i] + uniformOffsets[j];
                         }
-                        toFree[j] = true;
-                } else {
-                        toFree[j] = false;
                 }
         }
 
+        std::sort(bindingOffsets.begin(), bindingOffsets.end());
+        dynamicOffsets.clear();
+        for (const auto& bindingOffset : bindingOffsets) {
+                dynamicOffsets.push_back(bindingOffset.second);
+        }
+
         // Create Descriptor set
         std::vector<VkDescriptorSetLayout> layouts(BP->swapChainImages.size(),
                                                    DSL->descriptorSetLayout);
@@ -2292,11 +3934,14 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
                 std::vector<VkWriteDescriptorSet> descriptorWrites(E.size());
                 std::vector<VkDescriptorBufferInfo> bufferInfoVector;
                 std::vector<VkDescriptorImageInfo> imageInfoVector;
+                bufferInfoVector.reserve(E.size());
+                imageInfoVector.reserve(E.size());
 
                 for (int j = 0; j < E.size(); j++) {
                         if(E[j].type == UNIFORM) {
+                                // the offset of the slot is given as dynamic offset when binding the set
                                 VkDescriptorBufferInfo bufferInfo{};
-                                bufferInfo.buffer = uniformBuffers[j][i];
+                                bufferInfo.buffer = BP->uniformRing.buffers[i];
                                 bufferInfo.offset = 0;
                                 bufferInfo.range = E[j].size;
                                 bufferInfoVector.push_back(bufferInfo);
@@ -2305,7 +3950,7 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
                                 descriptorWrites[j].dstSet = descriptorSets[i];
                                 descriptorWrites[j].dstBinding = E[j].binding;
                                 descriptorWrites[j].dstArrayElement = 0;
-                                descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+                                descriptorWrites[j].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
                                 descriptorWrites[j].descriptorCount = 1;
                                 descriptorWrites[j].pBufferInfo = &(bufferInfoVector.back());
                         } else if(E[j].type == TEXTURE) {
@@ -2333,15 +3978,79 @@ void DescriptorSet::init(BaseProject *bp, DescriptorSetLayout *DSL,
 
 }
 
+// The uniform slots are released all together by UniformRing::cleanup
 void DescriptorSet::cleanup() {
-        for(int j = 0; j < uniformBuffers.size(); j++) {
-                if(toFree[j]) {
-                        for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
-                                vkDestroyBuffer(BP->device, uniformBuffers[j][i], nullptr);
-                                vkFreeMemory(BP->device, uniformBuffersMemory[j][i], nullptr);
-                        }
-                }
+        uniformBuffersMapped.clear();
+        dynamicOffsets.clear();
+}
+
+
+void UniformRing::init(BaseProject *bp, VkDeviceSize size) {
+        BP = bp;
+        this->size = size;
+        head = 0;
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(BP->physicalDevice, &properties);
+        alignment = std::max<VkDeviceSize>(properties.limits.minUniformBufferOffsetAlignment, 1);
+
+        buffers.resize(BP->swapChainImages.size());
+        buffersMemory.resize(BP->swapChainImages.size());
+        mapped.resize(BP->swapChainImages.size());
+
+        for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+                BP->createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                 buffers[i], buffersMemory[i]);
+                mapped[i] = static_cast<char *>(BP->allocator.map(buffersMemory[i]));
+        }
+}
+
+// Returns the offset of a new slot, the same in the buffers of all the swapchain images
+uint32_t UniformRing::allocate(VkDeviceSize size) {
+        VkDeviceSize offset = (head + alignment - 1) / alignment * alignment;
+        if (offset + size > this->size) {
+                throw std::runtime_error("uniform ring buffer is full!");
+        }
+        head = offset + size;
+        return static_cast<uint32_t>(offset);
+}
+
+void UniformRing::cleanup() {
+        for (size_t i = 0; i < buffers.size(); i++) {
+                BP->destroyBuffer(buffers[i], buffersMemory[i]);
+        }
+        buffers.clear();
+        buffersMemory.clear();
+        mapped.clear();
+        head = 0;
+}
+
+void InstanceBuffer::init(BaseProject *bp, uint32_t capacity) {
+        BP = bp;
+        this->capacity = capacity;
+
+        buffers.resize(BP->swapChainImages.size());
+        buffersMemory.resize(BP->swapChainImages.size());
+        mapped.resize(BP->swapChainImages.size());
+
+        for (size_t i = 0; i < BP->swapChainImages.size(); i++) {
+                BP->createBuffer(capacity * sizeof(InstanceData), VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+                                 VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                 buffers[i], buffersMemory[i]);
+                mapped[i] = static_cast<InstanceData *>(BP->allocator.map(buffersMemory[i]));
+        }
+}
+
+void InstanceBuffer::cleanup() {
+        for (size_t i = 0; i < buffers.size(); i++) {
+                BP->destroyBuffer(buffers[i], buffersMemory[i]);
         }
+        buffers.clear();
+        buffersMemory.clear();
+        mapped.clear();
 }
 
 
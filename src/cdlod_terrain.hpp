@@ -0,0 +1,264 @@
+#ifndef CDLOD_TERRAIN_H
+#define CDLOD_TERRAIN_H
+
+/**********************************************************************************
+ *
+ *  Continuous level of detail of a heightfield (CDLOD, F. Strugar 2009).
+ *
+ *  The heightfield is covered by a quadtree: a leaf spans CDLOD_PATCH_RESOLUTION
+ *  cells of the heightfield, and each level above doubles the span of its nodes.
+ *  Every node is drawn with the same grid patch of CDLOD_PATCH_RESOLUTION x
+ *  CDLOD_PATCH_RESOLUTION quads, instanced with the origin and the size of the
+ *  node; the vertex shader reads the heights from a texture. When only some of
+ *  the children of a node are close enough to be drawn at their own level, the
+ *  others are drawn as quarters of the patch of the node, whose indices are
+ *  contiguous ranges of the index buffer of the patch. The level of a node
+ *  is chosen from its distance from the camera (each level covers twice the
+ *  range of the one below), and in the last part of its range every vertex is
+ *  morphed towards the grid of the next level, so that neighbouring levels meet
+ *  without cracks or popping.
+ *  The minimum and maximum heights of every node are precomputed, so that the
+ *  selection only visits the nodes that can be in the frustum: its cost depends
+ *  on the view, not on the size of the heightfield.
+ *
+ **********************************************************************************/
+
+
+// Quads per side of the grid patch drawn for every node
+const uint32_t CDLOD_PATCH_RESOLUTION = 16;
+// Levels of the quadtree at most, enough for 16 * 2^11 = 32768 cells per side with a single root
+const uint32_t CDLOD_MAX_LEVELS = 12;
+// Range of the finest level, in nodes of the finest level
+const float CDLOD_LOD0_RANGE = 2.0f;
+// Fraction of the range of a level after which its vertices start morphing towards the next level
+const float CDLOD_MORPH_START = 0.7f;
+// Parts of the patch drawn by the instances: the whole patch, then its four quarters
+const uint32_t CDLOD_PATCH_PARTS = 5;
+
+
+// Grid patch spanning [0, 1] x [0, 1] on the xz plane, with the indices of each quarter (x half, then z half)
+// contiguous, so that the whole patch and each quarter are a single range of the index buffer
+void buildCdlodPatch(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+        const uint32_t side = CDLOD_PATCH_RESOLUTION + 1;
+        const uint32_t half = CDLOD_PATCH_RESOLUTION / 2;
+
+        vertices.clear();
+        for (uint32_t z = 0; z < side; z++) {
+                for (uint32_t x = 0; x < side; x++) {
+                        glm::vec2 position = glm::vec2(x, z) / static_cast<float>(CDLOD_PATCH_RESOLUTION);
+                        vertices.push_back({glm::vec3(position.x, 0.0f, position.y), glm::vec3(0.0f, 1.0f, 0.0f), position});
+                }
+        }
+
+        indices.clear();
+        for (uint32_t quarter = 0; quarter < 4; quarter++) {
+                uint32_t firstX = (quarter & 1) * half;
+                uint32_t firstZ = (quarter >> 1) * half;
+                for (uint32_t z = firstZ; z < firstZ + half; z++) {
+                        for (uint32_t x = firstX; x < firstX + half; x++) {
+                                uint32_t corner = z * side + x;
+                                indices.insert(indices.end(), {corner, corner + side, corner + 1,
+                                                               corner + 1, corner + side, corner + side + 1});
+                        }
+                }
+        }
+}
+
+// Range of the index buffer of the patch drawn for a part (0: whole patch, 1 + q: quarter q)
+void cdlodPatchPart(uint32_t part, uint32_t& firstIndex, uint32_t& indexCount) {
+        const uint32_t quarterIndices = CDLOD_PATCH_RESOLUTION * CDLOD_PATCH_RESOLUTION / 4 * 6;
+        firstIndex = (part == 0) ? 0 : (part - 1) * quarterIndices;
+        indexCount = (part == 0) ? 4 * quarterIndices : quarterIndices;
+}
+
+// Instances of each part of the patch selected for a frame
+using CdlodSelection = std::array<std::vector<InstanceData>, CDLOD_PATCH_PARTS>;
+
+
+class CdlodQuadtree {
+public:
+        // heights[row * samplesX + col] is the height of the sample at (origin.x + col * spacing.x, origin.y + row * spacing.y)
+        void init(const std::vector<float>& heights, uint32_t samplesX, uint32_t samplesZ,
+                  glm::vec2 origin, glm::vec2 spacing);
+        uint32_t getLevelCount() const { return levelCount; }
+        // Distances from the camera where the morph of a level starts and ends
+        glm::vec2 morphRange(uint32_t level) const;
+        // Fills patches with one instance per selected node (or quarter of a node), in the space of the heightfield:
+        // the model matrix maps the [0, 1] x [0, 1] patch onto the node, the flags hold the level of the node.
+        // Returns how many nodes (or quarters) were culled against the frustum
+        uint32_t select(const Frustum& frustum, const glm::vec3& camera, CdlodSelection& patches) const;
+
+private:
+        uint32_t samplesX, samplesZ;
+        glm::vec2 origin;
+        glm::vec2 spacing;
+        uint32_t levelCount;
+        std::vector<float> ranges;                      // per level
+        std::vector<uint32_t> nodesPerSide;             // per level
+        std::vector<std::vector<glm::vec2>> heightRanges;       // per level, (min, max) of each node
+
+        void selectNode(const Frustum& frustum, const glm::vec3& camera, uint32_t level, uint32_t x, uint32_t z,
+                        CdlodSelection& patches, uint32_t& culled) const;
+        bool isNodeInRange(const glm::vec3& camera, float range, uint32_t level, uint32_t x, uint32_t z) const;
+        bool nodeBounds(uint32_t level, uint32_t x, uint32_t z, glm::vec3& boxMin, glm::vec3& boxMax) const;
+        void addPatch(uint32_t level, uint32_t x, uint32_t z, uint32_t part, CdlodSelection& patches) const;
+};
+
+
+void CdlodQuadtree::init(const std::vector<float>& heights, uint32_t samplesX, uint32_t samplesZ,
+                         glm::vec2 origin, glm::vec2 spacing) {
+        auto start_time = std::chrono::high_resolution_clock::now();
+
+        this->samplesX = samplesX;
+        this->samplesZ = samplesZ;
+        this->origin = origin;
+        this->spacing = spacing;
+
+        uint32_t cells = std::max(samplesX, samplesZ) - 1;
+        levelCount = 1;
+        while (levelCount < CDLOD_MAX_LEVELS && (CDLOD_PATCH_RESOLUTION << (levelCount - 1)) < cells) {
+                levelCount++;
+        }
+
+        ranges.resize(levelCount);
+        nodesPerSide.resize(levelCount);
+        heightRanges.resize(levelCount);
+        float leafSize = CDLOD_PATCH_RESOLUTION * std::max(spacing.x, spacing.y);
+        for (uint32_t level = 0; level < levelCount; level++) {
+                ranges[level] = CDLOD_LOD0_RANGE * leafSize * static_cast<float>(1u << level);
+                uint32_t nodeCells = CDLOD_PATCH_RESOLUTION << level;
+                nodesPerSide[level] = (cells + nodeCells - 1) / nodeCells;
+        }
+
+        // leaves from the samples (a node also covers the samples on its far edges), then each level from the one below
+        uint32_t leaves = nodesPerSide[0];
+        heightRanges[0].assign(leaves * leaves, glm::vec2(std::numeric_limits<float>::max(),
+                                                          std::numeric_limits<float>::lowest()));
+        for (uint32_t row = 0; row < samplesZ; row++) {
+                for (uint32_t col = 0; col < samplesX; col++) {
+                        float height = heights[row * samplesX + col];
+                        uint32_t lastX = std::min(col / CDLOD_PATCH_RESOLUTION, leaves - 1);
+                        uint32_t lastZ = std::min(row / CDLOD_PATCH_RESOLUTION, leaves - 1);
+                        uint32_t firstX = std::min((col > 0 ? col - 1 : 0) / CDLOD_PATCH_RESOLUTION, lastX);
+                        uint32_t firstZ = std::min((row > 0 ? row - 1 : 0) / CDLOD_PATCH_RESOLUTION, lastZ);
+                        for (uint32_t z = firstZ; z <= lastZ; z++) {
+                                for (uint32_t x = firstX; x <= lastX; x++) {
+                                        glm::vec2& range = heightRanges[0][z * leaves + x];
+                                        range = glm::vec2(std::min(range.x, height), std::max(range.y, height));
+                                }
+                        }
+                }
+        }
+        for (uint32_t level = 1; level < levelCount; level++) {
+                uint32_t nodes = nodesPerSide[level];
+                uint32_t children = nodesPerSide[level - 1];
+                heightRanges[level].assign(nodes * nodes, glm::vec2(std::numeric_limits<float>::max(),
+                                                                    std::numeric_limits<float>::lowest()));
+                for (uint32_t z = 0; z < children; z++) {
+                        for (uint32_t x = 0; x < children; x++) {
+                                const glm::vec2& child = heightRanges[level - 1][z * children + x];
+                                glm::vec2& range = heightRanges[level][(z / 2) * nodes + x / 2];
+                                range = glm::vec2(std::min(range.x, child.x), std::max(range.y, child.y));
+                        }
+                }
+        }
+
+        auto end_time = std::chrono::high_resolution_clock::now();
+        std::cout << "CDLOD quadtree of " << samplesX << "x" << samplesZ << " samples: " << levelCount
+                  << " levels, " << nodesPerSide[levelCount - 1] * nodesPerSide[levelCount - 1] << " roots, built in "
+                  << std::chrono::duration<float, std::chrono::milliseconds::period>(end_time - start_time).count()
+                  << " ms\n";
+}
+
+glm::vec2 CdlodQuadtree::morphRange(uint32_t level) const {
+        float previous = (level > 0) ? ranges[level - 1] : 0.0f;
+        return glm::vec2(previous + (ranges[level] - previous) * CDLOD_MORPH_START, ranges[level]);
+}
+
+uint32_t CdlodQuadtree::select(const Frustum& frustum, const glm::vec3& camera, CdlodSelection& patches) const {
+        for (auto& part : patches) {
+                part.clear();
+        }
+        uint32_t culled = 0;
+
+        uint32_t top = levelCount - 1;
+        for (uint32_t z = 0; z < nodesPerSide[top]; z++) {
+                for (uint32_t x = 0; x < nodesPerSide[top]; x++) {
+                        // the roots are always drawn (at the coarsest level if they are out of its range)
+                        selectNode(frustum, camera, top, x, z, patches, culled);
+                }
+        }
+        return culled;
+}
+
+// A node is drawn at its own level unless the finer level reaches it: then each child in the range of
+// its level is selected on its own, and the others are drawn as quarters of the patch of this node
+void CdlodQuadtree::selectNode(const Frustum& frustum, const glm::vec3& camera, uint32_t level, uint32_t x, uint32_t z,
+                               CdlodSelection& patches, uint32_t& culled) const {
+        glm::vec3 boxMin, boxMax;
+        if (!nodeBounds(level, x, z, boxMin, boxMax)) {
+                return;
+        }
+        if (!frustum.intersects(boxMin, boxMax)) {
+                culled++;
+                return;
+        }
+
+        if (level == 0 || !isNodeInRange(camera, ranges[level - 1], level, x, z)) {
+                addPatch(level, x, z, 0, patches);
+                return;
+        }
+
+        for (uint32_t child = 0; child < 4; child++) {
+                uint32_t childX = 2 * x + (child & 1);
+                uint32_t childZ = 2 * z + (child >> 1);
+                if (childX >= nodesPerSide[level - 1] || childZ >= nodesPerSide[level - 1]) {
+                        continue;
+                }
+                if (isNodeInRange(camera, ranges[level - 1], level - 1, childX, childZ)) {
+                        selectNode(frustum, camera, level - 1, childX, childZ, patches, culled);
+                } else if (nodeBounds(level - 1, childX, childZ, boxMin, boxMax)) {
+                        if (frustum.intersects(boxMin, boxMax)) {
+                                addPatch(level, x, z, 1 + child, patches);
+                        } else {
+                                culled++;
+                        }
+                }
+        }
+}
+
+bool CdlodQuadtree::isNodeInRange(const glm::vec3& camera, float range, uint32_t level, uint32_t x, uint32_t z) const {
+        glm::vec3 boxMin, boxMax;
+        nodeBounds(level, x, z, boxMin, boxMax);
+        glm::vec3 nearest = glm::clamp(camera, boxMin, boxMax);
+        glm::vec3 offset = camera - nearest;
+        return glm::dot(offset, offset) <= range * range;
+}
+
+// The nodes on the far edges are clipped to the heightfield, like their patches in the vertex shader;
+// false for the nodes entirely outside of it (when the heightfield is not square)
+bool CdlodQuadtree::nodeBounds(uint32_t level, uint32_t x, uint32_t z, glm::vec3& boxMin, glm::vec3& boxMax) const {
+        float nodeCells = static_cast<float>(CDLOD_PATCH_RESOLUTION << level);
+        glm::vec2 extent = glm::vec2(samplesX - 1, samplesZ - 1);
+        glm::vec2 first = glm::min(glm::vec2(x, z) * nodeCells, extent);
+        glm::vec2 last = glm::min(glm::vec2(x + 1, z + 1) * nodeCells, extent);
+        const glm::vec2& heightRange = heightRanges[level][z * nodesPerSide[level] + x];
+
+        boxMin = glm::vec3(origin.x + first.x * spacing.x, heightRange.x, origin.y + first.y * spacing.y);
+        boxMax = glm::vec3(origin.x + last.x * spacing.x, heightRange.y, origin.y + last.y * spacing.y);
+        return heightRange.x <= heightRange.y;
+}
+
+void CdlodQuadtree::addPatch(uint32_t level, uint32_t x, uint32_t z, uint32_t part, CdlodSelection& patches) const {
+        glm::vec2 size = static_cast<float>(CDLOD_PATCH_RESOLUTION << level) * spacing;
+        glm::vec2 corner = origin + glm::vec2(x, z) * size;
+
+        InstanceData patch;
+        patch.model = glm::scale(glm::translate(glm::mat4(1.0f), glm::vec3(corner.x, 0.0f, corner.y)),
+                                 glm::vec3(size.x, 1.0f, size.y));
+        patch.flags = level;
+        patches[part].push_back(patch);
+}
+
+
+#endif          // CDLOD_TERRAIN_H
@@ -0,0 +1,262 @@
+#ifndef DRAW_RECORDER_H
+#define DRAW_RECORDER_H
+
+/**********************************************************************************
+ *
+ *  Records the draw calls of a frame on several threads.
+ *
+ *  The draw list is split into contiguous chunks, one per thread. Each thread
+ *  records its chunk into a VK_COMMAND_BUFFER_LEVEL_SECONDARY command buffer
+ *  allocated from its own pool (command pools cannot be used by two threads at
+ *  once, so there is one per thread and per frame in flight), and the primary
+ *  command buffer executes them in order inside the render pass. The calling
+ *  thread records the first chunk itself, the others are handed to workers that
+ *  are started once and then sleep between frames.
+ *
+ **********************************************************************************/
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+// Below this many draws per thread the threads cost more than they save
+const size_t DRAW_RECORDER_MIN_DRAWS_PER_THREAD = 256;
+
+
+class DrawRecorder {
+public:
+        // Records the draws [begin, end) of the list into the given command buffer
+        using RecordFunction = std::function<void(VkCommandBuffer commandBuffer, size_t begin, size_t end)>;
+
+        DrawRecorder() = default;
+        DrawRecorder(const DrawRecorder&) = delete;
+        DrawRecorder& operator=(const DrawRecorder&) = delete;
+        // Joins the workers if cleanup was not reached (e.g. after an exception); the pools belong to the device
+        ~DrawRecorder() { stopWorkers(); }
+
+        void init(VkDevice device, uint32_t queueFamilyIndex, uint32_t frameCount, uint32_t threadCount);
+        uint32_t getThreadCount() const { return threadCount; }
+        // How many threads are worth using for a draw list of the given size (1: record into the primary)
+        uint32_t chunkCount(size_t drawCount) const;
+        // Makes the secondary command buffers of the frame available again, once the frame has completed
+        void resetFrame(uint32_t frame);
+        // Records the draws into chunks secondary command buffers and executes them from the primary one,
+        // which must be inside a render pass begun with VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+        void record(uint32_t frame, VkCommandBuffer primary, const VkCommandBufferInheritanceInfo& inheritance,
+                    size_t drawCount, uint32_t chunks, const RecordFunction& recordDraws);
+        void cleanup();
+
+private:
+        // secondary command buffers of one thread for one frame; used ones are reused after resetFrame
+        struct ThreadPool {
+                VkCommandPool pool;
+                std::vector<VkCommandBuffer> commandBuffers;
+                size_t used;
+        };
+
+        VkDevice device;
+        uint32_t threadCount = 0;
+        std::vector<std::vector<ThreadPool>> pools;     // [frame][thread]
+
+        // job shared with the workers, protected by mutex
+        std::vector<std::thread> workers;
+        std::mutex mutex;
+        std::condition_variable jobAvailable;
+        std::condition_variable jobDone;
+        uint64_t jobGeneration = 0;
+        uint32_t jobChunks = 0;
+        uint32_t pendingChunks = 0;
+        bool isStopping = false;
+        std::exception_ptr jobError;
+
+        // read by the workers only while a job is running
+        uint32_t jobFrame;
+        size_t jobDrawCount;
+        const VkCommandBufferInheritanceInfo *jobInheritance;
+        const RecordFunction *jobRecordDraws;
+        std::vector<VkCommandBuffer> jobCommandBuffers;
+
+        void workerLoop(uint32_t thread);
+        void stopWorkers();
+        void recordChunk(uint32_t chunk);
+};
+
+
+void DrawRecorder::init(VkDevice device, uint32_t queueFamilyIndex, uint32_t frameCount, uint32_t threadCount) {
+        this->device = device;
+        this->threadCount = std::max(1u, threadCount);
+
+        pools.resize(frameCount);
+        for (auto& framePools : pools) {
+                framePools.resize(this->threadCount);
+                for (auto& threadPool : framePools) {
+                        VkCommandPoolCreateInfo poolInfo{};
+                        poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+                        poolInfo.queueFamilyIndex = queueFamilyIndex;
+                        poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+                        VkResult result = vkCreateCommandPool(device, &poolInfo, nullptr, &threadPool.pool);
+                        if (result != VK_SUCCESS) {
+                                PrintVkError(result);
+                                throw std::runtime_error("failed to create command pool!");
+                        }
+                        threadPool.used = 0;
+                }
+        }
+
+        // the calling thread records the first chunk, so one worker less is needed
+        for (uint32_t thread = 1; thread < this->threadCount; thread++) {
+                workers.emplace_back(&DrawRecorder::workerLoop, this, thread);
+        }
+}
+
+uint32_t DrawRecorder::chunkCount(size_t drawCount) const {
+        size_t chunks = drawCount / DRAW_RECORDER_MIN_DRAWS_PER_THREAD;
+        return static_cast<uint32_t>(std::max<size_t>(1, std::min<size_t>(chunks, threadCount)));
+}
+
+void DrawRecorder::resetFrame(uint32_t frame) {
+        for (auto& threadPool : pools[frame]) {
+                if (threadPool.used > 0) {
+                        vkResetCommandPool(device, threadPool.pool, 0);
+                        threadPool.used = 0;
+                }
+        }
+}
+
+void DrawRecorder::record(uint32_t frame, VkCommandBuffer primary, const VkCommandBufferInheritanceInfo& inheritance,
+                          size_t drawCount, uint32_t chunks, const RecordFunction& recordDraws) {
+        chunks = std::max(1u, std::min(chunks, threadCount));
+
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                jobFrame = frame;
+                jobDrawCount = drawCount;
+                jobInheritance = &inheritance;
+                jobRecordDraws = &recordDraws;
+                jobCommandBuffers.assign(chunks, VK_NULL_HANDLE);
+                jobChunks = chunks;
+                pendingChunks = chunks - 1;
+                jobError = nullptr;
+                jobGeneration++;
+        }
+        jobAvailable.notify_all();
+
+        std::exception_ptr error;
+        try {
+                recordChunk(0);
+        } catch (...) {
+                error = std::current_exception();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        jobDone.wait(lock, [this]() { return pendingChunks == 0; });
+        if (error == nullptr) {
+                error = jobError;
+        }
+        if (error != nullptr) {
+                std::rethrow_exception(error);
+        }
+
+        vkCmdExecuteCommands(primary, static_cast<uint32_t>(jobCommandBuffers.size()), jobCommandBuffers.data());
+}
+
+void DrawRecorder::workerLoop(uint32_t thread) {
+        uint64_t seenGeneration = 0;
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+                jobAvailable.wait(lock, [&]() { return isStopping || jobGeneration != seenGeneration; });
+                if (isStopping) {
+                        return;
+                }
+                seenGeneration = jobGeneration;
+                if (thread >= jobChunks) {
+                        continue;
+                }
+
+                lock.unlock();
+                std::exception_ptr error;
+                try {
+                        recordChunk(thread);
+                } catch (...) {
+                        error = std::current_exception();
+                }
+                lock.lock();
+
+                if (error != nullptr && jobError == nullptr) {
+                        jobError = error;
+                }
+                if (--pendingChunks == 0) {
+                        jobDone.notify_one();
+                }
+        }
+}
+
+// Chunk i is always recorded by thread i, from the pool of that thread
+void DrawRecorder::recordChunk(uint32_t chunk) {
+        ThreadPool& threadPool = pools[jobFrame][chunk];
+
+        if (threadPool.used == threadPool.commandBuffers.size()) {
+                VkCommandBufferAllocateInfo allocInfo{};
+                allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+                allocInfo.commandPool = threadPool.pool;
+                allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+                allocInfo.commandBufferCount = 1;
+
+                VkCommandBuffer commandBuffer;
+                VkResult result = vkAllocateCommandBuffers(device, &allocInfo, &commandBuffer);
+                if (result != VK_SUCCESS) {
+                        PrintVkError(result);
+                        throw std::runtime_error("failed to allocate command buffers!");
+                }
+                threadPool.commandBuffers.push_back(commandBuffer);
+        }
+        VkCommandBuffer commandBuffer = threadPool.commandBuffers[threadPool.used++];
+
+        VkCommandBufferBeginInfo beginInfo{};
+        beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+        beginInfo.pInheritanceInfo = jobInheritance;
+
+        if (vkBeginCommandBuffer(commandBuffer, &beginInfo) != VK_SUCCESS) {
+                throw std::runtime_error("failed to begin recording command buffer!");
+        }
+
+        size_t begin = jobDrawCount * chunk / jobChunks;
+        size_t end = jobDrawCount * (chunk + 1) / jobChunks;
+        (*jobRecordDraws)(commandBuffer, begin, end);
+
+        if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS) {
+                throw std::runtime_error("failed to record command buffer!");
+        }
+
+        jobCommandBuffers[chunk] = commandBuffer;
+}
+
+void DrawRecorder::stopWorkers() {
+        {
+                std::lock_guard<std::mutex> lock(mutex);
+                isStopping = true;
+        }
+        jobAvailable.notify_all();
+        for (auto& worker : workers) {
+                worker.join();
+        }
+        workers.clear();
+}
+
+void DrawRecorder::cleanup() {
+        stopWorkers();
+
+        for (auto& framePools : pools) {
+                for (auto& threadPool : framePools) {
+                        vkDestroyCommandPool(device, threadPool.pool, nullptr);
+                }
+        }
+        pools.clear();
+}
+
+
+#endif          // DRAW_RECORDER_H
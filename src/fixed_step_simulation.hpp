@@ -0,0 +1,165 @@
+#ifndef FIXED_STEP_SIMULATION_H
+#define FIXED_STEP_SIMULATION_H
+
+/**********************************************************************************
+ *
+ *  Runs a simulation on its own thread at a fixed rate.
+ *
+ *  Every step advances the simulation by the same dt, whatever the frame rate
+ *  of the renderer, and publishes a snapshot of its state. The last two
+ *  snapshots are kept (double buffered, behind a mutex held only to copy them),
+ *  and the renderer draws the state one step in the past, interpolated between
+ *  them: the motion stays smooth even when the frame rate is not a multiple of
+ *  the simulation rate, and the simulation keeps running while the renderer is
+ *  blocked waiting for the GPU or the swapchain.
+ *  If the thread falls behind (e.g. the process was suspended) at most
+ *  FIXED_STEP_MAX_CATCH_UP steps are run in a row, and the rest is dropped.
+ *  The simulation can also be advanced by the caller instead of the wall
+ *  clock (startStepped and advance): the same steps then run on the calling
+ *  thread, for a given time each call, and are interpolated the same way.
+ *
+ **********************************************************************************/
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+
+const int FIXED_STEP_MAX_CATCH_UP = 25;
+
+
+template<typename Snapshot>
+class FixedStepSimulation {
+public:
+        // Advances the simulation by dt seconds and returns its new state
+        using StepFunction = std::function<Snapshot(float dt)>;
+
+        FixedStepSimulation() = default;
+        FixedStepSimulation(const FixedStepSimulation&) = delete;
+        FixedStepSimulation& operator=(const FixedStepSimulation&) = delete;
+        // Stops the thread if stop was not reached (e.g. after an exception), so that it is never left joinable
+        ~FixedStepSimulation() { stop(); }
+
+        void start(float rate, const Snapshot& initial, const StepFunction& step);
+        // Like start, but without a thread: the simulation only moves on when advance is called
+        void startStepped(float rate, const Snapshot& initial, const StepFunction& step);
+        // Runs, on the calling thread, the steps that fall in the next seconds (stepped simulations only)
+        void advance(float seconds);
+        void stop();
+        bool isRunning() const { return thread.joinable() || isStepped; }
+        float getStepTime() const { return stepTime; }
+        uint64_t getStepCount() const { return stepCount; }
+        // The two latest snapshots, and where the current time falls between them (0: previous, 1: current)
+        float latest(Snapshot& previous, Snapshot& current);
+
+private:
+        using Clock = std::chrono::steady_clock;
+
+        std::thread thread;
+        std::atomic<bool> isStopping{false};
+        std::atomic<uint64_t> stepCount{0};
+        float stepTime = 0.0f;
+        StepFunction step;
+        // stepped simulations: time advanced past the current snapshot
+        bool isStepped = false;
+        float steppedTime = 0.0f;
+
+        // protected by mutex
+        std::mutex mutex;
+        Snapshot previousSnapshot;
+        Snapshot currentSnapshot;
+        Clock::time_point currentTime;
+
+        void loop();
+};
+
+
+template<typename Snapshot>
+void FixedStepSimulation<Snapshot>::start(float rate, const Snapshot& initial, const StepFunction& step) {
+        this->step = step;
+        stepTime = 1.0f / rate;
+        previousSnapshot = initial;
+        currentSnapshot = initial;
+        currentTime = Clock::now();
+        isStopping = false;
+        stepCount = 0;
+
+        thread = std::thread(&FixedStepSimulation::loop, this);
+}
+
+template<typename Snapshot>
+void FixedStepSimulation<Snapshot>::startStepped(float rate, const Snapshot& initial, const StepFunction& step) {
+        this->step = step;
+        stepTime = 1.0f / rate;
+        previousSnapshot = initial;
+        currentSnapshot = initial;
+        stepCount = 0;
+        isStepped = true;
+        steppedTime = 0.0f;
+}
+
+template<typename Snapshot>
+void FixedStepSimulation<Snapshot>::advance(float seconds) {
+        steppedTime += seconds;
+        while (steppedTime >= stepTime) {
+                previousSnapshot = currentSnapshot;
+                currentSnapshot = step(stepTime);
+                stepCount++;
+                steppedTime -= stepTime;
+        }
+}
+
+template<typename Snapshot>
+void FixedStepSimulation<Snapshot>::stop() {
+        isStepped = false;
+        if (!thread.joinable()) {
+                return;
+        }
+        isStopping = true;
+        thread.join();
+}
+
+template<typename Snapshot>
+float FixedStepSimulation<Snapshot>::latest(Snapshot& previous, Snapshot& current) {
+        std::lock_guard<std::mutex> lock(mutex);
+        previous = previousSnapshot;
+        current = currentSnapshot;
+        if (isStepped) {
+                return steppedTime / stepTime;
+        }
+
+        // the render time is one step behind, so that it always falls between the two snapshots
+        float sinceCurrent = std::chrono::duration<float>(Clock::now() - currentTime).count();
+        return std::min(std::max(sinceCurrent / stepTime, 0.0f), 1.0f);
+}
+
+template<typename Snapshot>
+void FixedStepSimulation<Snapshot>::loop() {
+        auto stepDuration = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<float>(stepTime));
+        Clock::time_point nextTime = Clock::now() + stepDuration;
+
+        while (!isStopping) {
+                std::this_thread::sleep_until(nextTime);
+
+                int steps = 0;
+                while (Clock::now() >= nextTime && !isStopping) {
+                        if (steps == FIXED_STEP_MAX_CATCH_UP) {
+                                nextTime = Clock::now();
+                                break;
+                        }
+
+                        Snapshot snapshot = step(stepTime);
+                        stepCount++;
+                        steps++;
+
+                        std::lock_guard<std::mutex> lock(mutex);
+                        previousSnapshot = currentSnapshot;
+                        currentSnapshot = snapshot;
+                        currentTime = nextTime;
+                        nextTime += stepDuration;
+                }
+        }
+}
+
+
+#endif          // FIXED_STEP_SIMULATION_H
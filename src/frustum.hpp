@@ -0,0 +1,142 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+/**********************************************************************************
+ *
+ *  Frustum culling of axis-aligned bounding boxes on the CPU.
+ *
+ *  The six planes of the frustum are extracted from the projection * view
+ *  matrix. The boxes are kept as a structure of arrays, so that with SSE each
+ *  plane is tested against four boxes at once (plain code is used elsewhere).
+ *  A box is culled when its corner farthest along the normal of a plane is
+ *  still behind that plane: the test is conservative, and a few boxes close to
+ *  the edges of the frustum are kept even if they are not visible.
+ *
+ **********************************************************************************/
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define FRUSTUM_USE_SSE
+#endif
+
+
+// Planes as (normal, distance), with the normals pointing inside the frustum
+struct Frustum {
+        std::array<glm::vec4, 6> planes;
+
+        // Clip space of Vulkan: -w <= x, y <= w and 0 <= z <= w
+        static Frustum fromMatrix(const glm::mat4& projView) {
+                glm::vec4 row0(projView[0][0], projView[1][0], projView[2][0], projView[3][0]);
+                glm::vec4 row1(projView[0][1], projView[1][1], projView[2][1], projView[3][1]);
+                glm::vec4 row2(projView[0][2], projView[1][2], projView[2][2], projView[3][2]);
+                glm::vec4 row3(projView[0][3], projView[1][3], projView[2][3], projView[3][3]);
+
+                return Frustum{{row3 + row0, row3 - row0, row3 + row1, row3 - row1, row2, row3 - row2}};
+        }
+
+        // Conservative test of a single box, see BoxCuller::cull for many boxes at once
+        bool intersects(const glm::vec3& boxMin, const glm::vec3& boxMax) const {
+                for (const auto& plane : planes) {
+                        glm::vec3 farthest((plane.x >= 0.0f) ? boxMax.x : boxMin.x,
+                                           (plane.y >= 0.0f) ? boxMax.y : boxMin.y,
+                                           (plane.z >= 0.0f) ? boxMax.z : boxMin.z);
+                        if (glm::dot(glm::vec3(plane), farthest) + plane.w < 0.0f) {
+                                return false;
+                        }
+                }
+                return true;
+        }
+};
+
+
+class BoxCuller {
+public:
+        void clear() {
+                minX.clear(); minY.clear(); minZ.clear();
+                maxX.clear(); maxY.clear(); maxZ.clear();
+                count = 0;
+        }
+
+        // Adds the box that contains the given one once transformed by model
+        void add(const glm::vec3& boxMin, const glm::vec3& boxMax, const glm::mat4& model = glm::mat4(1.0f)) {
+                glm::vec3 transformedMin(std::numeric_limits<float>::max());
+                glm::vec3 transformedMax(std::numeric_limits<float>::lowest());
+                for (int corner = 0; corner < 8; corner++) {
+                        glm::vec3 point((corner & 1) ? boxMax.x : boxMin.x,
+                                        (corner & 2) ? boxMax.y : boxMin.y,
+                                        (corner & 4) ? boxMax.z : boxMin.z);
+                        point = glm::vec3(model * glm::vec4(point, 1.0f));
+                        transformedMin = glm::min(transformedMin, point);
+                        transformedMax = glm::max(transformedMax, point);
+                }
+
+                // the arrays are padded to a multiple of 4 boxes, the padding is never reported as visible
+                if (count % 4 == 0) {
+                        for (auto *values : {&minX, &minY, &minZ, &maxX, &maxY, &maxZ}) {
+                                values->resize(count + 4, 0.0f);
+                        }
+                }
+                minX[count] = transformedMin.x;
+                minY[count] = transformedMin.y;
+                minZ[count] = transformedMin.z;
+                maxX[count] = transformedMax.x;
+                maxY[count] = transformedMax.y;
+                maxZ[count] = transformedMax.z;
+                count++;
+        }
+
+        size_t size() const {
+                return count;
+        }
+
+        // Fills visible with the indices (in the order they were added) of the boxes that may be in the frustum
+        void cull(const Frustum& frustum, std::vector<uint32_t>& visible) const {
+                visible.clear();
+
+                for (size_t i = 0; i < count; i += 4) {
+                        int outsideMask = 0;
+#ifdef FRUSTUM_USE_SSE
+                        __m128 outside = _mm_setzero_ps();
+                        for (const auto& plane : frustum.planes) {
+                                // corner of the boxes farthest along the normal of the plane
+                                __m128 x = _mm_loadu_ps((plane.x >= 0.0f) ? &maxX[i] : &minX[i]);
+                                __m128 y = _mm_loadu_ps((plane.y >= 0.0f) ? &maxY[i] : &minY[i]);
+                                __m128 z = _mm_loadu_ps((plane.z >= 0.0f) ? &maxZ[i] : &minZ[i]);
+
+                                __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(plane.x)),
+                                                                        _mm_mul_ps(y, _mm_set1_ps(plane.y))),
+                                                             _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(plane.z)),
+                                                                        _mm_set1_ps(plane.w)));
+                                outside = _mm_or_ps(outside, _mm_cmplt_ps(distance, _mm_setzero_ps()));
+                        }
+                        outsideMask = _mm_movemask_ps(outside);
+#else
+                        for (int lane = 0; lane < 4; lane++) {
+                                for (const auto& plane : frustum.planes) {
+                                        float distance = plane.x * ((plane.x >= 0.0f) ? maxX[i + lane] : minX[i + lane])
+                                                         + plane.y * ((plane.y >= 0.0f) ? maxY[i + lane] : minY[i + lane])
+                                                         + plane.z * ((plane.z >= 0.0f) ? maxZ[i + lane] : minZ[i + lane])
+                                                         + plane.w;
+                                        if (distance < 0.0f) {
+                                                outsideMask |= 1 << lane;
+                                                break;
+                                        }
+                                }
+                        }
+#endif
+                        for (size_t lane = 0; lane < 4 && i + lane < count; lane++) {
+                                if (!(outsideMask & (1 << lane))) {
+                                        visible.push_back(static_cast<uint32_t>(i + lane));
+                                }
+                        }
+                }
+        }
+
+private:
+        std::vector<float> minX, minY, minZ;
+        std::vector<float> maxX, maxY, maxZ;
+        size_t count = 0;
+};
+
+
+#endif          // FRUSTUM_H
@@ -0,0 +1,295 @@
+#ifndef GPU_ALLOCATOR_H
+#define GPU_ALLOCATOR_H
+
+/**********************************************************************************
+ *
+ *  Sub-allocator for the device memory of buffers and images.
+ *
+ *  Instead of calling vkAllocateMemory for every resource, resources are carved
+ *  out of big blocks, one list of blocks per memory type. Each block keeps a
+ *  sorted list of free ranges (first fit, merged again when freed), and empty
+ *  blocks are kept for the next allocations, so that recreating the swapchain
+ *  does not allocate device memory again. Buffers and optimal-tiling images are
+ *  kept in separate blocks when bufferImageGranularity requires it, and requests
+ *  bigger than half a block get a dedicated allocation.
+ *  Host-visible blocks are mapped once, the first time they are written.
+ *
+ **********************************************************************************/
+
+
+const VkDeviceSize GPU_ALLOCATOR_BLOCK_SIZE = 64 * 1024 * 1024;
+
+
+// Memory range assigned to a buffer or an image
+struct GpuAllocation {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        uint32_t pool = 0;
+        int block = -1;         // -1 for dedicated allocations
+};
+
+
+class GpuAllocator {
+public:
+        void init(VkPhysicalDevice physicalDevice, VkDevice device,
+                  VkDeviceSize blockSize = GPU_ALLOCATOR_BLOCK_SIZE);
+        GpuAllocation allocate(const VkMemoryRequirements& requirements, uint32_t memoryType, bool linear);
+        void free(GpuAllocation& allocation);
+        void* map(const GpuAllocation& allocation);
+        void printStats(const std::string& title) const;
+        void cleanup();
+
+private:
+        struct FreeRange {
+                VkDeviceSize offset;
+                VkDeviceSize size;
+        };
+
+        struct Block {
+                VkDeviceMemory memory;
+                VkDeviceSize size;
+                VkDeviceSize used;
+                uint32_t allocations;
+                std::vector<FreeRange> freeRanges;      // sorted by offset, never adjacent
+                void* mapped;
+        };
+
+        struct Dedicated {
+                VkDeviceSize size;
+                void* mapped;
+        };
+
+        // pool = memoryType * 2 + linear, so that buffers and images can be kept apart
+        struct Pool {
+                std::vector<Block> blocks;
+                std::map<VkDeviceMemory, Dedicated> dedicated;
+        };
+
+        VkDevice device;
+        VkPhysicalDeviceMemoryProperties memProperties;
+        VkDeviceSize bufferImageGranularity;
+        VkDeviceSize blockSize;
+        std::vector<Pool> pools;
+
+        VkDeviceMemory allocateMemory(VkDeviceSize size, uint32_t memoryType);
+        bool allocateFromBlock(Block& block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize& offset);
+        void* mapMemory(VkDeviceMemory memory, void*& mapped, uint32_t pool);
+};
+
+
+void GpuAllocator::init(VkPhysicalDevice physicalDevice, VkDevice device, VkDeviceSize blockSize) {
+        this->device = device;
+        this->blockSize = blockSize;
+
+        vkGetPhysicalDeviceMemoryProperties(physicalDevice, &memProperties);
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        bufferImageGranularity = properties.limits.bufferImageGranularity;
+
+        pools.assign(memProperties.memoryTypeCount * 2, Pool{});
+}
+
+VkDeviceMemory GpuAllocator::allocateMemory(VkDeviceSize size, uint32_t memoryType) {
+        VkMemoryAllocateInfo allocInfo{};
+        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        allocInfo.allocationSize = size;
+        allocInfo.memoryTypeIndex = memoryType;
+
+        VkDeviceMemory memory;
+        VkResult result = vkAllocateMemory(device, &allocInfo, nullptr, &memory);
+        if (result != VK_SUCCESS) {
+                PrintVkError(result);
+                throw std::runtime_error("failed to allocate device memory!");
+        }
+        return memory;
+}
+
+// First fit: the padding needed to align the range stays free, in front of it
+bool GpuAllocator::allocateFromBlock(Block& block, VkDeviceSize size, VkDeviceSize alignment,
+                                     VkDeviceSize& offset) {
+        for (size_t i = 0; i < block.freeRanges.size(); i++) {
+                FreeRange range = block.freeRanges[i];
+                VkDeviceSize alignedOffset = (range.offset + alignment - 1) / alignment * alignment;
+                if (alignedOffset + size > range.offset + range.size) {
+                        continue;
+                }
+
+                VkDeviceSize rangeEnd = range.offset + range.size;
+                block.freeRanges.erase(block.freeRanges.begin() + i);
+                if (alignedOffset + size < rangeEnd) {
+                        block.freeRanges.insert(block.freeRanges.begin() + i,
+                                                {alignedOffset + size, rangeEnd - alignedOffset - size});
+                }
+                if (alignedOffset > range.offset) {
+                        block.freeRanges.insert(block.freeRanges.begin() + i,
+                                                {range.offset, alignedOffset - range.offset});
+                }
+
+                block.used += size;
+                block.allocations++;
+                offset = alignedOffset;
+                return true;
+        }
+        return false;
+}
+
+GpuAllocation GpuAllocator::allocate(const VkMemoryRequirements& requirements, uint32_t memoryType, bool linear) {
+        // with a granularity of 1 buffers and images can share the same blocks
+        if (bufferImageGranularity <= 1) {
+                linear = true;
+        }
+
+        GpuAllocation allocation;
+        allocation.size = requirements.size;
+        allocation.pool = memoryType * 2 + (linear ? 1 : 0);
+        Pool& pool = pools[allocation.pool];
+
+        VkDeviceSize heapSize = memProperties.memoryHeaps[memProperties.memoryTypes[memoryType].heapIndex].size;
+        VkDeviceSize poolBlockSize = std::min(blockSize, heapSize / 8);
+
+        if (requirements.size > poolBlockSize / 2) {
+                allocation.memory = allocateMemory(requirements.size, memoryType);
+                pool.dedicated[allocation.memory] = {requirements.size, nullptr};
+                return allocation;
+        }
+
+        for (size_t i = 0; i < pool.blocks.size(); i++) {
+                if (allocateFromBlock(pool.blocks[i], requirements.size, requirements.alignment, allocation.offset)) {
+                        allocation.memory = pool.blocks[i].memory;
+                        allocation.block = static_cast<int>(i);
+                        return allocation;
+                }
+        }
+
+        Block block{};
+        block.memory = allocateMemory(poolBlockSize, memoryType);
+        block.size = poolBlockSize;
+        block.freeRanges.push_back({0, poolBlockSize});
+        pool.blocks.push_back(block);
+
+        allocateFromBlock(pool.blocks.back(), requirements.size, requirements.alignment, allocation.offset);
+        allocation.memory = block.memory;
+        allocation.block = static_cast<int>(pool.blocks.size() - 1);
+        return allocation;
+}
+
+void GpuAllocator::free(GpuAllocation& allocation) {
+        if (allocation.memory == VK_NULL_HANDLE) {
+                return;
+        }
+        Pool& pool = pools[allocation.pool];
+
+        if (allocation.block < 0) {
+                vkFreeMemory(device, allocation.memory, nullptr);
+                pool.dedicated.erase(allocation.memory);
+                allocation = GpuAllocation{};
+                return;
+        }
+
+        Block& block = pool.blocks[allocation.block];
+        block.used -= allocation.size;
+        block.allocations--;
+
+        // insert the range back, merging it with the free neighbours
+        auto next = std::lower_bound(block.freeRanges.begin(), block.freeRanges.end(), allocation.offset,
+                                     [](const FreeRange& range, VkDeviceSize offset) {
+                                             return range.offset < offset;
+                                     });
+        auto range = block.freeRanges.insert(next, {allocation.offset, allocation.size});
+        if (range + 1 != block.freeRanges.end() && range->offset + range->size == (range + 1)->offset) {
+                range->size += (range + 1)->size;
+                block.freeRanges.erase(range + 1);
+        }
+        if (range != block.freeRanges.begin() && (range - 1)->offset + (range - 1)->size == range->offset) {
+                (range - 1)->size += range->size;
+                block.freeRanges.erase(range);
+        }
+
+        allocation = GpuAllocation{};
+}
+
+void* GpuAllocator::mapMemory(VkDeviceMemory memory, void*& mapped, uint32_t pool) {
+        if (mapped == nullptr) {
+                if (!(memProperties.memoryTypes[pool / 2].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+                        throw std::runtime_error("failed to map memory that is not host visible!");
+                }
+                VkResult result = vkMapMemory(device, memory, 0, VK_WHOLE_SIZE, 0, &mapped);
+                if (result != VK_SUCCESS) {
+                        PrintVkError(result);
+                        throw std::runtime_error("failed to map device memory!");
+                }
+        }
+        return mapped;
+}
+
+// Pointer to the first byte of the allocation, valid until the allocator is cleaned up
+void* GpuAllocator::map(const GpuAllocation& allocation) {
+        Pool& pool = pools[allocation.pool];
+
+        if (allocation.block < 0) {
+                return mapMemory(allocation.memory, pool.dedicated[allocation.memory].mapped, allocation.pool);
+        }
+
+        Block& block = pool.blocks[allocation.block];
+        return static_cast<char *>(mapMemory(block.memory, block.mapped, allocation.pool)) + allocation.offset;
+}
+
+void GpuAllocator::printStats(const std::string& title) const {
+        std::cout << "GPU memory (" << title << "):\n";
+
+        for (size_t p = 0; p < pools.size(); p++) {
+                const Pool& pool = pools[p];
+                if (pool.blocks.empty() && pool.dedicated.empty()) {
+                        continue;
+                }
+
+                VkDeviceSize reserved = 0, used = 0, freeSize = 0, largestFreeSize = 0;
+                uint32_t allocations = 0;
+                for (const auto& block : pool.blocks) {
+                        reserved += block.size;
+                        used += block.used;
+                        allocations += block.allocations;
+
+                        VkDeviceSize largestFree = 0;
+                        for (const auto& range : block.freeRanges) {
+                                freeSize += range.size;
+                                largestFree = std::max(largestFree, range.size);
+                        }
+                        largestFreeSize += largestFree;
+                }
+                VkDeviceSize dedicatedSize = 0;
+                for (const auto& dedicated : pool.dedicated) {
+                        dedicatedSize += dedicated.second.size;
+                }
+
+                // 0% when the free memory of each block is a single range, close to 100% when it is scattered
+                float fragmentation = (freeSize > 0) ? 100.0f * (1.0f - (float) largestFreeSize / freeSize) : 0.0f;
+                VkMemoryPropertyFlags flags = memProperties.memoryTypes[p / 2].propertyFlags;
+
+                std::cout << "  type " << p / 2
+                          << ((flags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) ? " device-local" : "")
+                          << ((flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) ? " host-visible" : "")
+                          << ((bufferImageGranularity > 1) ? ((p % 2) ? " buffers" : " images") : "")
+                          << ": " << allocations << " allocations, " << used / 1024 << "/" << reserved / 1024
+                          << " KiB used in " << pool.blocks.size() << " blocks, fragmentation "
+                          << std::fixed << std::setprecision(1) << fragmentation << "%" << std::defaultfloat
+                          << ", " << pool.dedicated.size() << " dedicated (" << dedicatedSize / 1024 << " KiB)\n";
+        }
+}
+
+void GpuAllocator::cleanup() {
+        for (auto& pool : pools) {
+                for (auto& block : pool.blocks) {
+                        vkFreeMemory(device, block.memory, nullptr);
+                }
+                for (auto& dedicated : pool.dedicated) {
+                        vkFreeMemory(device, dedicated.first, nullptr);
+                }
+        }
+        pools.clear();
+}
+
+
+#endif          // GPU_ALLOCATOR_H
@@ -0,0 +1,131 @@
+#ifndef HEADLESS_DRIVE_H
+#define HEADLESS_DRIVE_H
+
+/**********************************************************************************
+ *
+ *  Scripted drives of the car, simulated without a window or a GPU.
+ *
+ *  A drive is a text stream of commands, one per line: the time in seconds
+ *  from the start of the drive, then the keys held down from that time on
+ *  (any of W, A, S, D and R, or - for none). Empty lines and lines starting
+ *  with # are skipped, and the last command ends the drive:
+ *
+ *      # accelerate, turn left for a second, then coast to a stop
+ *      0.0   W
+ *      2.0   WA
+ *      3.0   -
+ *      10.0  -
+ *
+ *  The car is advanced with a fixed dt, and each command takes effect at the
+ *  step nearest to its time, so the same drive always goes through the same
+ *  steps: its trajectory, and the hash of it, are identical from a run to the
+ *  next (for the same build on the same kind of CPU).
+ *
+ **********************************************************************************/
+
+#include <sstream>
+
+
+// Steps of a drive at most (2^53), so that the step of every command is exact in a double and fits a uint64_t
+const double DRIVE_MAX_STEPS = 9007199254740992.0;
+
+
+// Keys that drive the car, sampled by the render thread (or read from a drive) and read by the simulation
+enum CarKey : uint32_t {
+        CAR_KEY_FORWARD = 1 << 0,
+        CAR_KEY_BACKWARD = 1 << 1,
+        CAR_KEY_LEFT = 1 << 2,
+        CAR_KEY_RIGHT = 1 << 3,
+        CAR_KEY_RESET = 1 << 4
+};
+
+
+// The keys held down (CarKey bits) from a step of the drive on
+struct DriveCommand {
+        uint64_t step;
+        uint32_t keys;
+};
+
+
+// Parses the commands of a drive stepped every dt seconds, the last one marking its end
+std::vector<DriveCommand> parseDriveCommands(std::istream& input, float dt) {
+        std::vector<DriveCommand> commands;
+        std::string line;
+        int lineNumber = 0;
+
+        while (std::getline(input, line)) {
+                lineNumber++;
+                std::istringstream fields(line);
+                double time;
+                std::string keyNames;
+                if (!(fields >> time)) {
+                        fields.clear();
+                        std::string first;
+                        if (!(fields >> first) || first[0] == '#') {
+                                continue;
+                        }
+                        throw std::runtime_error("invalid time in drive command at line " + std::to_string(lineNumber) + "!");
+                }
+                if (!(fields >> keyNames) || time < 0.0) {
+                        throw std::runtime_error("invalid drive command at line " + std::to_string(lineNumber) + "!");
+                }
+
+                uint32_t keys = 0;
+                for (char key : keyNames) {
+                        switch (std::toupper(static_cast<unsigned char>(key))) {
+                                case 'W': keys |= CAR_KEY_FORWARD; break;
+                                case 'S': keys |= CAR_KEY_BACKWARD; break;
+                                case 'A': keys |= CAR_KEY_LEFT; break;
+                                case 'D': keys |= CAR_KEY_RIGHT; break;
+                                case 'R': keys |= CAR_KEY_RESET; break;
+                                case '-': break;
+                                default:
+                                        throw std::runtime_error("invalid key '" + std::string(1, key)
+                                                                 + "' in drive command at line " + std::to_string(lineNumber) + "!");
+                        }
+                }
+
+                // also false for a NaN, when dt is not a positive number
+                double steps = time / dt;
+                if (!(steps <= DRIVE_MAX_STEPS)) {
+                        throw std::runtime_error("drive command at line " + std::to_string(lineNumber) + " is too far in time!");
+                }
+                uint64_t step = static_cast<uint64_t>(std::llround(steps));
+                if (!commands.empty() && step < commands.back().step) {
+                        throw std::runtime_error("drive commands out of order at line " + std::to_string(lineNumber) + "!");
+                }
+                commands.push_back({step, keys});
+        }
+
+        if (commands.empty()) {
+                throw std::runtime_error("drive without commands!");
+        }
+        return commands;
+}
+
+
+// FNV-1a hash of the bits of the values along a trajectory
+class TrajectoryHash {
+public:
+        void add(float value) {
+                uint32_t bits;
+                std::memcpy(&bits, &value, sizeof(bits));
+                for (int byte = 0; byte < 4; byte++) {
+                        hash = (hash ^ ((bits >> (8 * byte)) & 0xff)) * 0x100000001b3ULL;
+                }
+        }
+
+        void add(const glm::vec3& value) {
+                add(value.x);
+                add(value.y);
+                add(value.z);
+        }
+
+        uint64_t value() const { return hash; }
+
+private:
+        uint64_t hash = 0xcbf29ce484222325ULL;
+};
+
+
+#endif          // HEADLESS_DRIVE_H
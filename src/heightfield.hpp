@@ -0,0 +1,187 @@
+#ifndef HEIGHTFIELD_H
+#define HEIGHTFIELD_H
+
+/**********************************************************************************
+ *
+ *  Regular grid of heights, stored row by row in a single array.
+ *
+ *  Each cell of the grid is split into two triangles along the diagonal that
+ *  goes from (x + 1, z) to (x, z + 1), like the cells of the terrain mesh, and
+ *  the height of a point is interpolated on the triangle it falls in. Points
+ *  outside the grid take the height of the nearest point of its border, and
+ *  a NaN coordinate is taken as the first sample on its axis.
+ *  Batches of points are evaluated 8 at a time with AVX2 (gathering the
+ *  samples) or 4 at a time with SSE2 (computing the indices and the
+ *  interpolation with SSE, loading the samples one by one), and one at a time
+ *  elsewhere; all the paths give the same results.
+ *
+ **********************************************************************************/
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define HEIGHTFIELD_USE_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define HEIGHTFIELD_USE_SSE2
+#endif
+
+
+class Heightfield {
+public:
+        // samplesX x samplesZ samples (at least 2 x 2), the first one at origin, spacing apart on x and z
+        void init(uint32_t samplesX, uint32_t samplesZ, glm::vec2 origin, glm::vec2 spacing);
+
+        float& at(uint32_t x, uint32_t z) { return samples[z * samplesX + x]; }
+        float at(uint32_t x, uint32_t z) const { return samples[z * samplesX + x]; }
+        // samples[z * samplesX + x] is the height of the sample (x, z)
+        const std::vector<float>& getSamples() const { return samples; }
+        uint32_t getSamplesX() const { return samplesX; }
+        uint32_t getSamplesZ() const { return samplesZ; }
+        glm::vec2 getOrigin() const { return origin; }
+        glm::vec2 getSpacing() const { return spacing; }
+
+        float height(float x, float z) const;
+        // heights[i] = height(x[i], z[i]) for count points
+        void heights(const float* x, const float* z, float* heights, size_t count) const;
+
+private:
+        std::vector<float> samples;
+        uint32_t samplesX = 0, samplesZ = 0;
+        glm::vec2 origin;
+        glm::vec2 spacing;
+        glm::vec2 inverseSpacing;
+};
+
+
+void Heightfield::init(uint32_t samplesX, uint32_t samplesZ, glm::vec2 origin, glm::vec2 spacing) {
+        if (samplesX < 2 || samplesZ < 2) {
+                throw std::runtime_error("heightfield must have at least 2x2 samples!");
+        }
+        this->samplesX = samplesX;
+        this->samplesZ = samplesZ;
+        this->origin = origin;
+        this->spacing = spacing;
+        inverseSpacing = 1.0f / spacing;
+        samples.assign(static_cast<size_t>(samplesX) * samplesZ, 0.0f);
+}
+
+float Heightfield::height(float x, float z) const {
+        // position in samples, clamped to the grid: std::max returns its first argument when the other is NaN,
+        // so NaNs become 0 like with max_ps in the batched paths
+        float fx = std::min(std::max(0.0f, (x - origin.x) * inverseSpacing.x), static_cast<float>(samplesX - 1));
+        float fz = std::min(std::max(0.0f, (z - origin.y) * inverseSpacing.y), static_cast<float>(samplesZ - 1));
+
+        // the cell, whose last one also holds the points on the far border
+        float cellX = static_cast<float>(static_cast<int32_t>(std::min(fx, static_cast<float>(samplesX - 2))));
+        float cellZ = static_cast<float>(static_cast<int32_t>(std::min(fz, static_cast<float>(samplesZ - 2))));
+        float px = fx - cellX;
+        float pz = fz - cellZ;
+
+        size_t index = static_cast<size_t>(cellZ) * samplesX + static_cast<size_t>(cellX);
+        float h00 = samples[index];
+        float h10 = samples[index + 1];
+        float h01 = samples[index + samplesX];
+        float h11 = samples[index + samplesX + 1];
+
+        if (px + pz < 1.0f) {
+                return h00 + px * (h10 - h00) + pz * (h01 - h00);
+        }
+        return h11 + (1.0f - px) * (h01 - h11) + (1.0f - pz) * (h10 - h11);
+}
+
+void Heightfield::heights(const float* x, const float* z, float* heights, size_t count) const {
+        size_t i = 0;
+
+#if defined(HEIGHTFIELD_USE_AVX2)
+        const __m256 originX = _mm256_set1_ps(origin.x);
+        const __m256 originZ = _mm256_set1_ps(origin.y);
+        const __m256 inverseX = _mm256_set1_ps(inverseSpacing.x);
+        const __m256 inverseZ = _mm256_set1_ps(inverseSpacing.y);
+        const __m256 lastX = _mm256_set1_ps(static_cast<float>(samplesX - 1));
+        const __m256 lastZ = _mm256_set1_ps(static_cast<float>(samplesZ - 1));
+        const __m256 lastCellX = _mm256_set1_ps(static_cast<float>(samplesX - 2));
+        const __m256 lastCellZ = _mm256_set1_ps(static_cast<float>(samplesZ - 2));
+        const __m256 rowLength = _mm256_set1_ps(static_cast<float>(samplesX));
+        const __m256 zero = _mm256_setzero_ps();
+        const __m256 one = _mm256_set1_ps(1.0f);
+        const __m256i nextX = _mm256_set1_epi32(1);
+        const __m256i nextZ = _mm256_set1_epi32(static_cast<int32_t>(samplesX));
+
+        for (; i + 8 <= count; i += 8) {
+                __m256 fx = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(x + i), originX), inverseX);
+                __m256 fz = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(z + i), originZ), inverseZ);
+                fx = _mm256_min_ps(_mm256_max_ps(fx, zero), lastX);
+                fz = _mm256_min_ps(_mm256_max_ps(fz, zero), lastZ);
+
+                __m256 cellX = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_min_ps(fx, lastCellX)));
+                __m256 cellZ = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_min_ps(fz, lastCellZ)));
+                __m256 px = _mm256_sub_ps(fx, cellX);
+                __m256 pz = _mm256_sub_ps(fz, cellZ);
+
+                // the indices stay exact in float up to 2^24 samples
+                __m256i index = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(cellZ, rowLength), cellX));
+                __m256 h00 = _mm256_i32gather_ps(samples.data(), index, 4);
+                __m256 h10 = _mm256_i32gather_ps(samples.data(), _mm256_add_epi32(index, nextX), 4);
+                __m256 h01 = _mm256_i32gather_ps(samples.data(), _mm256_add_epi32(index, nextZ), 4);
+                __m256 h11 = _mm256_i32gather_ps(samples.data(), _mm256_add_epi32(_mm256_add_epi32(index, nextZ), nextX), 4);
+
+                __m256 lower = _mm256_add_ps(_mm256_add_ps(h00, _mm256_mul_ps(px, _mm256_sub_ps(h10, h00))),
+                                             _mm256_mul_ps(pz, _mm256_sub_ps(h01, h00)));
+                __m256 upper = _mm256_add_ps(_mm256_add_ps(h11, _mm256_mul_ps(_mm256_sub_ps(one, px), _mm256_sub_ps(h01, h11))),
+                                             _mm256_mul_ps(_mm256_sub_ps(one, pz), _mm256_sub_ps(h10, h11)));
+                __m256 isLower = _mm256_cmp_ps(_mm256_add_ps(px, pz), one, _CMP_LT_OQ);
+                _mm256_storeu_ps(heights + i, _mm256_blendv_ps(upper, lower, isLower));
+        }
+#elif defined(HEIGHTFIELD_USE_SSE2)
+        const __m128 originX = _mm_set1_ps(origin.x);
+        const __m128 originZ = _mm_set1_ps(origin.y);
+        const __m128 inverseX = _mm_set1_ps(inverseSpacing.x);
+        const __m128 inverseZ = _mm_set1_ps(inverseSpacing.y);
+        const __m128 lastX = _mm_set1_ps(static_cast<float>(samplesX - 1));
+        const __m128 lastZ = _mm_set1_ps(static_cast<float>(samplesZ - 1));
+        const __m128 lastCellX = _mm_set1_ps(static_cast<float>(samplesX - 2));
+        const __m128 lastCellZ = _mm_set1_ps(static_cast<float>(samplesZ - 2));
+        const __m128 rowLength = _mm_set1_ps(static_cast<float>(samplesX));
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        alignas(16) int32_t index[4];
+
+        for (; i + 4 <= count; i += 4) {
+                __m128 fx = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(x + i), originX), inverseX);
+                __m128 fz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(z + i), originZ), inverseZ);
+                fx = _mm_min_ps(_mm_max_ps(fx, zero), lastX);
+                fz = _mm_min_ps(_mm_max_ps(fz, zero), lastZ);
+
+                __m128 cellX = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_min_ps(fx, lastCellX)));
+                __m128 cellZ = _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_min_ps(fz, lastCellZ)));
+                __m128 px = _mm_sub_ps(fx, cellX);
+                __m128 pz = _mm_sub_ps(fz, cellZ);
+
+                // the indices stay exact in float up to 2^24 samples
+                _mm_store_si128(reinterpret_cast<__m128i*>(index),
+                                _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(cellZ, rowLength), cellX)));
+                const float* s0 = &samples[index[0]];
+                const float* s1 = &samples[index[1]];
+                const float* s2 = &samples[index[2]];
+                const float* s3 = &samples[index[3]];
+                __m128 h00 = _mm_setr_ps(s0[0], s1[0], s2[0], s3[0]);
+                __m128 h10 = _mm_setr_ps(s0[1], s1[1], s2[1], s3[1]);
+                __m128 h01 = _mm_setr_ps(s0[samplesX], s1[samplesX], s2[samplesX], s3[samplesX]);
+                __m128 h11 = _mm_setr_ps(s0[samplesX + 1], s1[samplesX + 1], s2[samplesX + 1], s3[samplesX + 1]);
+
+                __m128 lower = _mm_add_ps(_mm_add_ps(h00, _mm_mul_ps(px, _mm_sub_ps(h10, h00))),
+                                          _mm_mul_ps(pz, _mm_sub_ps(h01, h00)));
+                __m128 upper = _mm_add_ps(_mm_add_ps(h11, _mm_mul_ps(_mm_sub_ps(one, px), _mm_sub_ps(h01, h11))),
+                                          _mm_mul_ps(_mm_sub_ps(one, pz), _mm_sub_ps(h10, h11)));
+                __m128 isLower = _mm_cmplt_ps(_mm_add_ps(px, pz), one);
+                _mm_storeu_ps(heights + i, _mm_or_ps(_mm_and_ps(isLower, lower), _mm_andnot_ps(isLower, upper)));
+        }
+#endif
+
+        for (; i < count; i++) {
+                heights[i] = height(x[i], z[i]);
+        }
+}
+
+
+#endif          // HEIGHTFIELD_H
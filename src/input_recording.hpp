@@ -0,0 +1,131 @@
+#ifndef INPUT_RECORDING_H
+#define INPUT_RECORDING_H
+
+/**********************************************************************************
+ *
+ *  Recording of the keys pressed during a session, to replay it later.
+ *
+ *  The state of the keys read by the application is sampled once per frame
+ *  as a set of InputKey bits, and only its changes are kept, each with the
+ *  time (in seconds from the start of the session) of the frame it was seen
+ *  in. The file is an InputRecordingHeader followed by its InputEvents, 8
+ *  bytes each, so that even long sessions take a few KB.
+ *  A replay asks for the keys at a time of its own clock, which only goes
+ *  forward: they are the keys of the last event up to that time.
+ *
+ **********************************************************************************/
+
+
+#define INPUT_RECORDING_VERSION 1
+
+
+// Keys read by the application, as bits of the state of the input in a frame
+enum InputKey : uint32_t {
+        INPUT_KEY_W = 1 << 0,
+        INPUT_KEY_A = 1 << 1,
+        INPUT_KEY_S = 1 << 2,
+        INPUT_KEY_D = 1 << 3,
+        INPUT_KEY_R = 1 << 4,
+        INPUT_KEY_V = 1 << 5,
+        INPUT_KEY_B = 1 << 6,
+        INPUT_KEY_N = 1 << 7,
+        INPUT_KEY_M = 1 << 8,
+        INPUT_KEY_1 = 1 << 9,
+        INPUT_KEY_2 = 1 << 10,
+        INPUT_KEY_SPACE = 1 << 11
+};
+
+// Header of the .input files, followed by eventCount InputEvents
+struct InputRecordingHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t eventCount;
+        float duration;
+};
+
+struct InputEvent {
+        float time;
+        uint32_t keys;
+};
+
+
+class InputRecording {
+public:
+        // Appends the state of the keys at time, if they changed since the last call
+        void record(float time, uint32_t keys);
+        void save(const std::string& file, float duration);
+        void load(const std::string& file);
+
+        // The keys at time, which must not be earlier than the one of the previous call
+        uint32_t keysAt(float time);
+        float getDuration() const { return duration; }
+        size_t getEventCount() const { return events.size(); }
+
+private:
+        std::vector<InputEvent> events;
+        float duration = 0.0f;
+        size_t nextEvent = 0;
+        uint32_t currentKeys = 0;
+};
+
+
+void InputRecording::record(float time, uint32_t keys) {
+        if (!events.empty() && events.back().keys == keys) {
+                return;
+        }
+        events.push_back({time, keys});
+}
+
+void InputRecording::save(const std::string& file, float duration) {
+        InputRecordingHeader header{};
+        memcpy(header.magic, "CARINPT", 8);
+        header.version = INPUT_RECORDING_VERSION;
+        header.eventCount = static_cast<uint32_t>(events.size());
+        header.duration = duration;
+
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(events.data()), events.size() * sizeof(InputEvent));
+        out.close();
+
+        if (!out) {
+                throw std::runtime_error("failed to write input recording " + file + "!");
+        }
+        std::cout << "Input recording of " << duration << " s (" << events.size() << " changes) written to " << file << "\n";
+}
+
+void InputRecording::load(const std::string& file) {
+        std::ifstream in(file, std::ios::binary);
+        InputRecordingHeader header{};
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+            || memcmp(header.magic, "CARINPT", 8) != 0 || header.version != INPUT_RECORDING_VERSION) {
+                throw std::runtime_error("failed to read input recording " + file + "!");
+        }
+
+        // the events must fill the rest of the file, before trusting their count with an allocation
+        in.seekg(0, std::ios::end);
+        std::streamoff eventBytes = static_cast<std::streamoff>(in.tellg()) - static_cast<std::streamoff>(sizeof(header));
+        if (!in || eventBytes != static_cast<std::streamoff>(header.eventCount) * static_cast<std::streamoff>(sizeof(InputEvent))) {
+                throw std::runtime_error("input recording " + file + " does not hold its " + std::to_string(header.eventCount) + " events!");
+        }
+        in.seekg(sizeof(header), std::ios::beg);
+
+        events.resize(header.eventCount);
+        if (!in.read(reinterpret_cast<char*>(events.data()), events.size() * sizeof(InputEvent))) {
+                throw std::runtime_error("input recording " + file + " is truncated!");
+        }
+        duration = header.duration;
+        nextEvent = 0;
+        currentKeys = 0;
+}
+
+uint32_t InputRecording::keysAt(float time) {
+        while (nextEvent < events.size() && events[nextEvent].time <= time) {
+                currentKeys = events[nextEvent].keys;
+                nextEvent++;
+        }
+        return currentKeys;
+}
+
+
+#endif          // INPUT_RECORDING_H
@@ -0,0 +1,377 @@
+#ifndef OBJ_LOADER_H
+#define OBJ_LOADER_H
+
+/**********************************************************************************
+ *
+ *  Multithreaded .obj parser, used by Model::loadModel for big models.
+ *
+ *  The file is split into line-aligned chunks that are parsed on all the cores,
+ *  then the chunks are merged in file order. Numbers are converted with the same
+ *  routines of tinyobj, so the result is identical to the one of tinyobj::LoadObj.
+ *  Whatever this parser does not support (polygons with more than 4 vertices,
+ *  invalid indices, ...) makes it give up, and the caller falls back to tinyobj.
+ *
+ **********************************************************************************/
+
+#include <thread>
+
+
+// Files smaller than this are left to tinyobj, threads would only add overhead
+const size_t OBJ_PARALLEL_MIN_FILE_SIZE = 256 * 1024;
+
+// Minimum number of bytes parsed by each thread
+const size_t OBJ_PARALLEL_MIN_CHUNK_SIZE = 64 * 1024;
+
+
+// Bits of ObjChunk::relative, telling which indices of a corner are relative to the chunk
+const uint8_t OBJ_RELATIVE_VERTEX = 1;
+const uint8_t OBJ_RELATIVE_TEXCOORD = 2;
+const uint8_t OBJ_RELATIVE_NORMAL = 4;
+
+
+// Records found in a line-aligned chunk of an .obj file
+struct ObjChunk {
+        std::vector<tinyobj::real_t> vertices;
+        std::vector<tinyobj::real_t> normals;
+        std::vector<tinyobj::real_t> texcoords;
+        std::vector<tinyobj::index_t> corners;
+        std::vector<uint8_t> relative;
+        std::vector<int> faceSizes;
+        bool isSupported = true;
+};
+
+
+static inline bool isObjSpace(char c) {
+        return c == ' ' || c == '\t';
+}
+
+static inline bool isObjNewLine(char c) {
+        return c == '\r' || c == '\n' || c == '\0';
+}
+
+// Same rules as fixIndex of tinyobj, but negative indices are resolved against the
+// counts of the chunk only: they are flagged, and the counts of the previous chunks are added when merging
+static bool fixObjChunkIndex(int idx, size_t chunkCount, int *ret, uint8_t *relative, uint8_t flag) {
+        if (idx > 0) {
+                *ret = idx - 1;
+                return true;
+        }
+        if (idx < 0) {
+                *ret = static_cast<int>(chunkCount) + idx;
+                *relative |= flag;
+                return true;
+        }
+        // zero is not allowed by the .obj specification
+        return false;
+}
+
+// Parse a face corner: i, i/j/k, i//k or i/j (same rules as parseTriple of tinyobj)
+static bool parseObjCorner(const char **token, const ObjChunk& chunk,
+                           tinyobj::index_t *corner, uint8_t *relative) {
+        const char *t = *token;
+
+        corner->vertex_index = -1;
+        corner->texcoord_index = -1;
+        corner->normal_index = -1;
+        *relative = 0;
+
+        if (!fixObjChunkIndex(atoi(t), chunk.vertices.size() / 3, &corner->vertex_index,
+                              relative, OBJ_RELATIVE_VERTEX)) {
+                return false;
+        }
+        t += strcspn(t, "/ \t\r");
+
+        if (t[0] == '/') {
+                t++;
+                if (t[0] == '/') {
+                        // i//k
+                        t++;
+                        if (!fixObjChunkIndex(atoi(t), chunk.normals.size() / 3, &corner->normal_index,
+                                              relative, OBJ_RELATIVE_NORMAL)) {
+                                return false;
+                        }
+                        t += strcspn(t, "/ \t\r");
+                } else {
+                        // i/j/k or i/j
+                        if (!fixObjChunkIndex(atoi(t), chunk.texcoords.size() / 2, &corner->texcoord_index,
+                                              relative, OBJ_RELATIVE_TEXCOORD)) {
+                                return false;
+                        }
+                        t += strcspn(t, "/ \t\r");
+
+                        if (t[0] == '/') {
+                                t++;
+                                if (!fixObjChunkIndex(atoi(t), chunk.normals.size() / 3, &corner->normal_index,
+                                                      relative, OBJ_RELATIVE_NORMAL)) {
+                                        return false;
+                                }
+                                t += strcspn(t, "/ \t\r");
+                        }
+                }
+        }
+
+        *token = t;
+        return true;
+}
+
+// Parse the lines in [begin, end), where end is just after a '\n' or at the end of the file.
+// Each '\n' is replaced by '\0', so that the tinyobj number parsers stop at the end of the line.
+static void parseObjChunk(char *begin, char *end, ObjChunk& chunk) {
+        char *line = begin;
+
+        while (line < end && chunk.isSupported) {
+                char *lineEnd = static_cast<char *>(memchr(line, '\n', end - line));
+                if (lineEnd == nullptr) {
+                        lineEnd = end;
+                }
+                *lineEnd = '\0';
+
+                const char *token = line + strspn(line, " \t");
+
+                if (token[0] == 'v' && isObjSpace(token[1])) {
+                        token += 2;
+                        chunk.vertices.push_back(tinyobj::parseReal(&token));
+                        chunk.vertices.push_back(tinyobj::parseReal(&token));
+                        chunk.vertices.push_back(tinyobj::parseReal(&token));
+                } else if (token[0] == 'v' && token[1] == 'n' && isObjSpace(token[2])) {
+                        token += 3;
+                        chunk.normals.push_back(tinyobj::parseReal(&token));
+                        chunk.normals.push_back(tinyobj::parseReal(&token));
+                        chunk.normals.push_back(tinyobj::parseReal(&token));
+                } else if (token[0] == 'v' && token[1] == 't' && isObjSpace(token[2])) {
+                        token += 3;
+                        chunk.texcoords.push_back(tinyobj::parseReal(&token));
+                        chunk.texcoords.push_back(tinyobj::parseReal(&token));
+                } else if (token[0] == 'f' && isObjSpace(token[1])) {
+                        token += 2;
+                        token += strspn(token, " \t");
+
+                        int faceSize = 0;
+                        while (!isObjNewLine(token[0])) {
+                                tinyobj::index_t corner;
+                                uint8_t relative;
+                                if (!parseObjCorner(&token, chunk, &corner, &relative)) {
+                                        chunk.isSupported = false;
+                                        break;
+                                }
+                                chunk.corners.push_back(corner);
+                                chunk.relative.push_back(relative);
+                                faceSize++;
+                                token += strspn(token, " \t\r");
+                        }
+                        chunk.faceSizes.push_back(faceSize);
+                }
+                // other records (comments, objects, groups, materials, ...) do not affect the mesh
+
+                line = lineEnd + 1;
+        }
+}
+
+// Parse an .obj file on all the cores, filling the positions, normals and texture coordinates
+// of attrib, and the triangulated face corners in file order.
+// Returns false if the file is small or uses features not handled here: tinyobj should be used instead.
+bool loadObjParallel(const std::string& file, tinyobj::attrib_t& attrib,
+                     std::vector<tinyobj::index_t>& corners, unsigned int threadCount = 0) {
+        if (threadCount == 0) {
+                threadCount = std::thread::hardware_concurrency();
+        }
+
+        std::ifstream in(file, std::ios::ate | std::ios::binary);
+        if (!in.is_open()) {
+                return false;
+        }
+
+        size_t fileSize = static_cast<size_t>(in.tellg());
+        if (fileSize < OBJ_PARALLEL_MIN_FILE_SIZE || threadCount < 2) {
+                return false;
+        }
+
+        // one more byte for the terminator of the last line
+        std::vector<char> buffer(fileSize + 1, '\0');
+        in.seekg(0);
+        in.read(buffer.data(), fileSize);
+        in.close();
+
+        // Split the file into line-aligned chunks, each one starting just after a '\n'
+        size_t chunkCount = std::min<size_t>(threadCount, fileSize / OBJ_PARALLEL_MIN_CHUNK_SIZE);
+        std::vector<char *> boundaries{buffer.data()};
+        for (size_t i = 1; i < chunkCount; i++) {
+                char *boundary = std::max(buffer.data() + fileSize * i / chunkCount, boundaries.back());
+                char *newLine = static_cast<char *>(memchr(boundary, '\n', buffer.data() + fileSize - boundary));
+                if (newLine == nullptr) {
+                        break;
+                }
+                boundaries.push_back(newLine + 1);
+        }
+        boundaries.push_back(buffer.data() + fileSize);
+
+        std::vector<ObjChunk> chunks(boundaries.size() - 1);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < chunks.size(); i++) {
+                threads.emplace_back(parseObjChunk, boundaries[i], boundaries[i + 1], std::ref(chunks[i]));
+        }
+        for (auto& thread : threads) {
+                thread.join();
+        }
+
+        // Merge the chunks in file order, turning the chunk-relative indices into absolute ones
+        size_t vertexCount = 0;
+        size_t normalCount = 0;
+        size_t texcoordCount = 0;
+        std::vector<tinyobj::index_t> faceCorners;
+
+        for (auto& chunk : chunks) {
+                if (!chunk.isSupported) {
+                        return false;
+                }
+
+                for (size_t k = 0; k < chunk.corners.size(); k++) {
+                        tinyobj::index_t corner = chunk.corners[k];
+                        if (chunk.relative[k] & OBJ_RELATIVE_VERTEX) {
+                                corner.vertex_index += static_cast<int>(vertexCount / 3);
+                        }
+                        if (chunk.relative[k] & OBJ_RELATIVE_TEXCOORD) {
+                                corner.texcoord_index += static_cast<int>(texcoordCount / 2);
+                        }
+                        if (chunk.relative[k] & OBJ_RELATIVE_NORMAL) {
+                                corner.normal_index += static_cast<int>(normalCount / 3);
+                        }
+                        faceCorners.push_back(corner);
+                }
+
+                vertexCount += chunk.vertices.size();
+                normalCount += chunk.normals.size();
+                texcoordCount += chunk.texcoords.size();
+        }
+
+        attrib.vertices.clear();
+        attrib.normals.clear();
+        attrib.texcoords.clear();
+        attrib.vertices.reserve(vertexCount);
+        attrib.normals.reserve(normalCount);
+        attrib.texcoords.reserve(texcoordCount);
+
+        for (const auto& chunk : chunks) {
+                attrib.vertices.insert(attrib.vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+                attrib.normals.insert(attrib.normals.end(), chunk.normals.begin(), chunk.normals.end());
+                attrib.texcoords.insert(attrib.texcoords.end(), chunk.texcoords.begin(), chunk.texcoords.end());
+        }
+
+        for (const auto& corner : faceCorners) {
+                if (corner.vertex_index < 0 || 3 * static_cast<size_t>(corner.vertex_index) + 2 >= vertexCount
+                    || corner.texcoord_index < -1 || 2 * static_cast<long>(corner.texcoord_index) + 1 >= static_cast<long>(texcoordCount)
+                    || corner.normal_index < -1 || 3 * static_cast<long>(corner.normal_index) + 2 >= static_cast<long>(normalCount)) {
+                        return false;
+                }
+        }
+
+        // Triangulate the faces in the same way as tinyobj
+        corners.clear();
+        corners.reserve(faceCorners.size());
+        size_t first = 0;
+
+        for (const auto& chunk : chunks) {
+                for (int faceSize : chunk.faceSizes) {
+                        const tinyobj::index_t *face = &faceCorners[first];
+                        first += faceSize;
+
+                        if (faceSize == 3) {
+                                corners.insert(corners.end(), face, face + 3);
+                        } else if (faceSize == 4) {
+                                // split the quad along its shortest diagonal
+                                const tinyobj::real_t *v0 = &attrib.vertices[3 * face[0].vertex_index];
+                                const tinyobj::real_t *v1 = &attrib.vertices[3 * face[1].vertex_index];
+                                const tinyobj::real_t *v2 = &attrib.vertices[3 * face[2].vertex_index];
+                                const tinyobj::real_t *v3 = &attrib.vertices[3 * face[3].vertex_index];
+
+                                tinyobj::real_t e02x = v2[0] - v0[0];
+                                tinyobj::real_t e02y = v2[1] - v0[1];
+                                tinyobj::real_t e02z = v2[2] - v0[2];
+                                tinyobj::real_t e13x = v3[0] - v1[0];
+                                tinyobj::real_t e13y = v3[1] - v1[1];
+                                tinyobj::real_t e13z = v3[2] - v1[2];
+
+                                tinyobj::real_t sqr02 = e02x * e02x + e02y * e02y + e02z * e02z;
+                                tinyobj::real_t sqr13 = e13x * e13x + e13y * e13y + e13z * e13z;
+
+                                if (sqr02 < sqr13) {
+                                        corners.insert(corners.end(), {face[0], face[1], face[2],
+                                                                       face[0], face[2], face[3]});
+                                } else {
+                                        corners.insert(corners.end(), {face[0], face[1], face[3],
+                                                                       face[1], face[2], face[3]});
+                                }
+                        } else {
+                                return false;
+                        }
+                }
+        }
+
+        return true;
+}
+
+
+// Compare the parallel parser against tinyobj::LoadObj, printing the best time out of some runs
+void benchmarkObjLoading(const std::vector<std::string>& files, int runs) {
+        unsigned int threadCount = std::max(2u, std::thread::hardware_concurrency());
+
+        for (const auto& file : files) {
+                float tinyobjTime = std::numeric_limits<float>::max();
+                float parallelTime = std::numeric_limits<float>::max();
+
+                tinyobj::attrib_t tinyobjAttrib;
+                std::vector<tinyobj::index_t> tinyobjCorners;
+                tinyobj::attrib_t parallelAttrib;
+                std::vector<tinyobj::index_t> parallelCorners;
+                bool isParallelSupported = true;
+
+                for (int run = 0; run < runs; run++) {
+                        std::vector<tinyobj::shape_t> shapes;
+                        std::vector<tinyobj::material_t> materials;
+                        std::string warn, err;
+
+                        auto start_time = std::chrono::high_resolution_clock::now();
+                        if (!tinyobj::LoadObj(&tinyobjAttrib, &shapes, &materials, &warn, &err, file.c_str())) {
+                                throw std::runtime_error(warn + err);
+                        }
+                        auto end_time = std::chrono::high_resolution_clock::now();
+                        tinyobjTime = std::min(tinyobjTime, std::chrono::duration<float, std::chrono::milliseconds::period>(end_time - start_time).count());
+
+                        tinyobjCorners.clear();
+                        for (const auto& shape : shapes) {
+                                tinyobjCorners.insert(tinyobjCorners.end(), shape.mesh.indices.begin(), shape.mesh.indices.end());
+                        }
+
+                        start_time = std::chrono::high_resolution_clock::now();
+                        isParallelSupported = loadObjParallel(file, parallelAttrib, parallelCorners, threadCount);
+                        end_time = std::chrono::high_resolution_clock::now();
+                        parallelTime = std::min(parallelTime, std::chrono::duration<float, std::chrono::milliseconds::period>(end_time - start_time).count());
+                }
+
+                bool isIdentical = isParallelSupported
+                                   && tinyobjAttrib.vertices == parallelAttrib.vertices
+                                   && tinyobjAttrib.normals == parallelAttrib.normals
+                                   && tinyobjAttrib.texcoords == parallelAttrib.texcoords
+                                   && tinyobjCorners.size() == parallelCorners.size()
+                                   && std::equal(tinyobjCorners.begin(), tinyobjCorners.end(), parallelCorners.begin(),
+                                                 [](const tinyobj::index_t& a, const tinyobj::index_t& b) {
+                                                         return a.vertex_index == b.vertex_index
+                                                                && a.normal_index == b.normal_index
+                                                                && a.texcoord_index == b.texcoord_index;
+                                                 });
+
+                std::cout << std::fixed << std::setprecision(2);
+                std::cout << file << " -> tinyobj: " << tinyobjTime << " ms"
+                          << "  |  parallel (" << threadCount << " threads): ";
+                if (isParallelSupported) {
+                        std::cout << parallelTime << " ms"
+                                  << "  |  speedup: " << tinyobjTime / parallelTime << "x"
+                                  << "  |  identical: " << (isIdentical ? "yes" : "NO") << "\n";
+                } else {
+                        std::cout << "not supported (file too small or unsupported records)\n";
+                }
+        }
+}
+
+
+#endif          // OBJ_LOADER_H
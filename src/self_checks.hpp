@@ -0,0 +1,451 @@
+#ifndef SELF_CHECKS_H
+#define SELF_CHECKS_H
+
+/**********************************************************************************
+ *
+ *  Checks of the runtime modules against the code they replaced, and timings
+ *  of both, run from the command line without opening a window (see main).
+ *
+ *  Each check prints its measurements and returns false if the new code does
+ *  not match the old one, so that main exits with EXIT_FAILURE. They are kept
+ *  out of the headers of the modules, which the application includes.
+ *
+ **********************************************************************************/
+
+#include <random>
+
+
+// Loads the models with Model::loadModel (deduplicated, and parsed in parallel if big) and with tinyobj (one
+// vertex per corner, like before the deduplication), and checks that the index buffer gives back the same
+// triangles, corner by corner; false if any position, normal or texture coordinate differs
+bool checkModelDedup(const std::vector<std::string>& files) {
+        bool isCorrect = true;
+
+        for (const auto& file : files) {
+                tinyobj::attrib_t attrib;
+                std::vector<tinyobj::shape_t> shapes;
+                std::vector<tinyobj::material_t> materials;
+                std::string warn, err;
+                if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, file.c_str())) {
+                        throw std::runtime_error(warn + err);
+                }
+
+                std::vector<Vertex> expanded;
+                for (const auto& shape : shapes) {
+                        for (const auto& index : shape.mesh.indices) {
+                                Vertex vertex{};
+                                vertex.pos = {
+                                                attrib.vertices[3 * index.vertex_index + 0],
+                                                attrib.vertices[3 * index.vertex_index + 1],
+                                                attrib.vertices[3 * index.vertex_index + 2]
+                                };
+                                vertex.texCoord = {
+                                                attrib.texcoords[2 * index.texcoord_index + 0],
+                                                1 - attrib.texcoords[2 * index.texcoord_index + 1]
+                                };
+                                vertex.norm = {
+                                                attrib.normals[3 * index.normal_index + 0],
+                                                attrib.normals[3 * index.normal_index + 1],
+                                                attrib.normals[3 * index.normal_index + 2]
+                                };
+                                expanded.push_back(vertex);
+                        }
+                }
+
+                Model model;
+                model.loadModel(file);
+
+                size_t mismatches = 0;
+                bool isInRange = model.indices.size() == expanded.size();
+                for (size_t i = 0; isInRange && i < expanded.size(); i++) {
+                        if (model.indices[i] >= model.vertices.size()) {
+                                isInRange = false;
+                        } else if (!(model.vertices[model.indices[i]] == expanded[i])) {
+                                mismatches++;
+                        }
+                }
+
+                bool isMatching = isInRange && mismatches == 0;
+                isCorrect = isCorrect && isMatching;
+                std::cout << "  " << file << ": " << expanded.size() / 3 << " triangles, " << model.indices.size()
+                          << " indices into " << model.vertices.size() << " vertices"
+                          << (!isInRange ? ", BAD INDICES" : "") << ", corners differing: " << mismatches
+                          << (isMatching ? ", ok" : ", MISMATCH") << "\n";
+        }
+
+        std::cout << (isCorrect ? "  all checks passed\n" : "  CHECKS FAILED\n");
+        return isCorrect;
+}
+
+
+// Builds a CdlodQuadtree on a synthetic heightfield of samples x samples, checks its levels, then selects it
+// from some views and checks that the patches and quarters selected cover every cell of the heightfield in the
+// frustum exactly once (and no cell twice), printing the times of the build and of the selections; false if a
+// check failed
+bool checkCdlodQuadtree(uint32_t samples) {
+        const glm::vec2 origin(-0.5f * (samples - 1), -0.5f * (samples - 1));
+        const glm::vec2 spacing(1.0f, 1.0f);
+        const uint32_t cells = samples - 1;
+
+        std::vector<float> heights(static_cast<size_t>(samples) * samples);
+        for (uint32_t row = 0; row < samples; row++) {
+                for (uint32_t col = 0; col < samples; col++) {
+                        heights[static_cast<size_t>(row) * samples + col] = 60.0f * std::sin(col * 0.01f) * std::cos(row * 0.013f)
+                                                                            + 20.0f * std::sin(col * 0.071f + row * 0.053f);
+                }
+        }
+        auto sampleHeight = [&](uint32_t col, uint32_t row) { return heights[static_cast<size_t>(row) * samples + col]; };
+
+        auto start_time = std::chrono::high_resolution_clock::now();
+        CdlodQuadtree quadtree;
+        quadtree.init(heights, samples, samples, origin, spacing);
+        float buildTime = std::chrono::duration<float, std::chrono::milliseconds::period>(
+                        std::chrono::high_resolution_clock::now() - start_time).count();
+
+        // a leaf spans CDLOD_PATCH_RESOLUTION cells, and the root the whole heightfield
+        uint32_t expectedLevels = std::min(CDLOD_MAX_LEVELS, 1 + static_cast<uint32_t>(std::max(0.0, std::ceil(
+                        std::log2(static_cast<double>(cells) / CDLOD_PATCH_RESOLUTION)))));
+        bool isCorrect = quadtree.getLevelCount() == expectedLevels;
+        std::cout << "CDLOD quadtree of " << samples << "x" << samples << " samples, built in " << std::fixed
+                  << std::setprecision(3) << buildTime << " ms: " << quadtree.getLevelCount() << " levels (expected "
+                  << expectedLevels << ")" << (isCorrect ? ", ok" : ", MISMATCH") << "\n";
+
+        struct View {
+                const char* name;
+                glm::vec3 eye;
+                glm::vec3 target;
+                glm::vec3 up;
+        };
+        float half = 0.5f * cells * spacing.x;
+        float ground = sampleHeight(cells / 2, cells / 2);
+        const std::array<View, 4> views = {{
+                {"centre, on the ground", glm::vec3(0.0f, ground + 2.0f, 0.0f), glm::vec3(100.0f, ground, 30.0f), glm::vec3(0.0f, 1.0f, 0.0f)},
+                {"corner, across", glm::vec3(-half, 100.0f, -half), glm::vec3(half, 0.0f, half), glm::vec3(0.0f, 1.0f, 0.0f)},
+                {"above, looking down", glm::vec3(0.0f, 2.0f * half, 0.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f)},
+                {"outside, looking away", glm::vec3(2.0f * half, 50.0f, 0.0f), glm::vec3(4.0f * half, 50.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f)},
+        }};
+
+        std::vector<uint8_t> coverage(static_cast<size_t>(cells) * cells);
+        CdlodSelection patches;
+        for (const auto& view : views) {
+                glm::mat4 proj = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, 0.1f, 4.0f * half);
+                proj[1][1] *= -1;
+                Frustum frustum = Frustum::fromMatrix(proj * glm::lookAt(view.eye, view.target, view.up));
+
+                float selectTime = std::numeric_limits<float>::max();
+                uint32_t culled = 0;
+                for (int run = 0; run < 10; run++) {
+                        start_time = std::chrono::high_resolution_clock::now();
+                        culled = quadtree.select(frustum, view.eye, patches);
+                        selectTime = std::min(selectTime, std::chrono::duration<float, std::chrono::milliseconds::period>(
+                                        std::chrono::high_resolution_clock::now() - start_time).count());
+                }
+
+                // the cells under each patch (or quarter), clipped to the heightfield like in the vertex shader
+                std::fill(coverage.begin(), coverage.end(), 0);
+                size_t selected = 0;
+                size_t overlaps = 0;
+                for (uint32_t part = 0; part < CDLOD_PATCH_PARTS; part++) {
+                        for (const auto& patch : patches[part]) {
+                                uint32_t nodeCells = CDLOD_PATCH_RESOLUTION << patch.flags;
+                                uint32_t size = (part == 0) ? nodeCells : nodeCells / 2;
+                                uint32_t firstX = static_cast<uint32_t>(std::lround((patch.model[3].x - origin.x) / spacing.x));
+                                uint32_t firstZ = static_cast<uint32_t>(std::lround((patch.model[3].z - origin.y) / spacing.y));
+                                if (part > 0) {
+                                        firstX += ((part - 1) & 1) * size;
+                                        firstZ += ((part - 1) >> 1) * size;
+                                }
+                                for (uint32_t z = firstZ; z < std::min(firstZ + size, cells); z++) {
+                                        for (uint32_t x = firstX; x < std::min(firstX + size, cells); x++) {
+                                                uint8_t& count = coverage[static_cast<size_t>(z) * cells + x];
+                                                overlaps += (count > 0) ? 1 : 0;
+                                                count = std::min(count + 1, 255);
+                                        }
+                                }
+                                selected++;
+                        }
+                }
+
+                // every cell in the frustum must be covered (the culling is conservative, so others may be too)
+                size_t visibleCells = 0;
+                size_t holes = 0;
+                for (uint32_t z = 0; z < cells; z++) {
+                        for (uint32_t x = 0; x < cells; x++) {
+                                float h00 = sampleHeight(x, z), h10 = sampleHeight(x + 1, z);
+                                float h01 = sampleHeight(x, z + 1), h11 = sampleHeight(x + 1, z + 1);
+                                glm::vec3 boxMin(origin.x + x * spacing.x, std::min(std::min(h00, h10), std::min(h01, h11)),
+                                                 origin.y + z * spacing.y);
+                                glm::vec3 boxMax(boxMin.x + spacing.x, std::max(std::max(h00, h10), std::max(h01, h11)),
+                                                 boxMin.z + spacing.y);
+                                if (frustum.intersects(boxMin, boxMax)) {
+                                        visibleCells++;
+                                        holes += (coverage[static_cast<size_t>(z) * cells + x] == 0) ? 1 : 0;
+                                }
+                        }
+                }
+
+                bool isMatching = holes == 0 && overlaps == 0;
+                isCorrect = isCorrect && isMatching;
+                std::cout << "  " << std::setw(22) << view.name << ":  " << selected << " patches (culled " << culled
+                          << "), selected in " << selectTime << " ms  |  cells in the frustum " << visibleCells
+                          << ", not covered " << holes << ", covered twice " << overlaps
+                          << (isMatching ? ", ok" : ", MISMATCH") << "\n";
+        }
+
+        std::cout << std::defaultfloat << (isCorrect ? "  all checks passed\n" : "  CHECKS FAILED\n");
+        return isCorrect;
+}
+
+
+// Largest difference allowed between Heightfield::height and the barycentric solve it replaced
+const float HEIGHTFIELD_CHECK_TOLERANCE = 1e-3f;
+
+// Degrees allowed between CameraLag and the vector it replaced, on top of the yaw covered in two frames
+const float CAMERA_LAG_CHECK_TOLERANCE = 0.01f;
+
+
+// Height of a point with the barycentric interpolation that the car used before Heightfield: the reference
+// of benchmarkHeightfield (it reads out of the grid outside of it, and divides by zero on its lines)
+float referencePointHeight(const Heightfield& heightfield, float x, float z) {
+        float x_point = x - heightfield.getOrigin().x;
+        float z_point = z - heightfield.getOrigin().y;
+
+        float x_point_float_index = x_point / heightfield.getSpacing().x;
+        float z_point_float_index = z_point / heightfield.getSpacing().y;
+
+        int x_a_index = std::ceil(x_point_float_index);
+        int z_a_index = std::ceil(z_point_float_index);
+        int x_b_index = std::ceil(x_point_float_index);
+        int z_b_index = std::floor(z_point_float_index);
+        int x_c_index = std::floor(x_point_float_index);
+        int z_c_index = std::floor(z_point_float_index);
+        int x_d_index = std::floor(x_point_float_index);
+        int z_d_index = std::ceil(z_point_float_index);
+
+        float x_a = x_a_index * heightfield.getSpacing().x;
+        float x_b = x_b_index * heightfield.getSpacing().x;
+        float x_c = x_c_index * heightfield.getSpacing().x;
+        float x_d = x_d_index * heightfield.getSpacing().x;
+
+        float y_a = heightfield.at(x_a_index, z_a_index);
+        float y_b = heightfield.at(x_b_index, z_b_index);
+        float y_c = heightfield.at(x_c_index, z_c_index);
+        float y_d = heightfield.at(x_d_index, z_d_index);
+
+        float z_a = z_a_index * heightfield.getSpacing().y;
+        float z_b = z_b_index * heightfield.getSpacing().y;
+        float z_c = z_c_index * heightfield.getSpacing().y;
+        float z_d = z_d_index * heightfield.getSpacing().y;
+
+        float x_point_percentage_index = x_point_float_index - x_c_index;
+        float z_point_percentage_index = z_point_float_index - z_c_index;
+
+        if (x_point_percentage_index < - z_point_percentage_index + 1) {
+                float det = (z_b - z_d) * (x_c - x_d) + (x_d - x_b) * (z_c - z_d);
+                float lambda_1 = ((z_b - z_d) * (x_point - x_d) + (x_d - x_b) * (z_point - z_d)) / det;
+                float lambda_2 = ((z_d - z_c) * (x_point - x_d) + (x_c - x_d) * (z_point - z_d)) / det;
+                float lambda_3 = 1.0f - lambda_1 - lambda_2;
+                return lambda_1 * y_c + lambda_2 * y_b + lambda_3 * y_d;
+        }
+        float det = (z_b - z_d) * (x_a - x_d) + (x_d - x_b) * (z_a - z_d);
+        float lambda_1 = ((z_b - z_d) * (x_point - x_d) + (x_d - x_b) * (z_point - z_d)) / det;
+        float lambda_2 = ((z_d - z_a) * (x_point - x_d) + (x_a - x_d) * (z_point - z_d)) / det;
+        float lambda_3 = 1.0f - lambda_1 - lambda_2;
+        return lambda_1 * y_a + lambda_2 * y_b + lambda_3 * y_d;
+}
+
+// Checks the scalar and the batched queries against the reference on random points strictly inside the grid
+// (out of it too for the two Heightfield paths, with some NaN and infinite coordinates), then times the three
+// of them; false if a check failed
+bool benchmarkHeightfield(const Heightfield& heightfield, size_t queries, int runs) {
+        std::mt19937 generator(1);
+        glm::vec2 size = glm::vec2(heightfield.getSamplesX() - 1, heightfield.getSamplesZ() - 1) * heightfield.getSpacing();
+        std::uniform_real_distribution<float> insideX(heightfield.getOrigin().x + 0.001f * size.x,
+                                                      heightfield.getOrigin().x + 0.999f * size.x);
+        std::uniform_real_distribution<float> insideZ(heightfield.getOrigin().y + 0.001f * size.y,
+                                                      heightfield.getOrigin().y + 0.999f * size.y);
+        std::uniform_real_distribution<float> aroundX(heightfield.getOrigin().x - 0.1f * size.x,
+                                                      heightfield.getOrigin().x + 1.1f * size.x);
+        std::uniform_real_distribution<float> aroundZ(heightfield.getOrigin().y - 0.1f * size.y,
+                                                      heightfield.getOrigin().y + 1.1f * size.y);
+
+        std::vector<float> x(queries), z(queries), reference(queries), scalar(queries), batched(queries);
+        for (size_t i = 0; i < queries; i++) {
+                x[i] = insideX(generator);
+                z[i] = insideZ(generator);
+        }
+
+        float referenceTime = std::numeric_limits<float>::max();
+        float scalarTime = std::numeric_limits<float>::max();
+        float batchedTime = std::numeric_limits<float>::max();
+        for (int run = 0; run < runs; run++) {
+                auto start_time = std::chrono::high_resolution_clock::now();
+                for (size_t i = 0; i < queries; i++) {
+                        reference[i] = referencePointHeight(heightfield, x[i], z[i]);
+                }
+                auto end_time = std::chrono::high_resolution_clock::now();
+                referenceTime = std::min(referenceTime, std::chrono::duration<float, std::chrono::milliseconds::period>(end_time - start_time).count());
+
+                start_time = std::chrono::high_resolution_clock::now();
+                for (size_t i = 0; i < queries; i++) {
+                        scalar[i] = heightfield.height(x[i], z[i]);
+                }
+                end_time = std::chrono::high_resolution_clock::now();
+                scalarTime = std::min(scalarTime, std::chrono::duration<float, std::chrono::milliseconds::period>(end_time - start_time).count());
+
+                start_time = std::chrono::high_resolution_clock::now();
+                heightfield.heights(x.data(), z.data(), batched.data(), queries);
+                end_time = std::chrono::high_resolution_clock::now();
+                batchedTime = std::min(batchedTime, std::chrono::duration<float, std::chrono::milliseconds::period>(end_time - start_time).count());
+        }
+
+        float maxReferenceError = 0.0f;
+        float maxBatchedError = 0.0f;
+        for (size_t i = 0; i < queries; i++) {
+                // the reference divides by zero on the lines of the grid, but a NaN from Heightfield is an error
+                float referenceError = std::abs(scalar[i] - reference[i]);
+                float batchedError = std::abs(batched[i] - scalar[i]);
+                if (!std::isnan(reference[i]) && (std::isnan(referenceError) || referenceError > maxReferenceError)) {
+                        maxReferenceError = referenceError;
+                }
+                if (std::isnan(batchedError) || batchedError > maxBatchedError) {
+                        maxBatchedError = batchedError;
+                }
+        }
+
+        // out of the grid, where the reference cannot be used, and on invalid coordinates in every lane of the batches
+        const std::array<float, 3> invalid = {std::numeric_limits<float>::quiet_NaN(),
+                                              std::numeric_limits<float>::infinity(),
+                                              -std::numeric_limits<float>::infinity()};
+        for (size_t i = 0; i < queries; i++) {
+                x[i] = (i % 5 == 0) ? invalid[(i / 5) % invalid.size()] : aroundX(generator);
+                z[i] = (i % 7 == 0) ? invalid[(i / 7) % invalid.size()] : aroundZ(generator);
+        }
+        auto clampToGrid = [](float value, float first, float last) {
+                return std::isnan(value) ? first : std::min(std::max(value, first), last);
+        };
+        heightfield.heights(x.data(), z.data(), batched.data(), queries);
+        size_t borderMismatches = 0;
+        for (size_t i = 0; i < queries; i++) {
+                float clampedX = clampToGrid(x[i], heightfield.getOrigin().x, heightfield.getOrigin().x + size.x);
+                float clampedZ = clampToGrid(z[i], heightfield.getOrigin().y, heightfield.getOrigin().y + size.y);
+                if (batched[i] != heightfield.height(x[i], z[i])
+                    || std::abs(batched[i] - heightfield.height(clampedX, clampedZ)) > 1e-4f) {
+                        borderMismatches++;
+                }
+        }
+
+#if defined(HEIGHTFIELD_USE_AVX2)
+        const char* batchedPath = "AVX2, 8 points at a time";
+#elif defined(HEIGHTFIELD_USE_SSE2)
+        const char* batchedPath = "SSE2, 4 points at a time";
+#else
+        const char* batchedPath = "scalar";
+#endif
+        std::cout << "Heightfield " << heightfield.getSamplesX() << "x" << heightfield.getSamplesZ() << ", "
+                  << queries << " queries (best of " << runs << " runs)\n" << std::fixed << std::setprecision(3)
+                  << "  reference:  " << referenceTime << " ms  (" << referenceTime * 1e6f / queries << " ns/query)\n"
+                  << "  scalar:     " << scalarTime << " ms  (" << scalarTime * 1e6f / queries << " ns/query)\n"
+                  << "  batched:    " << batchedTime << " ms  (" << batchedTime * 1e6f / queries << " ns/query, "
+                  << batchedPath << ")\n" << std::scientific << std::setprecision(2)
+                  << "  max |scalar - reference| = " << maxReferenceError
+                  << ", max |batched - scalar| = " << maxBatchedError
+                  << ", mismatches out of the grid: " << borderMismatches << std::defaultfloat << "\n";
+
+        // the scalar path follows the reference up to rounding, and the batched one is exactly the scalar one
+        bool isCorrect = maxReferenceError <= HEIGHTFIELD_CHECK_TOLERANCE && maxBatchedError == 0.0f
+                         && borderMismatches == 0;
+        std::cout << (isCorrect ? "  all checks passed\n" : "  CHECKS FAILED\n");
+        return isCorrect;
+}
+
+
+// The delay of the camera before CameraLag: a vector of one angle per millisecond, shifted by erase at every
+// millisecond of each frame (the angle read is undefined if a frame takes no time, it is 0 here)
+glm::vec3 referenceCameraLag(std::vector<glm::vec3>& last_angles, const glm::vec3& angle, float delta_time) {
+        glm::vec3 car_angle(0.0f);
+        for (float i = 0.0; i < delta_time; i += 0.001) {
+                car_angle = last_angles.front();
+                last_angles.erase(last_angles.begin());
+                last_angles.push_back(angle);
+        }
+        return car_angle;
+}
+
+// Drives the car along the same yaw curve with some frame rates, and compares the angle seen by the camera
+// through CameraLag with the one of the reference. The reference reads whole frames, and rounds each frame up
+// to whole milliseconds (so it lags a bit less than asked): the two are expected to differ by up to the yaw
+// covered in two frames. False if they differ by more in any of the frame rates
+bool benchmarkCameraLag(float lag, float seconds) {
+        struct FrameProfile {
+                const char* name;
+                float minFrameTime;
+                float maxFrameTime;
+        };
+        const std::array<FrameProfile, 4> profiles = {{
+                {"144 fps", 1.0f / 144.0f, 1.0f / 144.0f},
+                {"60 fps", 1.0f / 60.0f, 1.0f / 60.0f},
+                {"15 fps", 1.0f / 15.0f, 1.0f / 15.0f},
+                {"jittery 10-200 fps", 1.0f / 200.0f, 1.0f / 10.0f},
+        }};
+        size_t referenceLength = static_cast<size_t>(std::lround(lag * 1000.0f));
+        bool isCorrect = true;
+
+        std::cout << "Camera lag of " << lag << " s, " << seconds << " s of driving in circles\n"
+                  << std::fixed << std::setprecision(3);
+        for (const auto& profile : profiles) {
+                std::mt19937 generator(1);
+                std::uniform_real_distribution<float> frameTimes(profile.minFrameTime, profile.maxFrameTime);
+                std::vector<glm::vec3> last_angles(referenceLength, glm::vec3(0.0f));
+                CameraLag cameraLag;
+                cameraLag.reset(0.0, glm::vec3(0.0f));
+
+                double time = 0.0;
+                float maxDifference = 0.0f;
+                float maxFrameYaw = 0.0f;
+                float previousYaw = 0.0f;
+                float referenceTime = 0.0f;
+                float ringTime = 0.0f;
+                int frames = 0;
+                while (time < seconds) {
+                        float delta_time = frameTimes(generator);
+                        time += delta_time;
+                        // turning at 40 degrees per second, wrapping at 360 like the car, with a pause every 4 s
+                        float yaw = std::fmod(static_cast<float>(40.0 * std::min(std::fmod(time, 4.0), 3.0)
+                                                                 + 120.0 * std::floor(time / 4.0)), 360.0f);
+                        glm::vec3 angle(0.0f, yaw, 0.0f);
+
+                        auto start_time = std::chrono::high_resolution_clock::now();
+                        glm::vec3 reference = referenceCameraLag(last_angles, angle, delta_time);
+                        auto middle_time = std::chrono::high_resolution_clock::now();
+                        cameraLag.push(time, angle);
+                        glm::vec3 sampled = cameraLag.sample(time - lag);
+                        auto end_time = std::chrono::high_resolution_clock::now();
+                        referenceTime += std::chrono::duration<float, std::chrono::microseconds::period>(middle_time - start_time).count();
+                        ringTime += std::chrono::duration<float, std::chrono::microseconds::period>(end_time - middle_time).count();
+
+                        float difference = std::abs(sampled.y - reference.y);
+                        difference = std::min(difference, 360.0f - difference);
+                        if (std::isnan(difference) || difference > maxDifference) {
+                                maxDifference = difference;
+                        }
+                        float frameYaw = std::abs(yaw - previousYaw);
+                        maxFrameYaw = std::max(maxFrameYaw, std::min(frameYaw, 360.0f - frameYaw));
+                        previousYaw = yaw;
+                        frames++;
+                }
+
+                bool isMatching = maxDifference <= 2.0f * maxFrameYaw + CAMERA_LAG_CHECK_TOLERANCE;
+                isCorrect = isCorrect && isMatching;
+                std::cout << "  " << std::setw(18) << profile.name << ":  max difference " << maxDifference
+                          << " deg (max yaw in a frame " << maxFrameYaw << " deg)"
+                          << (isMatching ? ", ok" : ", MISMATCH")
+                          << "  |  reference " << referenceTime / frames << " us/frame, ring "
+                          << ringTime / frames << " us/frame\n";
+        }
+        std::cout << std::defaultfloat << (isCorrect ? "  all checks passed\n" : "  CHECKS FAILED\n");
+        return isCorrect;
+}
+
+
+#endif          // SELF_CHECKS_H
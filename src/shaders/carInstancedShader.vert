@@ -0,0 +1,33 @@
+#version 450
+
+layout(set = 0, binding = 0) uniform globalUniformBufferObject {
+	mat4 view;
+	mat4 proj;
+} gubo;
+
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+
+// per instance (InstanceData): the model matrix of the car and its light flags (bit 0: spotlight on)
+layout(location = 3) in mat4 instanceModel;
+layout(location = 7) in uint instanceFlags;
+
+layout(location = 0) out vec3 fragViewDir;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragTexCoord;
+layout(location = 3) out vec3 fragPos;
+layout(location = 4) flat out int fragSpotlightOn;
+
+
+void main() {
+
+	fragPos = (instanceModel * vec4(pos, 1.0)).xyz;
+
+	gl_Position = gubo.proj * gubo.view * instanceModel * vec4(pos, 1.0);
+	fragViewDir = (gubo.view[3]).xyz - (instanceModel * vec4(pos,  1.0)).xyz;
+	fragNorm = (instanceModel * vec4(norm, 0.0)).xyz;
+	fragTexCoord = texCoord;
+	fragSpotlightOn = int(instanceFlags & 1u);
+
+}
@@ -7,15 +7,17 @@
 
 layout(set=1, binding = 1) uniform sampler2D texSampler;
 
-layout(set = 1, binding = 0) uniform carUniformBufferObject {
-	int spotlight_on;
-	mat4 model;
-} cubo;
+// Lighting mode of the pipeline variant. With LIGHTING_FROM_UNIFORMS = 1 (the default, kept as a
+// fallback) the spotlight is read at every fragment from fragSpotlightOn (cubo.spotlight_on, or the
+// flags of the instance), otherwise it is fixed by SPOTLIGHT_ON and the unused lighting path is compiled out.
+layout(constant_id = 0) const int LIGHTING_FROM_UNIFORMS = 1;
+layout(constant_id = 1) const int SPOTLIGHT_ON = 0;
 
 layout(location = 0) in vec3 fragViewDir;
 layout(location = 1) in vec3 fragNorm;
 layout(location = 2) in vec2 fragTexCoord;
 layout(location = 3) in vec3 fragPos;
+layout(location = 4) flat in int fragSpotlightOn;
 
 layout(location = 0) out vec4 outColor;
 
@@ -44,7 +46,9 @@ void main() {
 	const vec3 obj_color = texture(texSampler, fragTexCoord).rgb;
 	vec3 light_color = vec3(1.0, 0.6, 0.6);
 
-	if (cubo.spotlight_on == 1) {
+	bool spotlight_on = (LIGHTING_FROM_UNIFORMS == 1) ? (fragSpotlightOn == 1) : (SPOTLIGHT_ON == 1);
+
+	if (spotlight_on) {
 
 		vec3 light_pos = vec3(0.0, 10.0, 0.0);
 		vec3 target_pos = vec3(0.0, 0.0, 0.0);
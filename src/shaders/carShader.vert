@@ -18,6 +18,7 @@ layout(location = 0) out vec3 fragViewDir;
 layout(location = 1) out vec3 fragNorm;
 layout(location = 2) out vec2 fragTexCoord;
 layout(location = 3) out vec3 fragPos;
+layout(location = 4) flat out int fragSpotlightOn;
 
 
 void main() {
@@ -28,5 +29,6 @@ void main() {
 	fragViewDir = (gubo.view[3]).xyz - (cubo.model * vec4(pos,  1.0)).xyz;
 	fragNorm = (cubo.model * vec4(norm, 0.0)).xyz;
 	fragTexCoord = texCoord;
+	fragSpotlightOn = cubo.spotlight_on;
 
 }
@@ -0,0 +1,92 @@
+#version 450
+
+layout(set = 0, binding = 0) uniform globalUniformBufferObject {
+	mat4 view;
+	mat4 proj;
+} gubo;
+
+layout(set = 1, binding = 0) uniform terrainUniformBufferObject {
+	int headlights_on;
+	int spotlight_on;
+	mat4 model;
+	vec3 car_pos;
+	vec3 car_ang;
+} tubo;
+
+// one float per sample of the heightfield, read with texelFetch
+layout(set = 1, binding = 2) uniform sampler2D heightMap;
+
+layout(set = 1, binding = 3) uniform cdlodUniformBufferObject {
+	vec4 camera_pos;		// in the space of the terrain model
+	vec4 heightfield;		// origin (x, z) and spacing (x, z) of the samples
+	vec4 morph_ranges[12];		// start and end of the morph of each level (CDLOD_MAX_LEVELS)
+} lodubo;
+
+// quads per side of the grid patch (CDLOD_PATCH_RESOLUTION)
+const float PATCH_RESOLUTION = 16.0;
+// repetitions of the terrain texture per unit of the model, as in Terrain.obj
+const float TEXTURE_REPEAT = 1.59;
+
+// the grid patch, spanning [0, 1] x [0, 1] on the xz plane
+layout(location = 0) in vec3 pos;
+layout(location = 1) in vec3 norm;
+layout(location = 2) in vec2 texCoord;
+
+// per instance (InstanceData): the patch onto its node and the level of the node
+layout(location = 3) in mat4 instanceModel;
+layout(location = 7) in uint instanceFlags;
+
+layout(location = 0) out vec3 fragViewDir;
+layout(location = 1) out vec3 fragNorm;
+layout(location = 2) out vec2 fragTexCoord;
+layout(location = 3) out vec3 fragPos;
+
+
+// Bilinear interpolation of the four samples around the point
+float height_at(vec2 xz) {
+	ivec2 samples = textureSize(heightMap, 0);
+	vec2 texel = clamp((xz - lodubo.heightfield.xy) / lodubo.heightfield.zw, vec2(0.0), vec2(samples - 1));
+	ivec2 base = min(ivec2(texel), samples - 2);
+	vec2 weight = texel - vec2(base);
+
+	float h00 = texelFetch(heightMap, base, 0).r;
+	float h10 = texelFetch(heightMap, base + ivec2(1, 0), 0).r;
+	float h01 = texelFetch(heightMap, base + ivec2(0, 1), 0).r;
+	float h11 = texelFetch(heightMap, base + ivec2(1, 1), 0).r;
+
+	return mix(mix(h00, h10, weight.x), mix(h01, h11, weight.x), weight.y);
+}
+
+
+void main() {
+
+	vec2 spacing = lodubo.heightfield.zw;
+	vec2 extent = lodubo.heightfield.xy + vec2(textureSize(heightMap, 0) - 1) * spacing;
+	vec2 patch_size = vec2(instanceModel[0][0], instanceModel[2][2]);
+	vec2 xz = (instanceModel * vec4(pos, 1.0)).xz;
+
+	// in the last part of the range of its level, each odd vertex of the grid slides onto its even
+	// neighbour, so that at the end of the range the patch matches the grid of the next level
+	vec2 range = lodubo.morph_ranges[instanceFlags].xy;
+	float camera_distance = distance(lodubo.camera_pos.xyz, vec3(xz.x, height_at(xz), xz.y));
+	float morph = clamp((camera_distance - range.x) / (range.y - range.x), 0.0, 1.0);
+	vec2 odd = fract(pos.xz * PATCH_RESOLUTION * 0.5) * 2.0 / PATCH_RESOLUTION;
+	xz -= odd * patch_size * morph;
+
+	// the patches on the far edges can go past the heightfield: their vertices collapse on its border
+	xz = min(xz, extent);
+
+	vec3 local_pos = vec3(xz.x, height_at(xz), xz.y);
+	vec3 local_norm = normalize(vec3(
+			(height_at(xz - vec2(spacing.x, 0.0)) - height_at(xz + vec2(spacing.x, 0.0))) / (2.0 * spacing.x),
+			1.0,
+			(height_at(xz - vec2(0.0, spacing.y)) - height_at(xz + vec2(0.0, spacing.y))) / (2.0 * spacing.y)));
+
+	fragPos = (tubo.model * vec4(local_pos, 1.0)).xyz;
+
+	gl_Position = gubo.proj * gubo.view * tubo.model * vec4(local_pos, 1.0);
+	fragViewDir = (gubo.view[3]).xyz - fragPos;
+	fragNorm = (tubo.model * vec4(local_norm, 0.0)).xyz;
+	fragTexCoord = TEXTURE_REPEAT * vec2(xz.x, -xz.y);
+
+}
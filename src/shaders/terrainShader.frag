@@ -10,6 +10,13 @@ layout(set = 1, binding = 0) uniform terrainUniformBufferObject {
 	vec3 car_ang;
 } tubo;
 
+// Lighting mode of the pipeline variant. With LIGHTING_FROM_UNIFORMS = 1 (the default, kept as a
+// fallback) the lights are read from tubo at every fragment, otherwise they are fixed by SPOTLIGHT_ON
+// and HEADLIGHTS_ON and the unused lighting paths are compiled out.
+layout(constant_id = 0) const int LIGHTING_FROM_UNIFORMS = 1;
+layout(constant_id = 1) const int SPOTLIGHT_ON = 0;
+layout(constant_id = 2) const int HEADLIGHTS_ON = 0;
+
 layout(location = 0) in vec3 fragViewDir;
 layout(location = 1) in vec3 fragNorm;
 layout(location = 2) in vec2 fragTexCoord;
@@ -43,7 +50,10 @@ void main() {
 	const vec3 obj_color = texture(texSampler, fragTexCoord).rgb;
 	vec3 light_color = vec3(1.0, 0.7, 0.7);
 
-	if (tubo.spotlight_on == 1) {
+	bool spotlight_on = (LIGHTING_FROM_UNIFORMS == 1) ? (tubo.spotlight_on == 1) : (SPOTLIGHT_ON == 1);
+	bool headlights_on = (LIGHTING_FROM_UNIFORMS == 1) ? (tubo.headlights_on == 1) : (HEADLIGHTS_ON == 1);
+
+	if (spotlight_on) {
 
 		vec3 light_pos = vec3(0.0, 10.0, 0.0);
 		vec3 target_pos = vec3(0.0, 0.0, 0.0);
@@ -85,7 +95,7 @@ void main() {
 
 	}
 
-	if (tubo.headlights_on == 1) {
+	if (headlights_on) {
 
 		vec3 point_pos = fragPos;
 
@@ -6,13 +6,22 @@
 #define ANG_SPEED 40.0
 #define TOP_LIN_SPEED 20.0
 
+// Delay in seconds of the yaw of the chasing cameras (Normal and Distant) behind the car
+#define CAMERA_LAG 0.3
+
+// Distance between the parked cars of the traffic, shrunk if they do not fit in the terrain
+#define CAR_SPACING 8.0f
+
+// --benchmark-cars: frames ignored and frames measured for each number of cars
+#define CAR_BENCHMARK_WARMUP_FRAMES 30
+#define CAR_BENCHMARK_FRAMES 300
+
 
 struct Car {
         glm::vec3 pos;
         glm::vec3 angle = glm::vec3(0.0);
         float lin_speed;
         float ang_speed;
-        std::vector<glm::vec3> last_angles{300, glm::vec3(0.0f)};
 
         glm::vec3 wheel_fl_pos;
         glm::vec3 wheel_fr_pos;
@@ -20,6 +29,13 @@ struct Car {
         glm::vec3 wheel_rr_pos;
 };
 
+// State of the car published by the simulation at every step
+struct CarSnapshot {
+        glm::vec3 pos;
+        glm::vec3 angle;
+        float lin_speed;
+};
+
 
 float terrain_scale_factor = 10.0;
 
@@ -36,8 +52,49 @@ int backlights_on = 0;
 
 enum CameraType { Normal, Distant, FirstPerson, MiniMap };
 CameraType camera_type = Normal;
-
+glm::vec3 camera_pos = glm::vec3(0.0f);
+glm::mat4 camera_view_proj = glm::mat4(1.0f);
+
+// Angles of the car in the last CAMERA_LAG seconds (at least), with the time the camera runs on
+CameraLag camera_lag;
+double camera_time = 0.0;
+
+// Tiles of the terrain that passed the frustum culling in the last frame
+std::vector<uint32_t> visible_terrain_tiles;
+
+// Patches of the CDLOD terrain selected in the last frame, stored one part after the other in IB_TerrainPatches
+CdlodSelection terrain_patches;
+std::array<uint32_t, CDLOD_PATCH_PARTS> terrain_patch_offsets = {};
+std::array<uint32_t, CDLOD_PATCH_PARTS> terrain_patch_counts = {};
+size_t terrain_patch_total = 0;
+// Nodes of the quadtree culled in the last frame, and patches that did not fit in IB_TerrainPatches
+uint32_t terrain_patch_culled = 0;
+size_t terrain_patch_dropped = 0;
+
+// car is the state drawn in the current frame, sim_car the one advanced by the steps of the simulation
 Car car = Car();
+Car sim_car = Car();
+std::atomic<uint32_t> car_keys{0};
+FixedStepSimulation<CarSnapshot> simulation;
+
+// Instances of the traffic: [0] is the car driven by the user, the others are parked
+std::vector<InstanceData> car_instances;
+uint32_t car_count = 0;
+
+const std::vector<uint32_t> car_benchmark_counts = {1, 10, 100, 1000, 10000};
+size_t car_benchmark_step = 0;
+int car_benchmark_frame = 0;
+float car_benchmark_cpu_sum = 0.0f;
+float car_benchmark_gpu_sum = 0.0f;
+float car_benchmark_frame_time_sum = 0.0f;
+bool is_car_benchmark_done = false;
+
+// Input recorded (--record) or replayed (--replay), on the clock of the frames since the start
+InputRecording input_recording;
+float input_time = 0.0f;
+// --replay: wall time, CPU time and GPU time (-1 if not available) of each frame, in ms
+std::vector<std::array<float, 3>> replay_frame_times;
+bool is_replay_done = false;
 
 
 // Compute elapsed time between two function calls
@@ -54,68 +111,19 @@ float compute_elapsed_time() {
 
 // Compute the height of a point in the terrain, given its coordinates in the xz-plane
 float compute_point_height(float x, float z) {
+        return terrain.heightfield.height(x / terrain_scale_factor, z / terrain_scale_factor) * terrain_scale_factor;
+}
 
-        float x_point = (x / terrain_scale_factor) + 50.0;
-        float z_point = (z / terrain_scale_factor) + 50.0;
-
-        // 109 = number of vertices  |  100 = size of the terrain before scaling
-        float x_point_float_index = x_point * 109.0 / 100.0;
-        float z_point_float_index = z_point * 109.0 / 100.0;
-
-        /*
-         *      D -- C        (z) <---|
-         *      | \  |                |
-         *      A -- B                v
-         *                           (x)
-         *
-         */
-        int x_a_index = std::ceil(x_point_float_index);
-        int z_a_index = std::ceil(z_point_float_index);
-        int x_b_index = std::ceil(x_point_float_index);
-        int z_b_index = std::floor(z_point_float_index);
-        int x_c_index = std::floor(x_point_float_index);
-        int z_c_index = std::floor(z_point_float_index);
-        int x_d_index = std::floor(x_point_float_index);
-        int z_d_index = std::ceil(z_point_float_index);
-
-        float x_a = x_a_index * 100.0 / 109.0;
-        float x_b = x_b_index * 100.0 / 109.0;
-        float x_c = x_c_index * 100.0 / 109.0;
-        float x_d = x_d_index * 100.0 / 109.0;
-
-        float y_a = terrain.altitudes[x_a_index][z_a_index];
-        float y_b = terrain.altitudes[x_b_index][z_b_index];
-        float y_c = terrain.altitudes[x_c_index][z_c_index];
-        float y_d = terrain.altitudes[x_d_index][z_d_index];
-
-        float z_a = z_a_index * 100.0 / 109.0;
-        float z_b = z_b_index * 100.0 / 109.0;
-        float z_c = z_c_index * 100.0 / 109.0;
-        float z_d = z_d_index * 100.0 / 109.0;
-
-        // used to determine in which of the two triangles the point is in
-        float x_point_percentage_index = x_point_float_index - x_c_index;
-        float z_point_percentage_index = z_point_float_index - z_c_index;
-
-        float interpolated_height = 0.0;
-
-        // check which of the two triangles the point belongs to and act as a consequence
-        if (x_point_percentage_index < - z_point_percentage_index + 1) {
-                float det = (z_b - z_d) * (x_c - x_d) + (x_d - x_b) * (z_c - z_d);
-                float lambda_1 = ((z_b - z_d) * (x_point - x_d) + (x_d - x_b) * (z_point - z_d)) / det;
-                float lambda_2 = ((z_d - z_c) * (x_point - x_d) + (x_c - x_d) * (z_point - z_d)) / det;
-                float lambda_3 = 1.0f - lambda_1 - lambda_2;
-                interpolated_height = lambda_1 * y_c + lambda_2 * y_b + lambda_3 * y_d;
-        } else {
-                float det = (z_b - z_d) * (x_a - x_d) + (x_d - x_b) * (z_a - z_d);
-                float lambda_1 = ((z_b - z_d) * (x_point - x_d) + (x_d - x_b) * (z_point - z_d)) / det;
-                float lambda_2 = ((z_d - z_a) * (x_point - x_d) + (x_a - x_d) * (z_point - z_d)) / det;
-                float lambda_3 = 1.0f - lambda_1 - lambda_2;
-                interpolated_height = lambda_1 * y_a + lambda_2 * y_b + lambda_3 * y_d;
+// Compute the heights of count points at once (x and z are overwritten with their coordinates in the terrain model)
+void compute_point_heights(float* x, float* z, float* y, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+                x[i] /= terrain_scale_factor;
+                z[i] /= terrain_scale_factor;
+        }
+        terrain.heightfield.heights(x, z, y, count);
+        for (size_t i = 0; i < count; i++) {
+                y[i] *= terrain_scale_factor;
         }
-
-        return interpolated_height * terrain_scale_factor;
-
 }
 
 
@@ -138,72 +146,117 @@ glm::vec3 rotate_pos(glm::vec3 pos, glm::vec3 ang, glm::vec3 offset) {
 }
 
 
-void handle_key_presses() {
+// The keys (InputKey bits) held down in this frame
+uint32_t poll_input_keys() {
+
+        const std::array<std::pair<int, InputKey>, 12> bindings = {{
+                {GLFW_KEY_W, INPUT_KEY_W}, {GLFW_KEY_A, INPUT_KEY_A}, {GLFW_KEY_S, INPUT_KEY_S}, {GLFW_KEY_D, INPUT_KEY_D},
+                {GLFW_KEY_R, INPUT_KEY_R}, {GLFW_KEY_V, INPUT_KEY_V}, {GLFW_KEY_B, INPUT_KEY_B}, {GLFW_KEY_N, INPUT_KEY_N},
+                {GLFW_KEY_M, INPUT_KEY_M}, {GLFW_KEY_1, INPUT_KEY_1}, {GLFW_KEY_2, INPUT_KEY_2},
+                {GLFW_KEY_SPACE, INPUT_KEY_SPACE}
+        }};
+
+        uint32_t input = 0;
+        for (const auto& binding : bindings) {
+                if (glfwGetKey(window, binding.first)) {
+                        input |= binding.second;
+                }
+        }
+        return input;
+
+}
+
+
+// Act on the keys held down in this frame (InputKey bits), from the keyboard or from a replay
+void handle_key_presses(uint32_t input) {
 
         // switch to the selected camera
-        if (glfwGetKey(window, GLFW_KEY_V)) {
+        if (input & INPUT_KEY_V) {
                 camera_type = Normal;
-        } else if (glfwGetKey(window, GLFW_KEY_B)) {
+        } else if (input & INPUT_KEY_B) {
                 camera_type = Distant;
-        } else if (glfwGetKey(window, GLFW_KEY_N)) {
+        } else if (input & INPUT_KEY_N) {
                 camera_type = FirstPerson;
-        } else if (glfwGetKey(window, GLFW_KEY_M)) {
+        } else if (input & INPUT_KEY_M) {
                 camera_type = MiniMap;
         }
         
-        if (glfwGetKey(window, GLFW_KEY_1)) {
+        if (input & INPUT_KEY_1) {
                 spotlight_on = 0;
-        } else if (glfwGetKey(window, GLFW_KEY_2)) {
+        } else if (input & INPUT_KEY_2) {
                 spotlight_on = 1;
         }
 
         // turn on/off the headlights
-        if (glfwGetKey(window, GLFW_KEY_SPACE) && (debounce_time >= 0.4)) {
+        if ((input & INPUT_KEY_SPACE) && (debounce_time >= 0.4)) {
                 headlights_on = (headlights_on == 0) ? 1 : 0;
                 debounce_time = 0.0;
         } else {
                 debounce_time += delta_time;
         }
 
+        // the keys that drive the car are read by the simulation at its next step
+        uint32_t keys = 0;
+        if (input & INPUT_KEY_W) {
+                keys |= CAR_KEY_FORWARD;
+        }
+        if (input & INPUT_KEY_S) {
+                keys |= CAR_KEY_BACKWARD;
+        }
+        if (input & INPUT_KEY_A) {
+                keys |= CAR_KEY_LEFT;
+        }
+        if (input & INPUT_KEY_D) {
+                keys |= CAR_KEY_RIGHT;
+        }
+        if (input & INPUT_KEY_R) {
+                keys |= CAR_KEY_RESET;
+                camera_lag.reset(camera_time, glm::vec3(0.0f));
+        }
+        car_keys = keys;
+
+}
+
+
+// Advance the car by dt seconds, driven by the given keys (CarKey bits)
+void step_car(Car& car, uint32_t keys, float dt) {
+
         // change velocity with a constant acceleration/deceleration profile
-        if (glfwGetKey(window, GLFW_KEY_W)) {
-                car.lin_speed = std::min(car.lin_speed + LIN_ACCEL * delta_time, TOP_LIN_SPEED - (-car.angle.z * PITCH_SLOWDOWN));
-        } else if (glfwGetKey(window, GLFW_KEY_S)) {
-                car.lin_speed = std::max(car.lin_speed - LIN_ACCEL * delta_time, -(TOP_LIN_SPEED + (-car.angle.z * PITCH_SLOWDOWN)));
+        if (keys & CAR_KEY_FORWARD) {
+                car.lin_speed = std::min(car.lin_speed + LIN_ACCEL * dt, TOP_LIN_SPEED - (-car.angle.z * PITCH_SLOWDOWN));
+        } else if (keys & CAR_KEY_BACKWARD) {
+                car.lin_speed = std::max(car.lin_speed - LIN_ACCEL * dt, -(TOP_LIN_SPEED + (-car.angle.z * PITCH_SLOWDOWN)));
         } else {
                 // decelerate until 0
                 if (car.lin_speed > 0.1) {
-                        car.lin_speed -= LIN_DECEL * delta_time;
+                        car.lin_speed -= LIN_DECEL * dt;
                 } else if (car.lin_speed < -0.1) {
-                        car.lin_speed += LIN_DECEL * delta_time;
+                        car.lin_speed += LIN_DECEL * dt;
                 } else {
                         car.lin_speed = 0.0;
                 }
         }
 
-        backlights_on = ((car.lin_speed < 0) && (headlights_on == 1)) ? 1 : 0;
-
         // steer only when the car is moving, and invert steering when going backward
-        if (glfwGetKey(window, GLFW_KEY_A)) {
+        if (keys & CAR_KEY_LEFT) {
                 if (car.lin_speed > 0.0) {
-                        car.angle.y += ANG_SPEED * delta_time;
+                        car.angle.y += ANG_SPEED * dt;
                 } else if (car.lin_speed < 0.0) {
-                        car.angle.y -= ANG_SPEED * delta_time;
+                        car.angle.y -= ANG_SPEED * dt;
                 }
-        } else if (glfwGetKey(window, GLFW_KEY_D)) {
+        } else if (keys & CAR_KEY_RIGHT) {
                 if (car.lin_speed > 0.0) {
-                        car.angle.y -= ANG_SPEED * delta_time;
+                        car.angle.y -= ANG_SPEED * dt;
                 } else if (car.lin_speed < 0.0) {
-                        car.angle.y += ANG_SPEED * delta_time;
+                        car.angle.y += ANG_SPEED * dt;
                 }
         }
 
         // reset to the initial position
-        if (glfwGetKey(window, GLFW_KEY_R)) {
+        if (keys & CAR_KEY_RESET) {
                 car.pos = glm::vec3(0.0f);
                 car.angle = glm::vec3(0.0f);
                 car.lin_speed = 0.0;
-                car.last_angles = std::vector<glm::vec3>(300, glm::vec3(0.0f));
         }
 
         // keep car angle in the range [-360,360]
@@ -222,7 +275,7 @@ void handle_key_presses() {
         } else if (car.pos.x <= terrain.height * terrain_scale_factor / -2.03) {
                 car.pos.x += 0.1;
         } else {
-                car.pos.x -= cos(glm::radians(car.angle.y)) * (car.lin_speed * delta_time);
+                car.pos.x -= cos(glm::radians(car.angle.y)) * (car.lin_speed * dt);
         }
 
         if (car.pos.z >= terrain.width * terrain_scale_factor / 2.03) {
@@ -230,13 +283,9 @@ void handle_key_presses() {
         } else if (car.pos.z <= terrain.width * terrain_scale_factor / -2.03) {
                 car.pos.z += 0.1;
         } else {
-                car.pos.z += sin(glm::radians(car.angle.y)) * (car.lin_speed * delta_time);
+                car.pos.z += sin(glm::radians(car.angle.y)) * (car.lin_speed * dt);
         }
 
-        // update car height
-        car.pos.y = compute_point_height(car.pos.x, car.pos.z);
-
-
         // compute new position of the wheels
         car.wheel_fl_pos.x = car.pos.x + (-1.0814 * cos(glm::radians(-car.angle.y))) -
                              (1.0 * sin(glm::radians(-car.angle.y)));
@@ -255,11 +304,16 @@ void handle_key_presses() {
         car.wheel_rr_pos.z = car.pos.z + (-1.0 * cos(glm::radians(-car.angle.y))) +
                              (2.4023 * sin(glm::radians(-car.angle.y)));
 
-        // compute the height of the wheels
-        car.wheel_fl_pos.y = compute_point_height(car.wheel_fl_pos.x, car.wheel_fl_pos.z);
-        car.wheel_fr_pos.y = compute_point_height(car.wheel_fr_pos.x, car.wheel_fr_pos.z);
-        car.wheel_rl_pos.y = compute_point_height(car.wheel_rl_pos.x, car.wheel_rl_pos.z);
-        car.wheel_rr_pos.y = compute_point_height(car.wheel_rr_pos.x, car.wheel_rr_pos.z);
+        // compute the height of the car and of the wheels, all at once
+        float points_x[5] = {car.pos.x, car.wheel_fl_pos.x, car.wheel_fr_pos.x, car.wheel_rl_pos.x, car.wheel_rr_pos.x};
+        float points_z[5] = {car.pos.z, car.wheel_fl_pos.z, car.wheel_fr_pos.z, car.wheel_rl_pos.z, car.wheel_rr_pos.z};
+        float points_y[5];
+        compute_point_heights(points_x, points_z, points_y, 5);
+        car.pos.y = points_y[0];
+        car.wheel_fl_pos.y = points_y[1];
+        car.wheel_fr_pos.y = points_y[2];
+        car.wheel_rl_pos.y = points_y[3];
+        car.wheel_rr_pos.y = points_y[4];
 
         // to compute car roll, make an average between front and rear wheels
         float delta_y_front_rear = ((car.wheel_fl_pos.y - car.wheel_fr_pos.y) +
@@ -277,20 +331,110 @@ void handle_key_presses() {
 
         car.angle.z = -glm::degrees(atan(delta_y_left_right / delta_x_left_right));
 
+}
+
+
+// The pose of the car to render: interpolated between the two latest steps of the simulation (on its thread,
+// or run here in a fixed-step replay), or advanced here by the frame time with --physics-rate 0
+void update_car_state() {
+
+        if (isReplay() && replayStep > 0.0f && simulation.isRunning()) {
+                simulation.advance(delta_time);
+        }
+
+        if (simulation.isRunning()) {
+                CarSnapshot previous, current;
+                float alpha = simulation.latest(previous, current);
+
+                car.pos = glm::mix(previous.pos, current.pos, alpha);
+                car.angle = mixAngles(previous.angle, current.angle, alpha);
+                car.lin_speed = glm::mix(previous.lin_speed, current.lin_speed, alpha);
+        } else {
+                step_car(car, car_keys, delta_time);
+        }
+
+        backlights_on = ((car.lin_speed < 0) && (headlights_on == 1)) ? 1 : 0;
 
+        // the chasing cameras start behind the car when they are switched on
+        camera_time += delta_time;
         if ((camera_type == FirstPerson) || (camera_type == MiniMap)) {
-                car.last_angles = std::vector<glm::vec3>(300, car.angle);
+                camera_lag.reset(camera_time, car.angle);
+        } else {
+                camera_lag.push(camera_time, car.angle);
+        }
+
+}
+
+
+// Run the car on its own thread at physicsRate steps per second (see FixedStepSimulation)
+void start_simulation() {
+
+        if (physicsRate <= 0.0f) {
+                return;
+        }
+
+        sim_car = car;
+        auto step = [this](float dt) {
+                step_car(sim_car, car_keys, dt);
+                return CarSnapshot{sim_car.pos, sim_car.angle, sim_car.lin_speed};
+        };
+
+        // a fixed-step replay runs the same steps on the render thread, replayStep seconds of them per frame,
+        // so that it does not depend on the wall clock and is the same at every replay
+        if (isReplay() && replayStep > 0.0f) {
+                simulation.startStepped(physicsRate, CarSnapshot{car.pos, car.angle, car.lin_speed}, step);
+                std::cout << "Car simulated at " << physicsRate << " Hz, " << replayStep << " s per frame\n";
+                return;
+        }
+
+        simulation.start(physicsRate, CarSnapshot{car.pos, car.angle, car.lin_speed}, step);
+        std::cout << "Car simulated at " << physicsRate << " Hz on its own thread\n";
+
+}
+
+
+// Drive car through the commands, stepping it every dt seconds like the simulation thread, and return the hash
+// of its trajectory (also written to trajectory, one step per line, unless it is null)
+uint64_t run_drive(Car& car, const std::vector<DriveCommand>& commands, float dt, std::ostream* trajectory) {
+
+        TrajectoryHash hash;
+        uint32_t keys = 0;
+        size_t next_command = 0;
+
+        if (trajectory) {
+                *trajectory << "time,x,y,z,roll,yaw,pitch,speed\n" << std::setprecision(9);
+        }
+        for (uint64_t step = 0; step < commands.back().step; step++) {
+                while (next_command < commands.size() && commands[next_command].step <= step) {
+                        keys = commands[next_command].keys;
+                        next_command++;
+                }
+
+                step_car(car, keys, dt);
+
+                hash.add(car.pos);
+                hash.add(car.angle);
+                hash.add(car.lin_speed);
+                if (trajectory) {
+                        *trajectory << (step + 1) * static_cast<double>(dt) << "," << car.pos.x << "," << car.pos.y << "," << car.pos.z
+                                    << "," << car.angle.x << "," << car.angle.y << "," << car.angle.z << "," << car.lin_speed << "\n";
+                }
         }
+        return hash.value();
+
+}
 
+
+glm::mat4 compute_terrain_model() {
+        return glm::scale(glm::mat4(1.0), glm::vec3(terrain_scale_factor));
 }
 
 
 void update_tubo_for_terrain(uint32_t currentImage) {
 
         terrainUniformBufferObject tubo{};
-        void* data;
 
-        tubo.model = glm::scale(glm::mat4(1.0), glm::vec3(terrain_scale_factor));
+        tubo.model = compute_terrain_model();
 
         tubo.spotlight_on = spotlight_on;
         tubo.headlights_on = headlights_on;
@@ -298,46 +442,90 @@ void update_tubo_for_terrain(uint32_t currentImage) {
         tubo.car_pos = car.pos;
         tubo.car_ang = glm::radians(car.angle);
 
-        vkMapMemory(device, DS_SlTerrain.uniformBuffersMemory[0][currentImage], 0, sizeof(tubo), 0, &data);
-        memcpy(data, &tubo, sizeof(tubo));
-        vkUnmapMemory(device, DS_SlTerrain.uniformBuffersMemory[0][currentImage]);
+        *DS_SlTerrain.uniform<terrainUniformBufferObject>(currentImage) = tubo;
+        if (isCdlodTerrain) {
+                *DS_TerrainCdlod.uniform<terrainUniformBufferObject>(currentImage) = tubo;
+        }
 
 }
 
 
-void update_cubo_for_car(uint32_t currentImage) {
+// Select the nodes of the quadtree for the current camera (in the space of the terrain model, where the
+// heightfield is) and write their patches into the instance buffer
+void update_terrain_patches(uint32_t currentImage) {
 
-        carUniformBufferObject cubo{};
-        void* data;
+        glm::mat4 terrain_model = compute_terrain_model();
+        glm::vec3 local_camera_pos = glm::vec3(glm::inverse(terrain_model) * glm::vec4(camera_pos, 1.0));
+
+        terrain_patch_culled = terrainQuadtree.select(Frustum::fromMatrix(camera_view_proj * terrain_model),
+                                                      local_camera_pos, terrain_patches);
+
+        uint32_t offset = 0;
+        size_t selected = 0;
+        for (uint32_t part = 0; part < CDLOD_PATCH_PARTS; part++) {
+                uint32_t count = std::min<uint32_t>(terrain_patches[part].size(), MAX_TERRAIN_PATCHES - offset);
+                memcpy(IB_TerrainPatches.mapped[currentImage] + offset, terrain_patches[part].data(),
+                       count * sizeof(InstanceData));
+                terrain_patch_offsets[part] = offset;
+                terrain_patch_counts[part] = count;
+                offset += count;
+                selected += terrain_patches[part].size();
+        }
+        terrain_patch_total = offset;
+
+        // the patches past the capacity of the instance buffer are not drawn, leaving holes in the terrain
+        if (selected > offset && terrain_patch_dropped == 0) {
+                std::cout << "Warning: " << selected << " terrain patches selected, only the first " << MAX_TERRAIN_PATCHES
+                          << " are drawn (MAX_TERRAIN_PATCHES)\n";
+        }
+        terrain_patch_dropped = selected - offset;
+
+        cdlodUniformBufferObject lodubo{};
+
+        lodubo.camera_pos = glm::vec4(local_camera_pos, 1.0);
+        lodubo.heightfield = glm::vec4(terrain.heightfield.getOrigin(), terrain.heightfield.getSpacing());
+        for (uint32_t level = 0; level < terrainQuadtree.getLevelCount(); level++) {
+                lodubo.morph_ranges[level] = glm::vec4(terrainQuadtree.morphRange(level), 0.0, 0.0);
+        }
+
+        *DS_TerrainCdlod.uniform<cdlodUniformBufferObject>(currentImage, 3) = lodubo;
+
+}
+
+
+glm::mat4 compute_car_model() {
 
         glm::vec3 car_angle = (camera_type == FirstPerson)
                         ? glm::vec3(0.0, car.angle.y, 0.0)
                         : car.angle;
 
-        cubo.model = glm::translate(glm::mat4(1.0), car.pos)
-                     * glm::rotate(glm::mat4(1.0), glm::radians(car_angle.y), glm::vec3(0, 1, 0))
-                     * glm::rotate(glm::mat4(1.0), glm::radians(car_angle.x), glm::vec3(1, 0, 0))
-                     * glm::rotate(glm::mat4(1.0), glm::radians(car_angle.z), glm::vec3(0, 0, 1));
+        return glm::translate(glm::mat4(1.0), car.pos)
+               * glm::rotate(glm::mat4(1.0), glm::radians(car_angle.y), glm::vec3(0, 1, 0))
+               * glm::rotate(glm::mat4(1.0), glm::radians(car_angle.x), glm::vec3(1, 0, 0))
+               * glm::rotate(glm::mat4(1.0), glm::radians(car_angle.z), glm::vec3(0, 0, 1));
+
+}
+
+void update_cubo_for_car(uint32_t currentImage) {
+
+        carUniformBufferObject cubo{};
+
+        cubo.model = compute_car_model();
 
         cubo.spotlight_on = spotlight_on;
 
-        vkMapMemory(device, DS_SlCar.uniformBuffersMemory[0][currentImage], 0, sizeof(cubo), 0, &data);
-        memcpy(data, &cubo, sizeof(cubo));
-        vkUnmapMemory(device, DS_SlCar.uniformBuffersMemory[0][currentImage]);
+        *DS_SlCar.uniform<carUniformBufferObject>(currentImage) = cubo;
 
 }
 
 void update_subo_for_skybox(uint32_t currentImage) {
 
         skyboxUniformBufferObject subo{};
-        void* data;
 
         // model is scaled to make it appear as at infinite distance
         subo.model = glm::scale(glm::mat4(1.0), glm::vec3(100000.0f));
 
-        vkMapMemory(device, DS_SlSkyBox.uniformBuffersMemory[0][currentImage], 0, sizeof(subo), 0, &data);
-        memcpy(data, &subo, sizeof(subo));
-        vkUnmapMemory(device, DS_SlSkyBox.uniformBuffersMemory[0][currentImage]);
+        *DS_SlSkyBox.uniform<skyboxUniformBufferObject>(currentImage) = subo;
 
 }
 
@@ -345,7 +533,6 @@ void update_subo_for_skybox(uint32_t currentImage) {
 void update_gubo_for_camera(uint32_t currentImage) {
 
         globalUniformBufferObject gubo{};
-        void* data;
 
         glm::vec3 camera_offset;
         float field_of_view;
@@ -401,15 +588,8 @@ void update_gubo_for_camera(uint32_t currentImage) {
                                                         glm::vec3(0.0f, 1.0f, 0.0f));
 
         } else {
-                glm::vec3 car_angle;
-
-                // handle the "delay" of the camera in a way so that it is independent from
-                // the performance of the pc (discard values to display if delta_time is high)
-                for (float i = 0.0; i < delta_time; i += 0.001) {
-                        car_angle = car.last_angles.front();
-                        car.last_angles.erase(car.last_angles.begin());
-                        car.last_angles.push_back(car.angle);
-                }
+                // the camera follows the yaw the car had CAMERA_LAG seconds ago, whatever the frame rate
+                glm::vec3 car_angle = camera_lag.sample(camera_time - CAMERA_LAG);
 
                 glm::vec3 cam_pos = rotate_pos(car.pos, glm::radians(glm::vec3(
                                                                                 car_angle.y,
@@ -432,15 +612,16 @@ void update_gubo_for_camera(uint32_t currentImage) {
         }
         
 
-        vkMapMemory(device, DS_global.uniformBuffersMemory[0][currentImage], 0, sizeof(gubo), 0, &data);
-        memcpy(data, &gubo, sizeof(gubo));
-        vkUnmapMemory(device, DS_global.uniformBuffersMemory[0][currentImage]);
+        camera_pos = glm::vec3(glm::inverse(gubo.view)[3]);
+        camera_view_proj = gubo.proj * gubo.view;
+
+        *DS_global.uniform<globalUniformBufferObject>(currentImage) = gubo;
 
 }
 
 
-void compute_fps() {
-        fps_sum += 1 / delta_time;
+void compute_fps(float frame_time) {
+        fps_sum += 1 / frame_time;
         fps_count++;
 }
 
@@ -454,8 +635,19 @@ void log_info(float logging_period) {
                                 << "    |    yaw=" << std::setw(8) << car.angle.y
                                 << "    |    pitch=" << std::setw(8) << car.angle.z
                                 << "    |    roll=" << std::setw(8) << car.angle.x
-                                << "    |    speed=" << std::setw(7) << car.lin_speed
-                                << "         [" << std::setw(4) << (fps_sum / fps_count) << " FPS]" << std::endl;
+                                << "    |    speed=" << std::setw(7) << car.lin_speed;
+                if (isCdlodTerrain) {
+                        std::cout << "    |    patches=" << std::setw(4) << terrain_patch_total
+                                  << " (culled " << std::setw(4) << terrain_patch_culled;
+                        if (terrain_patch_dropped > 0) {
+                                std::cout << ", dropped " << terrain_patch_dropped;
+                        }
+                        std::cout << ")";
+                } else {
+                        std::cout << "    |    tiles=" << std::setw(3) << visible_terrain_tiles.size()
+                                  << "/" << M_SlTerrain.tiles.size();
+                }
+                std::cout << "         [" << std::setw(4) << (fps_sum / fps_count) << " FPS]" << std::endl;
                 fps_sum = 0;
                 fps_count = 0;
                 logging_time = 0.0;
@@ -466,19 +658,200 @@ void log_info(float logging_period) {
 }
 
 
+// Lay out the parked cars on a grid centred in the terrain, each one facing a different direction
+void place_traffic_cars(uint32_t count) {
+
+        car_instances.resize(count);
+        car_count = count;
+
+        int cars_per_row = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(count))));
+        float spacing_x = std::min(CAR_SPACING, 2.0f * (terrain.height * terrain_scale_factor / 2.03f) / cars_per_row);
+        float spacing_z = std::min(CAR_SPACING, 2.0f * (terrain.width * terrain_scale_factor / 2.03f) / cars_per_row);
+
+        // the heights of all the cars are computed at once
+        std::vector<float> xs(count), zs(count), ys(count);
+        for (uint32_t i = 1; i < count; i++) {
+                xs[i] = ((i % cars_per_row) - (cars_per_row - 1) / 2.0f) * spacing_x;
+                zs[i] = ((i / cars_per_row) - (cars_per_row - 1) / 2.0f) * spacing_z;
+        }
+        std::vector<float> terrain_xs(xs), terrain_zs(zs);
+        compute_point_heights(terrain_xs.data(), terrain_zs.data(), ys.data(), count);
+
+        for (uint32_t i = 1; i < count; i++) {
+                float yaw = static_cast<float>((i * 137) % 360);
+
+                car_instances[i].model = glm::translate(glm::mat4(1.0), glm::vec3(xs[i], ys[i], zs[i]))
+                                         * glm::rotate(glm::mat4(1.0), glm::radians(yaw), glm::vec3(0, 1, 0));
+        }
+
+}
+
+
+void update_car_instances(uint32_t currentImage) {
+
+        uint32_t count = isBenchmarkCars ? car_benchmark_counts[car_benchmark_step] : trafficCars;
+        if (count != car_count) {
+                place_traffic_cars(count);
+        }
+
+        car_instances[0].model = compute_car_model();
+        for (auto& instance : car_instances) {
+                instance.flags = spotlight_on;
+        }
+
+        memcpy(IB_Cars.mapped[currentImage], car_instances.data(), car_count * sizeof(InstanceData));
+
+}
+
+
+// Collect the timings of the frames of the replay, then print them and close the window at its end
+void update_replay(float frame_time) {
+
+        if (is_replay_done) {
+                return;
+        }
+
+        // the CPU and GPU times measured are the ones of the previous frame
+        replay_frame_times.push_back({frame_time * 1000.0f, lastCpuFrameTime, lastGpuFrameTime});
+        if (input_time < input_recording.getDuration()) {
+                return;
+        }
+
+        is_replay_done = true;
+        glfwSetWindowShouldClose(window, GLFW_TRUE);
+
+        if (!frameTimesFile.empty()) {
+                std::ofstream out(frameTimesFile);
+                out << "frame,frame_ms,cpu_ms,gpu_ms\n" << std::fixed << std::setprecision(4);
+                for (size_t frame = 0; frame < replay_frame_times.size(); frame++) {
+                        out << frame << "," << replay_frame_times[frame][0] << "," << replay_frame_times[frame][1] << ",";
+                        if (replay_frame_times[frame][2] >= 0.0f) {
+                                out << replay_frame_times[frame][2];
+                        }
+                        out << "\n";
+                }
+                if (!out) {
+                        std::cout << "Unable to write the frame times to " << frameTimesFile << "\n";
+                }
+        }
+
+        std::cout << "Replay of " << input_recording.getDuration() << " s in " << replay_frame_times.size() << " frames"
+                  << (replayStep > 0.0f ? " (fixed steps)" : " (real time)") << "\n"
+                  << std::setw(12) << "" << std::setw(12) << "mean ms" << std::setw(12) << "median ms"
+                  << std::setw(12) << "p99 ms" << std::setw(12) << "max ms" << "\n" << std::fixed << std::setprecision(3);
+        const std::array<const char*, 3> names = {"frame", "CPU", "GPU"};
+        for (size_t column = 0; column < names.size(); column++) {
+                std::vector<float> times;
+                for (const auto& frame : replay_frame_times) {
+                        if (frame[column] >= 0.0f) {
+                                times.push_back(frame[column]);
+                        }
+                }
+                std::cout << std::setw(12) << names[column];
+                if (times.empty()) {
+                        std::cout << std::setw(12) << "n/a" << "\n";
+                        continue;
+                }
+                std::sort(times.begin(), times.end());
+                float sum = 0.0f;
+                for (float time : times) {
+                        sum += time;
+                }
+                std::cout << std::setw(12) << sum / times.size() << std::setw(12) << times[times.size() / 2]
+                          << std::setw(12) << times[std::min(times.size() - 1, times.size() * 99 / 100)]
+                          << std::setw(12) << times.back() << "\n";
+        }
+        std::cout << std::defaultfloat;
+
+}
+
+
+// Average the CPU and GPU frame times of each number of cars, then close the window
+void update_car_benchmark() {
+
+        if (is_car_benchmark_done) {
+                return;
+        }
+        if (car_benchmark_step == 0 && car_benchmark_frame == 0) {
+                std::cout << "Cars benchmark (average of " << CAR_BENCHMARK_FRAMES << " frames)\n"
+                          << std::setw(8) << "cars" << std::setw(12) << "CPU ms" << std::setw(12) << "GPU ms"
+                          << std::setw(12) << "frame ms" << std::endl;
+        }
+
+        // the frame times measured are the ones of the previous frames
+        if (car_benchmark_frame >= CAR_BENCHMARK_WARMUP_FRAMES) {
+                car_benchmark_cpu_sum += lastCpuFrameTime;
+                car_benchmark_gpu_sum += lastGpuFrameTime;
+                car_benchmark_frame_time_sum += delta_time * 1000.0f;
+        }
+        car_benchmark_frame++;
+
+        if (car_benchmark_frame == CAR_BENCHMARK_WARMUP_FRAMES + CAR_BENCHMARK_FRAMES) {
+                std::cout << std::fixed << std::setprecision(3)
+                          << std::setw(8) << car_benchmark_counts[car_benchmark_step]
+                          << std::setw(12) << car_benchmark_cpu_sum / CAR_BENCHMARK_FRAMES;
+                if (lastGpuFrameTime >= 0.0f) {
+                        std::cout << std::setw(12) << car_benchmark_gpu_sum / CAR_BENCHMARK_FRAMES;
+                } else {
+                        std::cout << std::setw(12) << "n/a";
+                }
+                std::cout << std::setw(12) << car_benchmark_frame_time_sum / CAR_BENCHMARK_FRAMES
+                          << std::defaultfloat << std::endl;
+
+                car_benchmark_frame = 0;
+                car_benchmark_cpu_sum = 0.0f;
+                car_benchmark_gpu_sum = 0.0f;
+                car_benchmark_frame_time_sum = 0.0f;
+
+                if (car_benchmark_step + 1 < car_benchmark_counts.size()) {
+                        car_benchmark_step++;
+                } else {
+                        is_car_benchmark_done = true;
+                        glfwSetWindowShouldClose(window, GLFW_TRUE);
+                }
+        }
+
+}
+
+
 // Update the uniforms (ubo and gubo)
 void updateUniformBuffer(uint32_t currentImage) {
 
-        delta_time = compute_elapsed_time();
+        // a fixed-step replay advances by the same time at every frame, whatever the frame took
+        float frame_time = compute_elapsed_time();
+        if (isReplay() && replayStep > 0.0f) {
+                delta_time = replayStep;
+        }
+        input_time += delta_time;
 
-        handle_key_presses();
+        uint32_t input = isReplay() ? input_recording.keysAt(input_time) : poll_input_keys();
+        if (isRecording()) {
+                input_recording.record(input_time, input);
+        }
+        handle_key_presses(input);
+        update_car_state();
 
         update_cubo_for_car(currentImage);
         update_gubo_for_camera(currentImage);
         update_tubo_for_terrain(currentImage);
         update_subo_for_skybox(currentImage);
 
-        compute_fps();
+        if (isCdlodTerrain) {
+                update_terrain_patches(currentImage);
+        }
+
+        if (isInstanced()) {
+                if (isBenchmarkCars) {
+                        update_car_benchmark();
+                }
+                update_car_instances(currentImage);
+        }
+
+        if (isReplay()) {
+                update_replay(frame_time);
+        }
+
+        compute_fps(frame_time);
         log_info(0.3);
 
 }